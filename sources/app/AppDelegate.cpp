@@ -2,6 +2,9 @@
 #include <extension/RuntimeSDL/SDLApplication.h>
 #include <extension/RuntimeSDL/SDLView.h>
 #include <extension/SourceFFM/FFMediaFile.h>
+#include <extension/SourceFFM/FFMemorySource.h>
+#include <extension/SourceFFM/FFPipeSource.h>
+#include <unistd.h>
 
 class PlayerAppDelegate: public SDLAppDelegate {
 public:  
@@ -12,11 +15,41 @@ public:
     // 设置日志过滤等级，一般默认为Info，但在调试场景下，可以使用Verbose来获取更完备的信息
     lms::setLogLevel(lms::LogLevelVerbose);
 
-    auto src = new FFMediaFile(argv[1]);
+    // "-"：从标准输入以低延迟模式读取，例如由录制进程通过管道输出的MPEG-TS
+    // --memory：将整个文件载入内存并循环播放，用于排除I/O的影响测量解码与渲染的吞吐量
+    lms::MediaSource *src = nullptr;
+    if (strcmp(argv[1], "-") == 0) {
+      auto pipe = new FFPipeSource(STDIN_FILENO, false);
+      pipe->setLowLatency(true);
+      src = pipe;
+    } else if (argc > 2 && strcmp(argv[2], "--memory") == 0) {
+      auto mem = new FFMemorySource(argv[1]);
+      mem->setLooping(true);
+      src = mem;
+    } else if (argc > 2) {
+      // 多个文件：组成播放列表无缝连续播放
+      auto first = new FFMediaFile(argv[1]);
+      auto playlist = new lms::PlaylistSource(first);
+      lms::release(first);
+      for (int i = 2; i < argc; ++i) {
+        auto item = new FFMediaFile(argv[i]);
+        playlist->enqueue(item);
+        lms::release(item);
+      }
+      src = playlist;
+    } else {
+      src = new FFMediaFile(argv[1]);
+    }
     auto view = new SDLView;
 
     player = new lms::Player(src, view);
-    player->play();
+    
+    // 数据源的打开与解码器的初始化都在后台完成，不会阻塞主线程的事件循环
+    player->playAsync([] (int result) {
+      if (result != 0) {
+        LMSLogError("Failed starting playback: code=%d", result);
+      }
+    });
 
     lms::release(src);
     lms::release(view);
@@ -0,0 +1,152 @@
+//
+//  ConvertBench.cpp
+//  convert_bench
+//
+//  校验PixelConvert中各指令集的转换内核与swscale（createMatchingSwsContext：SWS_BILINEAR、关闭抖动、同尺寸，
+//  与SDLView的用法一致）的输出逐字节一致，并比较两者每帧的耗时。除指定尺寸外，还会以宽高各减一的奇数尺寸校验边界的处理。存在不一致时返回1。
+//  用法: convert_bench [width height [iterations]]
+//
+
+#include <extension/RuntimeSDL/PixelConvert.h>
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+}
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+
+typedef std::chrono::steady_clock BenchClock;
+
+static double elapsedMS(BenchClock::time_point begin, int iterations) {
+  return std::chrono::duration<double, std::milli>(BenchClock::now() - begin).count() / iterations;
+}
+
+static AVFrame *createSourceFrame(AVPixelFormat format, int width, int height) {
+  AVFrame *frame = av_frame_alloc();
+  frame->format = format;
+  frame->width  = width;
+  frame->height = height;
+  av_frame_get_buffer(frame, 32);
+
+  // 随机内容覆盖所有取值；10bit格式只填充有效的10bit范围
+  bool highDepth = format == AV_PIX_FMT_YUV420P10LE;
+  for (int p = 0; p < 4 && frame->data[p]; p += 1) {
+    int rows = p == 0 ? height : (height + 1) / 2;
+    for (int y = 0; y < rows; y += 1) {
+      uint8_t *row = frame->data[p] + y * frame->linesize[p];
+      if (highDepth) {
+        for (int x = 0; x < frame->linesize[p] / 2; x += 1) {
+          ((uint16_t *)row)[x] = rand() & 0x3FF;
+        }
+      } else {
+        for (int x = 0; x < frame->linesize[p]; x += 1) {
+          row[x] = rand() & 0xFF;
+        }
+      }
+    }
+  }
+
+  return frame;
+}
+
+// 比较两个YUV420P图像的有效区域，返回不一致的字节数
+static int64_t compareYUV420P(uint8_t *const a[4], const int aLinesize[4], uint8_t *const b[4], const int bLinesize[4],
+                              int width, int height) {
+  int64_t diff = 0;
+  for (int p = 0; p < 3; p += 1) {
+    int w = p == 0 ? width  : (width + 1) / 2;
+    int h = p == 0 ? height : (height + 1) / 2;
+    for (int y = 0; y < h; y += 1) {
+      const uint8_t *ra = a[p] + y * aLinesize[p];
+      const uint8_t *rb = b[p] + y * bLinesize[p];
+      for (int x = 0; x < w; x += 1) {
+        diff += ra[x] != rb[x];
+      }
+    }
+  }
+  return diff;
+}
+
+// 返回不一致的字节总数
+static int64_t benchFormat(AVPixelFormat format, int width, int height, int iterations) {
+  AVFrame *src = createSourceFrame(format, width, height);
+
+  uint8_t *refData[4];
+  int      refLinesize[4];
+  av_image_alloc(refData, refLinesize, width, height, AV_PIX_FMT_YUV420P, 32);
+
+  SwsContext *sws = createMatchingSwsContext(width, height, format, width, height, AV_PIX_FMT_YUV420P);
+
+  auto begin = BenchClock::now();
+  for (int i = 0; i < iterations; i += 1) {
+    sws_scale(sws, (uint8_t const *const *)src->data, src->linesize, 0, height, refData, refLinesize);
+  }
+  double swsMS = elapsedMS(begin, iterations);
+
+  printf("%-12s %5dx%-5d %-8s %10.3lf %8s %10s\n", av_get_pix_fmt_name(format), width, height, "swscale", swsMS, "1.00x", "-");
+
+  int64_t mismatches = 0;
+  const PixelKernelsISA isas[] = { PixelKernelsScalar, PixelKernelsSSE2, PixelKernelsAVX2 };
+  for (auto isa : isas) {
+    const PixelKernels *kernels = getPixelKernels(isa);
+    if (kernels == nullptr) {
+      continue;
+    }
+
+    uint8_t *data[4];
+    int      linesize[4];
+    av_image_alloc(data, linesize, width, height, AV_PIX_FMT_YUV420P, 32);
+
+    begin = BenchClock::now();
+    for (int i = 0; i < iterations; i += 1) {
+      convertToYUV420P(kernels, src, data, linesize);
+    }
+    double ms = elapsedMS(begin, iterations);
+
+    int64_t diff = compareYUV420P(refData, refLinesize, data, linesize, width, height);
+    mismatches += diff;
+
+    printf("%-12s %5dx%-5d %-8s %10.3lf %7.2lfx %10lld\n", av_get_pix_fmt_name(format), width, height,
+           kernels->name, ms, swsMS / ms, (long long)diff);
+
+    av_freep(&data[0]);
+  }
+
+  sws_freeContext(sws);
+  av_freep(&refData[0]);
+  av_frame_free(&src);
+
+  return mismatches;
+}
+
+int main(int argc, char *argv[]) {
+  int width      = argc > 2 ? atoi(argv[1]) : 1920;
+  int height     = argc > 2 ? atoi(argv[2]) : 1080;
+  int iterations = argc > 3 ? atoi(argv[3]) : 100;
+
+  if (width < 2 || height < 2 || iterations < 1) {
+    fprintf(stderr, "usage: convert_bench [width height [iterations]]\n");
+    return 2;
+  }
+
+  const AVPixelFormat formats[] = {
+    AV_PIX_FMT_NV12,
+    AV_PIX_FMT_NV21,
+    AV_PIX_FMT_YUVJ420P,
+    AV_PIX_FMT_YUV420P10LE,
+  };
+
+  printf("%-12s %11s %-8s %10s %8s %10s\n", "format", "size", "impl", "ms/frame", "speedup", "mismatch");
+
+  int64_t mismatches = 0;
+  for (auto format : formats) {
+    mismatches += benchFormat(format, width, height, iterations);
+    mismatches += benchFormat(format, width - 1, height - 1, 1);
+  }
+
+  printf("%s\n", mismatches == 0 ? "all kernels match swscale" : "MISMATCH against swscale");
+  return mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,174 @@
+//
+//  DemuxBench.cpp
+//  demux_bench
+//
+//  对比FFmpeg默认文件协议与MappedFileIO两种读取方式下的解封装吞吐量与系统调用次数。
+//  用法: demux_bench <file> [rounds]
+//
+
+#include <lms/Logger.h>
+#include <extension/SourceFFM/MappedFileIO.h>
+extern "C" {
+#include <libavformat/avformat.h>
+}
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <sys/resource.h>
+
+typedef struct {
+  uint64_t syscr;      // read类系统调用次数，来自/proc/self/io，不支持的平台上为0
+  uint64_t readBytes;  // read类系统调用读取的字节数
+  long     minorFaults;
+  long     majorFaults;
+} IOCounters;
+
+static bool hasProcIO = false;
+
+static IOCounters sampleIOCounters() {
+  IOCounters c = { 0, 0, 0, 0 };
+
+  FILE *fp = fopen("/proc/self/io", "r");
+  if (fp) {
+    char key[64];
+    unsigned long long value;
+    while (fscanf(fp, "%63[^:]: %llu\n", key, &value) == 2) {
+      if (strcmp(key, "syscr") == 0) {
+        c.syscr = value;
+      } else if (strcmp(key, "rchar") == 0) {
+        c.readBytes = value;
+      }
+    }
+    fclose(fp);
+    hasProcIO = true;
+  }
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  c.minorFaults = usage.ru_minflt;
+  c.majorFaults = usage.ru_majflt;
+
+  return c;
+}
+
+typedef struct {
+  double     seconds;
+  uint64_t   packets;
+  uint64_t   payloadBytes;
+  IOCounters io;
+} DemuxResult;
+
+static bool demux(const char *path, bool mapped, DemuxResult *result) {
+  MappedFileIO    *mf  = nullptr;
+  AVFormatContext *ctx = nullptr;
+
+  IOCounters before = sampleIOCounters();
+  auto begin = std::chrono::steady_clock::now();
+
+  if (mapped) {
+    mf = MappedFileIO::open(path);
+    if (mf == nullptr) {
+      fprintf(stderr, "Failed mapping file: %s\n", path);
+      return false;
+    }
+
+    ctx = avformat_alloc_context();
+    ctx->pb     = mf->getIOContext();
+    ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+  }
+
+  if (avformat_open_input(&ctx, path, nullptr, nullptr) != 0) {
+    fprintf(stderr, "Failed opening file: %s\n", path);
+    delete mf;
+    return false;
+  }
+
+  avformat_find_stream_info(ctx, nullptr);
+
+  result->packets      = 0;
+  result->payloadBytes = 0;
+
+  AVPacket *pkt = av_packet_alloc();
+  while (av_read_frame(ctx, pkt) >= 0) {
+    result->packets      += 1;
+    result->payloadBytes += pkt->size;
+    av_packet_unref(pkt);
+  }
+  av_packet_free(&pkt);
+
+  avformat_close_input(&ctx);
+  delete mf;
+
+  auto end = std::chrono::steady_clock::now();
+  IOCounters after = sampleIOCounters();
+
+  result->seconds        = std::chrono::duration<double>(end - begin).count();
+  result->io.syscr       = after.syscr - before.syscr;
+  result->io.readBytes   = after.readBytes - before.readBytes;
+  result->io.minorFaults = after.minorFaults - before.minorFaults;
+  result->io.majorFaults = after.majorFaults - before.majorFaults;
+  return true;
+}
+
+static void report(const char *name, const DemuxResult& r, int rounds) {
+  double mb = r.payloadBytes / (1024.0 * 1024.0);
+
+  printf("%-8s %10.3lf %10.1lf %10llu ", name, r.seconds / rounds, mb / r.seconds, (unsigned long long)(r.packets / rounds));
+  if (hasProcIO) {
+    printf("%10llu %12llu ", (unsigned long long)(r.io.syscr / rounds), (unsigned long long)(r.io.readBytes / rounds));
+  } else {
+    printf("%10s %12s ", "n/a", "n/a");
+  }
+  printf("%8ld %8ld\n", r.io.minorFaults / rounds, r.io.majorFaults / rounds);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <file> [rounds]\n", argv[0]);
+    return 1;
+  }
+
+  const char *path = argv[1];
+  int rounds = argc > 2 ? std::max(atoi(argv[2]), 1) : 5;
+
+  // 基准测试不初始化SDK，只需要屏蔽MappedFileIO中的日志输出
+  lms::setLogLevel(lms::LogLevelCritical);
+  av_log_set_level(AV_LOG_ERROR);
+
+  // 先完整读取一遍，让两种方式都在页缓存已预热的条件下比较
+  DemuxResult warmup;
+  if (!demux(path, false, &warmup)) {
+    return 1;
+  }
+
+  DemuxResult total[2];
+  memset(total, 0, sizeof(total));
+
+  // 两种方式交替执行，避免系统状态的变化只影响其中一方
+  for (int i = 0; i < rounds; i += 1) {
+    for (int mapped = 0; mapped < 2; mapped += 1) {
+      DemuxResult r;
+      if (!demux(path, mapped == 1, &r)) {
+        return 1;
+      }
+
+      DemuxResult& t = total[mapped];
+      t.seconds        += r.seconds;
+      t.packets        += r.packets;
+      t.payloadBytes   += r.payloadBytes;
+      t.io.syscr       += r.io.syscr;
+      t.io.readBytes   += r.io.readBytes;
+      t.io.minorFaults += r.io.minorFaults;
+      t.io.majorFaults += r.io.majorFaults;
+    }
+  }
+
+  printf("file: %s, rounds: %d\n", path, rounds);
+  printf("%-8s %10s %10s %10s %10s %12s %8s %8s\n", "io", "sec/round", "MB/s", "packets", "syscr", "rchar", "minflt", "majflt");
+  report("file",  total[0], rounds);
+  report("mmap",  total[1], rounds);
+
+  return 0;
+}
@@ -0,0 +1,147 @@
+//
+//  EventBench.cpp
+//  event_bench
+//
+//  测量EventCenter在多个播放器同时运行时的事件分发开销。每个模拟的播放器按Player的方式注册观察者
+//  （每个流的decode_frame/update_decode_skip，以及did_update_packets），然后轮流为各个流发出decode_frame。
+//  分别测量按流订阅（sender为流对象）、订阅全部后在回调中按参数过滤、以及按流订阅并在发出线程中直接回调三种方式。
+//  "decode_frame" 是可合并的事件，同一批中尚未分发的同一个流的事件会合并，handled为实际的回调次数，merged为被合并的次数。
+//  用法: event_bench [events]
+//
+
+#include <lms/LMS.h>
+#include <lms/Events.h>
+#include <lms/Runtime.h>
+#include <lms/Metrics.h>
+#include <extension/RuntimeSDL/SDLApplication.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+typedef struct {
+  int      streamTag; // 模拟的流对象，使用其地址作为sender
+  uint64_t handled;
+} BenchStream;
+
+static void onDecodeFrameBySender(BenchStream *s, const char *name, void *sender, const lms::EventParams& p) {
+  s->handled += 1;
+}
+
+static void onDecodeFrameFiltered(BenchStream *s, const char *name, void *sender, const lms::EventParams& p) {
+  if (lms::variantsGetPointer(p, "stream_object") == &s->streamTag) {
+    s->handled += 1;
+  }
+}
+
+static void onIgnoredEvent(BenchStream *s, const char *name, void *sender, const lms::EventParams& p) {
+}
+
+typedef enum {
+  SubscribeSender   = 0, // 按流订阅，主线程回调
+  SubscribeFiltered = 1, // 订阅全部，在回调中按参数过滤
+  SubscribeInline   = 2, // 按流订阅，在发出事件的线程中直接回调
+} SubscribeMode;
+
+static const char *subscribeModeNames[] = { "sender", "filtered", "inline" };
+
+// 每批投递的事件数量，之后在主线程中同步执行完所有排队的分发
+constexpr int BatchSize = 1000;
+
+static double measure(int players, int events, SubscribeMode mode, uint64_t *handled) {
+  const int streamsPerPlayer = 2;
+
+  std::vector<BenchStream> streams(players * streamsPerPlayer);
+  std::vector<void *> observers;
+
+  for (auto& s : streams) {
+    s.handled = 0;
+    void *sender = (mode == SubscribeFiltered) ? nullptr : &s.streamTag;
+    auto onDecodeFrame = (mode == SubscribeFiltered) ? onDecodeFrameFiltered : onDecodeFrameBySender;
+    auto delivery = (mode == SubscribeInline) ? lms::EventDeliveryInline : lms::EventDeliveryHost;
+
+    observers.push_back(lms::addEventObserver("decode_frame", sender, &s, (lms::EventCallback)onDecodeFrame, delivery));
+    observers.push_back(lms::addEventObserver("update_decode_skip", sender, &s, (lms::EventCallback)onIgnoredEvent));
+    observers.push_back(lms::addEventObserver("update_decode_mode", nullptr, &s, (lms::EventCallback)onIgnoredEvent));
+  }
+
+  for (int i = 0; i < players; i += 1) {
+    observers.push_back(lms::addEventObserver("did_update_packets", nullptr, &streams[i], (lms::EventCallback)onIgnoredEvent));
+    observers.push_back(lms::addEventObserver("did_reach_milestone", nullptr, &streams[i], (lms::EventCallback)onIgnoredEvent));
+  }
+
+  auto begin = std::chrono::steady_clock::now();
+
+  for (int fired = 0; fired < events; ) {
+    int batch = std::min(BatchSize, events - fired);
+    for (int i = 0; i < batch; i += 1, fired += 1) {
+      BenchStream& s = streams[fired % streams.size()];
+      lms::fireEvent("decode_frame", &s.streamTag, {
+        { "stream_object", &s.streamTag }
+      });
+    }
+
+    // 在主线程中调用sync时会先执行所有排队的任务
+    lms::sync(lms::hostQueue(), "Drain", [] {});
+    SDL_FlushEvents(SDL_USEREVENT, SDL_LASTEVENT);
+  }
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+  *handled = 0;
+  for (auto& s : streams) {
+    *handled += s.handled;
+  }
+
+  for (auto o : observers) {
+    lms::removeEventObserver(o);
+  }
+
+  return seconds * 1e9 / events;
+}
+
+class EventBenchDelegate : public SDLAppDelegate {
+public:
+  void didFinishLaunchingApplication(int argc, char **argv) override {
+    lms::init();
+    lms::setLogLevel(lms::LogLevelCritical);
+
+    int events = argc > 1 ? std::max(atoi(argv[1]), BatchSize) : 200000;
+
+    printf("events: %d\n", events);
+    printf("%-8s %-10s %12s %10s %10s\n", "players", "subscribe", "ns/event", "handled", "merged");
+
+    const int playerCounts[] = { 1, 10, 100 };
+    for (int players : playerCounts) {
+      for (int mode = SubscribeSender; mode <= SubscribeInline; mode += 1) {
+        uint64_t handled = 0;
+        double mergedBefore = lms::getMetric("events.coalesce.decode_frame.merged").sum;
+        double ns = measure(players, events, (SubscribeMode)mode, &handled);
+        double merged = lms::getMetric("events.coalesce.decode_frame.merged").sum - mergedBefore;
+        printf("%-8d %-10s %12.1lf %10llu %10.0lf\n", players, subscribeModeNames[mode], ns, (unsigned long long)handled, merged);
+      }
+    }
+
+    SDL_Event quit;
+    SDL_zero(quit);
+    quit.type = SDL_QUIT;
+    SDL_PushEvent(&quit);
+  }
+
+  void willTerminateApplication() override {
+    lms::unInit();
+  }
+};
+
+int main(int argc, char *argv[]) {
+  // 不需要真正的窗口与音频设备
+  SDL_setenv("SDL_VIDEODRIVER", "dummy", 0);
+  SDL_setenv("SDL_AUDIODRIVER", "dummy", 0);
+
+  SDLApplication app(argc, argv);
+  EventBenchDelegate delegate;
+  app.run(&delegate);
+
+  return 0;
+}
@@ -0,0 +1,349 @@
+//
+//  PipeLatencyBench.cpp
+//  pipe_latency_bench
+//
+//  本地回环测量PipeIO的端到端延迟：写入线程把文件按实时速率重新封装为MPEG-TS写入管道（或Unix socket），
+//  读取端通过PipeIO解封装并解码视频，统计每一帧从写入到解码完成的时间。
+//  默认参数与低延迟参数各运行一次，对比首帧延迟与稳态延迟。
+//  用法: pipe_latency_bench <file> [seconds] [--socket]
+//
+
+#include <lms/Logger.h>
+#include <extension/SourceFFM/PipeIO.h>
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+}
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+// 解码帧与写入记录按pts匹配时允许的误差（微秒），用于吸收时间基转换的舍入
+constexpr int64_t MatchTolerance = 2000;
+
+static int64_t nowUS(Clock::time_point origin) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - origin).count();
+}
+
+/*
+ 写入端：按实时速率把输入文件重新封装为MPEG-TS，每个数据包写出后立即flush到fd
+ */
+class Writer {
+public:
+  Writer(const char *path, int fd, double seconds, Clock::time_point origin)
+    : path(path), fd(fd), seconds(seconds), origin(origin) {}
+
+  void run() {
+    AVFormatContext *in = nullptr;
+    if (avformat_open_input(&in, path, nullptr, nullptr) != 0 || avformat_find_stream_info(in, nullptr) < 0) {
+      fprintf(stderr, "Failed opening file: %s\n", path);
+      ::close(fd);
+      return;
+    }
+
+    AVFormatContext *out = nullptr;
+    avformat_alloc_output_context2(&out, nullptr, "mpegts", nullptr);
+
+    const int bufferSize = 4096;
+    auto buffer = (unsigned char *)av_malloc(bufferSize);
+    out->pb = avio_alloc_context(buffer, bufferSize, 1, this, writePacket, nullptr, nullptr);
+    out->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+    videoIndex = av_find_best_stream(in, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    std::vector<int> mapping(in->nb_streams, -1);
+    for (unsigned i = 0; i < in->nb_streams; i += 1) {
+      auto type = in->streams[i]->codecpar->codec_type;
+      if (type != AVMEDIA_TYPE_VIDEO && type != AVMEDIA_TYPE_AUDIO) {
+        continue;
+      }
+
+      AVStream *st = avformat_new_stream(out, nullptr);
+      avcodec_parameters_copy(st->codecpar, in->streams[i]->codecpar);
+      st->codecpar->codec_tag = 0;
+      mapping[i] = st->index;
+    }
+
+    // max_delay为0时MPEG-TS不会为时间戳附加复用延迟，读取端解出的pts与写入时一致
+    AVDictionary *opts = nullptr;
+    av_dict_set_int(&opts, "max_delay", 0, 0);
+    av_dict_set_int(&opts, "flush_packets", 1, 0);
+    avformat_write_header(out, &opts);
+    av_dict_free(&opts);
+    avio_flush(out->pb);
+
+    int64_t firstDts = AV_NOPTS_VALUE;
+    int64_t begin    = nowUS(origin);
+
+    AVPacket *pkt = av_packet_alloc();
+    while (av_read_frame(in, pkt) >= 0) {
+      int outIndex = mapping[pkt->stream_index];
+      if (outIndex < 0) {
+        av_packet_unref(pkt);
+        continue;
+      }
+
+      AVStream *ist = in->streams[pkt->stream_index];
+      AVStream *ost = out->streams[outIndex];
+
+      // 按dts实时写出
+      int64_t dts = pkt->dts != AV_NOPTS_VALUE ? av_rescale_q(pkt->dts, ist->time_base, AV_TIME_BASE_Q) : AV_NOPTS_VALUE;
+      if (dts != AV_NOPTS_VALUE) {
+        if (firstDts == AV_NOPTS_VALUE) {
+          firstDts = dts;
+        }
+
+        if (dts - firstDts > (int64_t)(seconds * AV_TIME_BASE)) {
+          av_packet_unref(pkt);
+          break;
+        }
+
+        int64_t wait = begin + (dts - firstDts) - nowUS(origin);
+        if (wait > 0) {
+          std::this_thread::sleep_for(std::chrono::microseconds(wait));
+        }
+      }
+
+      bool isVideo = pkt->stream_index == videoIndex;
+      av_packet_rescale_ts(pkt, ist->time_base, ost->time_base);
+      pkt->stream_index = outIndex;
+
+      int64_t pts = pkt->pts != AV_NOPTS_VALUE ? av_rescale_q(pkt->pts, ost->time_base, AV_TIME_BASE_Q) : AV_NOPTS_VALUE;
+      if (isVideo && pts != AV_NOPTS_VALUE) {
+        std::lock_guard<std::mutex> lock(mutex);
+        writeTimes[pts] = nowUS(origin);
+      }
+
+      av_write_frame(out, pkt);
+      avio_flush(out->pb);
+      av_packet_unref(pkt);
+    }
+    av_packet_free(&pkt);
+
+    av_write_trailer(out);
+    avio_flush(out->pb);
+
+    av_freep(&out->pb->buffer);
+    avio_context_free(&out->pb);
+    avformat_free_context(out);
+    avformat_close_input(&in);
+
+    // 关闭写入端，读取端随之读到结尾
+    ::close(fd);
+  }
+
+  // 查找与pts匹配的写入时间，找不到时返回-1
+  int64_t findWriteTime(int64_t pts) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto it = writeTimes.lower_bound(pts - MatchTolerance);
+    if (it == writeTimes.end() || it->first > pts + MatchTolerance) {
+      return -1;
+    }
+    return it->second;
+  }
+
+private:
+  static int writePacket(void *opaque, uint8_t *buf, int size) {
+    auto self = (Writer *)opaque;
+
+    int written = 0;
+    while (written < size) {
+      ssize_t n = ::write(self->fd, buf + written, size - written);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0) {
+        return AVERROR(errno);
+      }
+      written += (int)n;
+    }
+    return written;
+  }
+
+  const char *path;
+  int         fd;
+  double      seconds;
+  int         videoIndex;
+  Clock::time_point origin;
+
+  std::mutex mutex;
+  std::map<int64_t, int64_t> writeTimes; // 视频数据包的pts -> 写出时间（微秒）
+};
+
+typedef struct {
+  double   openMS;       // 从开始写入到探测完成
+  double   firstFrameMS; // 从开始写入到首帧解码完成
+  uint64_t frames;
+  std::vector<double> latencies; // 每一帧从写入到解码完成的时间（毫秒）
+  size_t   peakBuffered;
+} LatencyResult;
+
+static bool measure(const char *path, double seconds, bool useSocket, bool lowLatency, LatencyResult *result) {
+  int fds[2];
+  int rt = useSocket ? socketpair(AF_UNIX, SOCK_STREAM, 0, fds) : pipe(fds);
+  if (rt != 0) {
+    fprintf(stderr, "Failed creating %s: errno=%d\n", useSocket ? "socketpair" : "pipe", errno);
+    return false;
+  }
+
+  Clock::time_point origin = Clock::now();
+  Writer writer(path, fds[1], seconds, origin);
+  std::thread writerThread([&writer] { writer.run(); });
+
+  PipeIO *pio = PipeIO::open(fds[0], true, lowLatency ? PipeIOConfigLowLatency : PipeIOConfigDefault);
+
+  // 与FFPipeSource的低延迟模式使用相同的探测参数
+  AVFormatContext *ctx = avformat_alloc_context();
+  ctx->pb     = pio->getIOContext();
+  ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+  AVDictionary *opts = nullptr;
+  if (lowLatency) {
+    av_dict_set_int(&opts, "probesize", 32 * 1024, 0);
+    av_dict_set_int(&opts, "analyzeduration", 50 * 1000, 0);
+    av_dict_set_int(&opts, "fpsprobesize", 0, 0);
+  }
+
+  bool opened = avformat_open_input(&ctx, "pipe:", nullptr, &opts) == 0;
+  av_dict_free(&opts);
+  bool ok = opened && avformat_find_stream_info(ctx, nullptr) >= 0;
+
+  int videoIndex = ok ? av_find_best_stream(ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0) : -1;
+  if (videoIndex < 0) {
+    fprintf(stderr, "Failed probing pipe input\n");
+    if (opened) {
+      avformat_close_input(&ctx);
+    }
+
+    // 关闭读取端，阻塞在写入中的写入线程随之出错返回
+    delete pio;
+    writerThread.join();
+    return false;
+  }
+
+  result->openMS       = nowUS(origin) / 1000.0;
+  result->firstFrameMS = -1;
+  result->frames       = 0;
+  result->latencies.clear();
+
+  AVStream       *st    = ctx->streams[videoIndex];
+  const AVCodec  *codec = avcodec_find_decoder(st->codecpar->codec_id);
+  AVCodecContext *dec   = avcodec_alloc_context3(codec);
+  avcodec_parameters_to_context(dec, st->codecpar);
+  avcodec_open2(dec, codec, nullptr);
+
+  AVPacket *pkt   = av_packet_alloc();
+  AVFrame  *frame = av_frame_alloc();
+
+  auto drain = [&] {
+    while (avcodec_receive_frame(dec, frame) >= 0) {
+      int64_t now = nowUS(origin);
+      if (result->firstFrameMS < 0) {
+        result->firstFrameMS = now / 1000.0;
+      }
+
+      int64_t ts = frame->best_effort_timestamp;
+      if (ts != AV_NOPTS_VALUE) {
+        int64_t written = writer.findWriteTime(av_rescale_q(ts, st->time_base, AV_TIME_BASE_Q));
+        if (written >= 0) {
+          result->latencies.push_back((now - written) / 1000.0);
+        }
+      }
+
+      result->frames += 1;
+      av_frame_unref(frame);
+    }
+  };
+
+  while (av_read_frame(ctx, pkt) >= 0) {
+    if (pkt->stream_index == videoIndex) {
+      avcodec_send_packet(dec, pkt);
+      drain();
+    }
+    av_packet_unref(pkt);
+  }
+
+  avcodec_send_packet(dec, nullptr);
+  drain();
+
+  writerThread.join();
+
+  result->peakBuffered = pio->getPeakBuffered();
+
+  av_frame_free(&frame);
+  av_packet_free(&pkt);
+  avcodec_free_context(&dec);
+  avformat_close_input(&ctx);
+  delete pio;
+  return true;
+}
+
+static double percentile(std::vector<double> values, double p) {
+  if (values.empty()) {
+    return 0;
+  }
+
+  std::sort(values.begin(), values.end());
+  size_t index = std::min(values.size() - 1, (size_t)(p * (values.size() - 1) + 0.5));
+  return values[index];
+}
+
+static void report(const char *name, const LatencyResult& r) {
+  double maxLatency = r.latencies.empty() ? 0 : *std::max_element(r.latencies.begin(), r.latencies.end());
+
+  printf("%-12s %10.1lf %12.1lf %8llu %10.2lf %10.2lf %10.2lf %12zu\n",
+         name, r.openMS, r.firstFrameMS, (unsigned long long)r.frames,
+         percentile(r.latencies, 0.5), percentile(r.latencies, 0.95), maxLatency, r.peakBuffered);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <file> [seconds] [--socket]\n", argv[0]);
+    return 1;
+  }
+
+  const char *path      = argv[1];
+  double      seconds   = 10;
+  bool        useSocket = false;
+  for (int i = 2; i < argc; i += 1) {
+    if (strcmp(argv[i], "--socket") == 0) {
+      useSocket = true;
+    } else {
+      seconds = std::max(atof(argv[i]), 1.0);
+    }
+  }
+
+  // 读取端提前关闭时，写入端应得到EPIPE而不是被信号终止
+  signal(SIGPIPE, SIG_IGN);
+
+  lms::setLogLevel(lms::LogLevelCritical);
+  av_log_set_level(AV_LOG_ERROR);
+
+  LatencyResult results[2];
+  for (int lowLatency = 0; lowLatency < 2; lowLatency += 1) {
+    if (!measure(path, seconds, useSocket, lowLatency == 1, &results[lowLatency])) {
+      return 1;
+    }
+  }
+
+  printf("file: %s, seconds: %.0lf, transport: %s\n", path, seconds, useSocket ? "unix socket" : "pipe");
+  printf("%-12s %10s %12s %8s %10s %10s %10s %12s\n",
+         "mode", "open(ms)", "first(ms)", "frames", "p50(ms)", "p95(ms)", "max(ms)", "peak_bytes");
+  report("default",     results[0]);
+  report("low-latency", results[1]);
+
+  return 0;
+}
@@ -0,0 +1,392 @@
+#include "PixelConvert.h"
+#include <lms/Logger.h>
+extern "C" {
+#include <libavutil/opt.h>
+#include <SDL2/SDL.h>
+}
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define LMS_PIXEL_KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+// AVX2的实现不要求整个模块以-mavx2编译，在运行时确认CPU支持后才会调用
+#if defined(LMS_PIXEL_KERNELS_X86) && (defined(__GNUC__) || defined(__clang__))
+#define LMS_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define LMS_TARGET_AVX2
+#endif
+
+// swscale中全范围转换为有限范围的定点参数：亮度与色度先左移7位为15bit的中间值，
+// 乘加后分别右移14、11位，最后加上64的舍入值右移7位输出8bit（lumRangeFromJpeg / chrRangeFromJpeg）
+constexpr int RangeLumaMul   = 14071;
+constexpr int RangeLumaAdd   = 33561947;
+constexpr int RangeLumaShift = 14;
+
+constexpr int RangeChromaMul   = 1799;
+constexpr int RangeChromaAdd   = 4081085;
+constexpr int RangeChromaShift = 11;
+
+static inline uint8_t _range_convert(uint8_t v, int mul, int add, int shift) {
+  int t = ((v << 7) * mul + add) >> shift;
+  int o = (t + 64) >> 7;
+  return (uint8_t)(o < 0 ? 0 : (o > 255 ? 255 : o));
+}
+
+// --- scalar
+
+static void deinterleave_scalar(const uint8_t *src, uint8_t *dstA, uint8_t *dstB, int n) {
+  for (int i = 0; i < n; i += 1) {
+    dstA[i] = src[2 * i];
+    dstB[i] = src[2 * i + 1];
+  }
+}
+
+// 与swscale关闭抖动时的取整一致：加上0.5后右移2位，1022、1023进位得到的256回退为255。
+// 中间值按16bit计算，超出10bit范围的样本在各指令集的实现中结果也相同
+static inline uint8_t _shift10(uint16_t v) {
+  unsigned t = (uint16_t)(v + 2) >> 2;
+  return (uint8_t)(t - (t >> 8));
+}
+
+static void shift10_scalar(const uint16_t *src, uint8_t *dst, int n) {
+  for (int i = 0; i < n; i += 1) {
+    dst[i] = _shift10(src[i]);
+  }
+}
+
+static void rangeLuma_scalar(const uint8_t *src, uint8_t *dst, int n) {
+  for (int i = 0; i < n; i += 1) {
+    dst[i] = _range_convert(src[i], RangeLumaMul, RangeLumaAdd, RangeLumaShift);
+  }
+}
+
+static void rangeChroma_scalar(const uint8_t *src, uint8_t *dst, int n) {
+  for (int i = 0; i < n; i += 1) {
+    dst[i] = _range_convert(src[i], RangeChromaMul, RangeChromaAdd, RangeChromaShift);
+  }
+}
+
+static const PixelKernels _kernelsScalar = {
+  "scalar",
+  deinterleave_scalar,
+  shift10_scalar,
+  rangeLuma_scalar,
+  rangeChroma_scalar,
+};
+
+#ifdef LMS_PIXEL_KERNELS_X86
+
+// --- SSE2，每次处理16个像素，剩余部分交给标量实现
+
+static void deinterleave_sse2(const uint8_t *src, uint8_t *dstA, uint8_t *dstB, int n) {
+  const __m128i mask = _mm_set1_epi16(0x00FF);
+
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i x0 = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+    __m128i x1 = _mm_loadu_si128((const __m128i *)(src + 2 * i + 16));
+
+    __m128i a = _mm_packus_epi16(_mm_and_si128(x0, mask), _mm_and_si128(x1, mask));
+    __m128i b = _mm_packus_epi16(_mm_srli_epi16(x0, 8), _mm_srli_epi16(x1, 8));
+
+    _mm_storeu_si128((__m128i *)(dstA + i), a);
+    _mm_storeu_si128((__m128i *)(dstB + i), b);
+  }
+
+  deinterleave_scalar(src + 2 * i, dstA + i, dstB + i, n - i);
+}
+
+static void shift10_sse2(const uint16_t *src, uint8_t *dst, int n) {
+  const __m128i half = _mm_set1_epi16(2);
+  const __m128i mask = _mm_set1_epi16(0x00FF);
+
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i x0 = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i x1 = _mm_loadu_si128((const __m128i *)(src + i + 8));
+
+    x0 = _mm_srli_epi16(_mm_add_epi16(x0, half), 2);
+    x1 = _mm_srli_epi16(_mm_add_epi16(x1, half), 2);
+    x0 = _mm_and_si128(_mm_sub_epi16(x0, _mm_srli_epi16(x0, 8)), mask);
+    x1 = _mm_and_si128(_mm_sub_epi16(x1, _mm_srli_epi16(x1, 8)), mask);
+
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(x0, x1));
+  }
+
+  shift10_scalar(src + i, dst + i, n - i);
+}
+
+// 8个16bit的样本x（0~255）按 ((x << 7) * Mul + Add) >> Shift 计算，再加64右移7位
+template<int Mul, int Add, int Shift>
+static inline __m128i _range_convert_sse2(__m128i x) {
+  x = _mm_slli_epi16(x, 7);
+
+  const __m128i mul = _mm_set1_epi16(Mul);
+  __m128i lo = _mm_mullo_epi16(x, mul);
+  __m128i hi = _mm_mulhi_epi16(x, mul);
+
+  const __m128i add = _mm_set1_epi32(Add);
+  __m128i p0 = _mm_srai_epi32(_mm_add_epi32(_mm_unpacklo_epi16(lo, hi), add), Shift);
+  __m128i p1 = _mm_srai_epi32(_mm_add_epi32(_mm_unpackhi_epi16(lo, hi), add), Shift);
+
+  __m128i t = _mm_packs_epi32(p0, p1);
+  return _mm_srai_epi16(_mm_add_epi16(t, _mm_set1_epi16(64)), 7);
+}
+
+template<int Mul, int Add, int Shift>
+static void _range_row_sse2(const uint8_t *src, uint8_t *dst, int n) {
+  const __m128i zero = _mm_setzero_si128();
+
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+
+    __m128i a = _range_convert_sse2<Mul, Add, Shift>(_mm_unpacklo_epi8(x, zero));
+    __m128i b = _range_convert_sse2<Mul, Add, Shift>(_mm_unpackhi_epi8(x, zero));
+
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(a, b));
+  }
+
+  for (; i < n; i += 1) {
+    dst[i] = _range_convert(src[i], Mul, Add, Shift);
+  }
+}
+
+static void rangeLuma_sse2(const uint8_t *src, uint8_t *dst, int n) {
+  _range_row_sse2<RangeLumaMul, RangeLumaAdd, RangeLumaShift>(src, dst, n);
+}
+
+static void rangeChroma_sse2(const uint8_t *src, uint8_t *dst, int n) {
+  _range_row_sse2<RangeChromaMul, RangeChromaAdd, RangeChromaShift>(src, dst, n);
+}
+
+static const PixelKernels _kernelsSSE2 = {
+  "sse2",
+  deinterleave_sse2,
+  shift10_sse2,
+  rangeLuma_sse2,
+  rangeChroma_sse2,
+};
+
+// --- AVX2，每次处理32个像素。256bit的pack指令按128bit分别进行，结果需要重新排列
+
+LMS_TARGET_AVX2
+static void deinterleave_avx2(const uint8_t *src, uint8_t *dstA, uint8_t *dstB, int n) {
+  const __m256i mask = _mm256_set1_epi16(0x00FF);
+
+  int i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i x0 = _mm256_loadu_si256((const __m256i *)(src + 2 * i));
+    __m256i x1 = _mm256_loadu_si256((const __m256i *)(src + 2 * i + 32));
+
+    __m256i a = _mm256_packus_epi16(_mm256_and_si256(x0, mask), _mm256_and_si256(x1, mask));
+    __m256i b = _mm256_packus_epi16(_mm256_srli_epi16(x0, 8), _mm256_srli_epi16(x1, 8));
+
+    _mm256_storeu_si256((__m256i *)(dstA + i), _mm256_permute4x64_epi64(a, 0xD8));
+    _mm256_storeu_si256((__m256i *)(dstB + i), _mm256_permute4x64_epi64(b, 0xD8));
+  }
+
+  deinterleave_sse2(src + 2 * i, dstA + i, dstB + i, n - i);
+}
+
+LMS_TARGET_AVX2
+static void shift10_avx2(const uint16_t *src, uint8_t *dst, int n) {
+  const __m256i half = _mm256_set1_epi16(2);
+  const __m256i mask = _mm256_set1_epi16(0x00FF);
+
+  int i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i x0 = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i x1 = _mm256_loadu_si256((const __m256i *)(src + i + 16));
+
+    x0 = _mm256_srli_epi16(_mm256_add_epi16(x0, half), 2);
+    x1 = _mm256_srli_epi16(_mm256_add_epi16(x1, half), 2);
+    x0 = _mm256_and_si256(_mm256_sub_epi16(x0, _mm256_srli_epi16(x0, 8)), mask);
+    x1 = _mm256_and_si256(_mm256_sub_epi16(x1, _mm256_srli_epi16(x1, 8)), mask);
+
+    __m256i packed = _mm256_packus_epi16(x0, x1);
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_permute4x64_epi64(packed, 0xD8));
+  }
+
+  shift10_sse2(src + i, dst + i, n - i);
+}
+
+template<int Mul, int Add, int Shift>
+LMS_TARGET_AVX2
+static inline __m256i _range_convert_avx2(__m256i x) {
+  x = _mm256_slli_epi16(x, 7);
+
+  const __m256i mul = _mm256_set1_epi16(Mul);
+  __m256i lo = _mm256_mullo_epi16(x, mul);
+  __m256i hi = _mm256_mulhi_epi16(x, mul);
+
+  // unpack与packs都按128bit分别进行，两者互逆，样本的顺序保持不变
+  const __m256i add = _mm256_set1_epi32(Add);
+  __m256i p0 = _mm256_srai_epi32(_mm256_add_epi32(_mm256_unpacklo_epi16(lo, hi), add), Shift);
+  __m256i p1 = _mm256_srai_epi32(_mm256_add_epi32(_mm256_unpackhi_epi16(lo, hi), add), Shift);
+
+  __m256i t = _mm256_packs_epi32(p0, p1);
+  return _mm256_srai_epi16(_mm256_add_epi16(t, _mm256_set1_epi16(64)), 7);
+}
+
+template<int Mul, int Add, int Shift>
+LMS_TARGET_AVX2
+static void _range_row_avx2(const uint8_t *src, uint8_t *dst, int n) {
+  int i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(src + i)));
+    __m256i b = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(src + i + 16)));
+
+    a = _range_convert_avx2<Mul, Add, Shift>(a);
+    b = _range_convert_avx2<Mul, Add, Shift>(b);
+
+    __m256i packed = _mm256_packus_epi16(a, b);
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_permute4x64_epi64(packed, 0xD8));
+  }
+
+  _range_row_sse2<Mul, Add, Shift>(src + i, dst + i, n - i);
+}
+
+LMS_TARGET_AVX2
+static void rangeLuma_avx2(const uint8_t *src, uint8_t *dst, int n) {
+  _range_row_avx2<RangeLumaMul, RangeLumaAdd, RangeLumaShift>(src, dst, n);
+}
+
+LMS_TARGET_AVX2
+static void rangeChroma_avx2(const uint8_t *src, uint8_t *dst, int n) {
+  _range_row_avx2<RangeChromaMul, RangeChromaAdd, RangeChromaShift>(src, dst, n);
+}
+
+static const PixelKernels _kernelsAVX2 = {
+  "avx2",
+  deinterleave_avx2,
+  shift10_avx2,
+  rangeLuma_avx2,
+  rangeChroma_avx2,
+};
+
+#endif // LMS_PIXEL_KERNELS_X86
+
+const PixelKernels *getPixelKernels(PixelKernelsISA isa) {
+  switch (isa) {
+    case PixelKernelsScalar:
+      return &_kernelsScalar;
+#ifdef LMS_PIXEL_KERNELS_X86
+    case PixelKernelsSSE2:
+      return SDL_HasSSE2() ? &_kernelsSSE2 : nullptr;
+    case PixelKernelsAVX2:
+      return SDL_HasAVX2() ? &_kernelsAVX2 : nullptr;
+#endif
+    default:
+      return nullptr;
+  }
+}
+
+const PixelKernels *bestPixelKernels() {
+  static const PixelKernels *best = nullptr;
+
+  if (best == nullptr) {
+    const PixelKernels *k = getPixelKernels(PixelKernelsAVX2);
+    if (k == nullptr) {
+      k = getPixelKernels(PixelKernelsSSE2);
+    }
+    if (k == nullptr) {
+      k = getPixelKernels(PixelKernelsScalar);
+    }
+
+    LMSLogInfo("Pixel kernels selected: %s", k->name);
+    best = k;
+  }
+
+  return best;
+}
+
+SwsContext *createMatchingSwsContext(int srcWidth, int srcHeight, int srcFormat, int dstWidth, int dstHeight, int dstFormat) {
+  SwsContext *ctx = sws_alloc_context();
+  if (ctx == nullptr) {
+    return nullptr;
+  }
+
+  av_opt_set_int(ctx, "srcw",       srcWidth,  0);
+  av_opt_set_int(ctx, "srch",       srcHeight, 0);
+  av_opt_set_int(ctx, "src_format", srcFormat, 0);
+  av_opt_set_int(ctx, "dstw",       dstWidth,  0);
+  av_opt_set_int(ctx, "dsth",       dstHeight, 0);
+  av_opt_set_int(ctx, "dst_format", dstFormat, 0);
+  av_opt_set_int(ctx, "sws_flags",  SWS_BILINEAR, 0);
+  av_opt_set(ctx, "sws_dither", "none", 0);
+
+  if (sws_init_context(ctx, NULL, NULL) < 0) {
+    sws_freeContext(ctx);
+    return nullptr;
+  }
+  return ctx;
+}
+
+bool canConvertToYUV420P(int format) {
+  return format == AV_PIX_FMT_NV12
+      || format == AV_PIX_FMT_NV21
+      || format == AV_PIX_FMT_YUVJ420P
+      || format == AV_PIX_FMT_YUV420P10LE;
+}
+
+bool convertToYUV420P(const PixelKernels *k, const AVFrame *src, uint8_t *const dst[3], const int dstLinesize[3]) {
+  return convertRowsToYUV420P(k, src, dst, dstLinesize, 0, src->height);
+}
+
+bool convertRowsToYUV420P(const PixelKernels *k, const AVFrame *src, uint8_t *const dst[3], const int dstLinesize[3],
+                          int rowBegin, int rowEnd) {
+  assert(rowBegin % 2 == 0);
+
+  const int width   = src->width;
+  const int cwidth  = (width + 1) >> 1;
+  const int cbegin  = rowBegin >> 1;
+  const int cend    = (rowEnd + 1) >> 1;
+
+  switch (src->format) {
+    case AV_PIX_FMT_NV12:
+    case AV_PIX_FMT_NV21: {
+      for (int y = rowBegin; y < rowEnd; y += 1) {
+        memcpy(dst[0] + y * dstLinesize[0], src->data[0] + y * src->linesize[0], width);
+      }
+
+      // NV21的色度平面按VU的顺序交错
+      bool swapped = src->format == AV_PIX_FMT_NV21;
+      for (int y = cbegin; y < cend; y += 1) {
+        uint8_t *u = dst[1] + y * dstLinesize[1];
+        uint8_t *v = dst[2] + y * dstLinesize[2];
+        k->deinterleave(src->data[1] + y * src->linesize[1], swapped ? v : u, swapped ? u : v, cwidth);
+      }
+      return true;
+    }
+
+    case AV_PIX_FMT_YUVJ420P: {
+      for (int y = rowBegin; y < rowEnd; y += 1) {
+        k->rangeLuma(src->data[0] + y * src->linesize[0], dst[0] + y * dstLinesize[0], width);
+      }
+      for (int p = 1; p <= 2; p += 1) {
+        for (int y = cbegin; y < cend; y += 1) {
+          k->rangeChroma(src->data[p] + y * src->linesize[p], dst[p] + y * dstLinesize[p], cwidth);
+        }
+      }
+      return true;
+    }
+
+    case AV_PIX_FMT_YUV420P10LE: {
+      for (int p = 0; p <= 2; p += 1) {
+        int w     = p == 0 ? width    : cwidth;
+        int begin = p == 0 ? rowBegin : cbegin;
+        int end   = p == 0 ? rowEnd   : cend;
+        for (int y = begin; y < end; y += 1) {
+          k->shift10((const uint16_t *)(src->data[p] + y * src->linesize[p]), dst[p] + y * dstLinesize[p], w);
+        }
+      }
+      return true;
+    }
+
+    default:
+      return false;
+  }
+}
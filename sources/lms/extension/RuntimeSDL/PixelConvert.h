@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdint.h>
+extern "C" {
+#include <libavutil/frame.h>
+#include <libswscale/swscale.h>
+}
+
+/*
+ @struct PixelKernels
+ 同尺寸像素格式转换的行内核，每个函数处理一行中的n个像素（或色度样本）。
+ 各指令集的实现与createMatchingSwsContext创建的swscale上下文（同尺寸）的输出逐字节一致
+
+ @discussion
+ deinterleave: 将交错的两个分量（NV12的UV）拆分到两个平面
+ shift10     : 10bit小端样本转换为8bit（四舍五入，与swscale关闭抖动时一致）
+ rangeLuma   : 全范围（JPEG）亮度转换为有限范围
+ rangeChroma : 全范围（JPEG）色度转换为有限范围
+ */
+typedef struct {
+  const char *name;
+  void (*deinterleave)(const uint8_t *src, uint8_t *dstA, uint8_t *dstB, int n);
+  void (*shift10)(const uint16_t *src, uint8_t *dst, int n);
+  void (*rangeLuma)(const uint8_t *src, uint8_t *dst, int n);
+  void (*rangeChroma)(const uint8_t *src, uint8_t *dst, int n);
+} PixelKernels;
+
+typedef enum {
+  PixelKernelsScalar = 0,
+  PixelKernelsSSE2   = 1,
+  PixelKernelsAVX2   = 2,
+} PixelKernelsISA;
+
+/*
+ @function getPixelKernels
+ 取得指定指令集的实现，当前CPU或编译目标不支持时返回nullptr
+ */
+const PixelKernels *getPixelKernels(PixelKernelsISA isa);
+
+// 根据运行时检测到的CPU特性选择最快的实现，结果会被缓存
+const PixelKernels *bestPixelKernels();
+
+/*
+ @function createMatchingSwsContext
+ 创建与转换内核输出一致的swscale上下文：SWS_BILINEAR，并关闭抖动（sws_dither=none）。
+ swscale默认会在高位深转换为8bit时加入有序抖动，无法与逐像素的转换内核保持一致。失败时返回nullptr
+
+ @discussion
+ 不使用转换内核的格式与尺寸也通过这里创建上下文，使同一路流在两种转换路径之间切换时画面一致
+ */
+SwsContext *createMatchingSwsContext(int srcWidth, int srcHeight, int srcFormat, int dstWidth, int dstHeight, int dstFormat);
+
+/*
+ @function canConvertToYUV420P
+ 是否可以不经过swscale直接转换为YUV420P，目前支持NV12、NV21、YUVJ420P与YUV420P10LE
+ */
+bool canConvertToYUV420P(int format);
+
+/*
+ @function convertToYUV420P
+ 将src转换为同尺寸的YUV420P，写入dst的三个平面。格式不支持时返回false
+ */
+bool convertToYUV420P(const PixelKernels *kernels, const AVFrame *src, uint8_t *const dst[3], const int dstLinesize[3]);
+
+/*
+ @function convertRowsToYUV420P
+ 只转换亮度行[rowBegin, rowEnd)及其对应的色度行，rowBegin需要是偶数，以便各段的色度行互不重叠。
+ 不同的行区间可以在多个线程中同时转换
+ */
+bool convertRowsToYUV420P(const PixelKernels *kernels, const AVFrame *src, uint8_t *const dst[3], const int dstLinesize[3],
+                          int rowBegin, int rowEnd);
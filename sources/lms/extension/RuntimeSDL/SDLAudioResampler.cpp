@@ -7,6 +7,7 @@
 
 #include <lms/Foundation.h>
 #include <lms/Cell.h>
+#include <lms/Logger.h>
 extern "C" {
   #include <libavcodec/avcodec.h>
   #include "libavutil/avutil.h"
@@ -24,6 +25,11 @@ class SDLAudioResampler: public lms::Cell {
   int out_channel_layout;
   int out_sample_rate;
   AVSampleFormat out_sample_format;
+  
+  // 当前重采样器的输入参数
+  int64_t in_channel_layout;
+  int     in_sample_rate;
+  int     in_sample_format;
 
 public:
   SDLAudioResampler(AVStream *stream) {
@@ -31,27 +37,38 @@ public:
     this->out_sample_format  = AV_SAMPLE_FMT_S16;
     this->out_sample_rate    = stream->codecpar->sample_rate;
     this->out_channel_layout = stream->codecpar->channel_layout;
+    this->context = nullptr;
 
-    this->context = swr_alloc();
-    int64_t in_channel_layout  = stream->codecpar->channel_layout;
-    int in_nb_channels = stream->codecpar->channels;
-    int in_nb_samples = 0;
-       
+    setupContext(stream->codecpar->channel_layout, stream->codecpar->channels,
+                 stream->codecpar->sample_rate, stream->codecpar->format);
+  }
+  
+  /*
+   以新的输入参数重新创建重采样器，输出参数（即音频设备的参数）保持不变。
+   播放列表切换到采样率、声道等不同的下一个条目时，音频设备因此无需重新打开
+   */
+  void setupContext(int64_t channel_layout, int nb_channels, int sample_rate, int sample_format) {
     // get input audio channels
-    bool channels_matches_layout = (in_nb_channels == av_get_channel_layout_nb_channels(in_channel_layout));
+    bool channels_matches_layout = (nb_channels == av_get_channel_layout_nb_channels(channel_layout));
     if (!channels_matches_layout) {
-      in_channel_layout = av_get_default_channel_layout(in_nb_channels);
+      channel_layout = av_get_default_channel_layout(nb_channels);
     }
     
-    int ret = 0;
+    this->in_channel_layout = channel_layout;
+    this->in_sample_rate    = sample_rate;
+    this->in_sample_format  = sample_format;
+    
+    swr_free(&this->context);
+    this->context = swr_alloc();
+    
     setOption("in_channel_layout",  in_channel_layout);
-    setOption("in_sample_rate",     stream->codecpar->sample_rate);
-    setOption("in_sample_fmt",      stream->codecpar->format);
+    setOption("in_sample_rate",     in_sample_rate);
+    setOption("in_sample_fmt",      in_sample_format);
     setOption("out_channel_layout", out_channel_layout);
     setOption("out_sample_rate",    out_sample_rate);
     setOption("out_sample_fmt",     out_sample_format);
 
-    ret = swr_init(context);
+    swr_init(context);
   }
 
   ~SDLAudioResampler() {
@@ -67,7 +84,21 @@ public:
   void stop() override {}
   
   void didReceivePipelineMessage(const lms::PipelineMessage& msg) override {
+    // seek之后丢弃重采样器内部缓存的样本，并将flush继续传递给下游
+    if (strcmp(lms::variantsGetCString(msg, "type", ""), "flush") == 0) {
+      swr_init(context);
+      deliverPipelineMessage(msg);
+      return;
+    }
+    
     auto avfrm = (AVFrame *)msg.at("frame").value.ptr;
+    
+    int64_t frame_layout = avfrm->channel_layout ? avfrm->channel_layout : av_get_default_channel_layout(avfrm->channels);
+    if (frame_layout != in_channel_layout || avfrm->sample_rate != in_sample_rate || avfrm->format != in_sample_format) {
+      LMSLogInfo("Resampler input changed: rate=%d, channels=%d, format=%d", avfrm->sample_rate, avfrm->channels, avfrm->format);
+      setupContext(frame_layout, avfrm->channels, avfrm->sample_rate, avfrm->format);
+    }
+    
     int out_linesize = 0;
     uint8_t **resampled_data = NULL;
     int resampled_data_size = 0;
@@ -123,8 +154,9 @@ public:
     frame_resampled->sample_rate = out_sample_rate;
 
     lms::PipelineMessage frmMsg;
-    frmMsg["type"]  = "media_frame";
-    frmMsg["frame"] = frame_resampled;
+    frmMsg["type"]   = "media_frame";
+    frmMsg["frame"]  = frame_resampled;
+    frmMsg["serial"] = lms::variantsGetUInt(msg, "serial");
     deliverPipelineMessage(frmMsg);
 
     av_freep(&resampled_data[0]);
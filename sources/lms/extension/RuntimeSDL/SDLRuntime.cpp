@@ -4,6 +4,7 @@
 extern "C" {
 #include <SDL2/SDL.h>
 }
+#include <algorithm>
 #include <cmath>
 
 static Uint32 RunnableEvent;
@@ -299,14 +300,25 @@ public:
   SDL_Thread    *thread;
   std::atomic<bool> shouldQuit;
 
+  // 以下字段只用于按截止时间运行的定时器
+  std::function<double()> deadlineAction;
+  SDL_mutex *mutex;
+  SDL_cond  *cond;
+  bool       woken;
+
   SDLTimer(const char *name, double interval, lms::Runnable *r) {
     this->name       = strdup(name);
     this->shouldQuit = false;
     this->interval   = interval;
     this->runnable   = retain(r);
+    this->mutex      = SDL_CreateMutex();
+    this->cond       = SDL_CreateCond();
+    this->woken      = false;
   }
   
   ~SDLTimer() {
+    SDL_DestroyCond(cond);
+    SDL_DestroyMutex(mutex);
     release(runnable);
     free((void *)name);
   }
@@ -349,6 +361,76 @@ static int runtimeTimerThread_SDL(SDLTimer *timer) {
   LMSLogDebug("Timer stop: name=%s", timer->name);
 }
 
+// 截止时间之前多久改为短暂睡眠：条件变量的超时等待通常会比预期晚醒来1~2ms
+constexpr double DeadlineSpinSeconds = 0.002;
+
+static int runtimeDeadlineTimerThread_SDL(SDLTimer *timer) {
+  LMSLogDebug("Deadline timer start: name=%s", timer->name);
+  
+  const double frequency = (double)SDL_GetPerformanceFrequency();
+  
+  while(!timer->shouldQuit) {
+    double wait = timer->deadlineAction();
+    Uint64 deadline = SDL_GetPerformanceCounter() + (Uint64)(std::max(wait, 0.0) * frequency);
+    
+    SDL_LockMutex(timer->mutex);
+    {
+      while (!timer->woken && !timer->shouldQuit) {
+        if (wait < 0) {
+          SDL_CondWait(timer->cond, timer->mutex);
+          continue;
+        }
+        
+        Uint64 now = SDL_GetPerformanceCounter();
+        if (now >= deadline) {
+          break;
+        }
+        
+        double remain = (deadline - now) / frequency;
+        if (remain > DeadlineSpinSeconds) {
+          SDL_CondWaitTimeout(timer->cond, timer->mutex, (Uint32)((remain - DeadlineSpinSeconds) * 1000));
+        } else {
+          SDL_UnlockMutex(timer->mutex);
+          SDL_Delay(remain > 0.001 ? 1 : 0);
+          SDL_LockMutex(timer->mutex);
+        }
+      }
+      timer->woken = false;
+    }
+    SDL_UnlockMutex(timer->mutex);
+  }
+  
+  LMSLogDebug("Deadline timer stop: name=%s", timer->name);
+  return 0;
+}
+
+Timer *scheduleDeadlineTimer(const char *name, std::function<double()> action) {
+  if (name == nullptr) {
+    name = "Undefined";
+  }
+  
+  auto timer = new SDLTimer(name, 0, nullptr);
+  timer->deadlineAction = action;
+  timer->thread = SDL_CreateThread((SDL_ThreadFunction)runtimeDeadlineTimerThread_SDL, name, timer);
+  
+  return timer;
+}
+
+void wakeTimer(Timer *t) {
+  if (t == nullptr) {
+    return;
+  }
+  
+  auto timer = static_cast<SDLTimer *>(t);
+  
+  SDL_LockMutex(timer->mutex);
+  {
+    timer->woken = true;
+    SDL_CondSignal(timer->cond);
+  }
+  SDL_UnlockMutex(timer->mutex);
+}
+
 Timer *scheduleTimer(const char *name, double interval, std::function<void()> action) {
   if (name == nullptr) {
     name = "Undefined";
@@ -371,7 +453,12 @@ void invalidateTimer(Timer *t) {
   // timer 实例一定是经过 scheduleTimer 方法创建的，所以可以安全地进行强制类型转换
   auto timer = static_cast<SDLTimer *>(t);
 
-  timer->shouldQuit = true;
+  SDL_LockMutex(timer->mutex);
+  {
+    timer->shouldQuit = true;
+    SDL_CondSignal(timer->cond);
+  }
+  SDL_UnlockMutex(timer->mutex);
   
   SDL_WaitThread(timer->thread, nullptr);  
 }
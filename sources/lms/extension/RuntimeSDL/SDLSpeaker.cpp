@@ -12,6 +12,7 @@
 #include <lms/Events.h>
 extern "C" {
 #include <libavformat/avformat.h>
+#include <libavutil/time.h>
 #include <SDL2/SDL.h>
 }
 
@@ -30,6 +31,8 @@ public:
     this->timeSync   = lms::retain(timeSync);
     this->frameItems = new FramesBuffer<AudioFrameItem *>;
     this->totalSamples = 0;
+    this->serial       = 0;
+    this->firstSamplePlayed = false;
     
     SDL_AudioSpec request_specs, respond_specs;
     request_specs.freq     = stream->codecpar->sample_rate;
@@ -59,7 +62,36 @@ public:
   
 protected:
   void didReceivePipelineMessage(const PipelineMessage& msg) override {
+    uint64_t msgSerial = variantsGetUInt(msg, "serial");
+    
+    if (strcmp(variantsGetCString(msg, "type", ""), "flush") == 0) {
+      serial = msgSerial;
+      
+      // 锁定音频设备，等待正在执行的数据回调结束：回调中取出的旧帧会被放回队列，并以旧的pts更新时钟
+      SDL_LockAudioDevice(speakerId);
+      {
+        // 音频是播放时钟的基准，在新位置的首帧播放之前，时钟处于无效状态
+        timeSync->updateTimePivot(-1.0);
+        
+        // 丢弃seek之前缓存的所有音频帧
+        for (auto afi : frameItems->takeAll()) {
+          totalSamples -= afi->remainBytes;
+          freeFrameItem(afi);
+        }
+      }
+      SDL_UnlockAudioDevice(speakerId);
+      return;
+    }
+    
     auto avfrm = (AVFrame *)msg.at("frame").value.ptr;
+    
+    // 重采样后的帧由该speaker持有，旧serial的帧需要在这里释放
+    if (msgSerial != serial) {
+      av_freep(&avfrm->data[0]);
+      av_frame_free(&avfrm);
+      return;
+    }
+    
     AudioFrameItem *afi = new AudioFrameItem { avfrm, avfrm->data[0], avfrm->linesize[0] };
     frameItems->pushBack(afi);
     
@@ -72,8 +104,9 @@ private:
     
     while(len > 0) {
       if (self->frameItems->count() < SDLSpeaker::IdealCachingFrames) {
-        fireEvent("decode_frame", self, {
-          {"stream_object", self->stream}
+        fireEvent("decode_frame", self->stream, {
+          {"stream_object", self->stream},
+          {"count"        , 1},
         });
       }
       
@@ -84,6 +117,15 @@ private:
       }
       
       AVFrame *frame = afi->frame;
+      
+      if (!self->firstSamplePlayed) {
+        self->firstSamplePlayed = true;
+        fireEvent("did_reach_milestone", self, {
+          { "stream_object", self->stream },
+          { "milestone"    , "first_present" },
+          { "time"         , (int64_t)av_gettime_relative() },
+        });
+      }
 
       double ts = frame->pts * av_q2d(self->stream->time_base);
       self->timeSync->updateTimePivot(ts);
@@ -104,15 +146,20 @@ private:
       if (afi->remainBytes > 0) {
         self->frameItems->pushFront(afi);
       } else {
-        av_freep(&frame->data[0]);
-        av_frame_free(&frame);
-        delete afi;
+        freeFrameItem(afi);
       }
     }
   }
+  
+  static void freeFrameItem(AudioFrameItem *afi) {
+    av_freep(&afi->frame->data[0]);
+    av_frame_free(&afi->frame);
+    delete afi;
+  }
 
 private:
   void start() override {
+    firstSamplePlayed = false;
     SDL_PauseAudioDevice(speakerId, 0);
   }
   
@@ -127,6 +174,8 @@ private:
   TimeSync *timeSync;
   FramesBuffer<AudioFrameItem *> *frameItems;
   std::atomic<uint32_t> totalSamples;
+  uint64_t              serial;
+  bool                  firstSamplePlayed; // 除start外，仅在音频回调线程中访问
   
   constexpr static int IdealCachingFrames = 10;
 };
@@ -1,15 +1,37 @@
 #include "SDLView.h"
+#include "PixelConvert.h"
 #include <lms/MediaSource.h>
 #include <lms/Logger.h>
 #include <lms/Runtime.h>
 #include <lms/Foundation.h>
 #include <lms/Events.h>
+#include <lms/Metrics.h>
 extern "C" {
   #include <libavformat/avformat.h>
+  #include <libavutil/buffer.h>
   #include <libavutil/imgutils.h>
+  #include <libavutil/pixdesc.h>
   #include <libswscale/swscale.h>
   #include <SDL2/SDL.h>
 }
+#include <algorithm>
+#include <vector>
+
+// 视频尺寸未知时窗口的默认大小
+constexpr int DefaultWindowWidth  = 960;
+constexpr int DefaultWindowHeight = 540;
+
+// 帧的像素数达到显示区域的该倍数时，转换时一并缩小到显示尺寸，而不是上传完整的帧再由SDL_RenderCopy缩小
+constexpr int DownscaleAreaRatio = 2;
+
+// 缩小后的尺寸按该值向上对齐，避免窗口尺寸的微小变化频繁地重建纹理
+constexpr int DownscaleAlignment = 16;
+
+// 分段转换时每一段至少包含的像素数，低于该值时分段的调度开销会超过并行带来的收益
+constexpr int SliceMinPixels = 960 * 540;
+
+// 分段转换的工作线程数上限（不含转换队列自身的线程）
+constexpr int MaxSliceWorkers = 7;
 
 static SDL_Rect calcDrawRect(SDLView::ContentMode mode, int srcWidth, int srcHeight, SDL_Rect bounds) {
   double srcRatio      = (double)srcWidth / (double)srcHeight;
@@ -38,76 +60,328 @@ static SDL_Rect calcDrawRect(SDLView::ContentMode mode, int srcWidth, int srcHei
   return drawRect;
 }
 
+typedef enum {
+  TextureUploadPlanar = 1, // Y、U、V三个平面，SDL_UpdateYUVTexture
+  TextureUploadNV     = 2, // Y平面与交错的UV平面，SDL_UpdateNVTexture
+  TextureUploadPacked = 3, // 单个平面的packed格式，SDL_UpdateTexture
+} TextureUploadMethod;
+
+struct TextureFormat {
+  AVPixelFormat       pixelFormat;
+  Uint32              sdlFormat;
+  TextureUploadMethod method;
+  const char         *name;
+};
+
+/*
+ 解码器输出格式与可以直接上传的SDL纹理格式的对应关系。
+ RGB格式使用按字节顺序定义的SDL格式（RGBA32等），与FFmpeg的定义一致，不受大小端影响；
+ 纹理关闭了混合，带填充字节的格式（RGB0等）可以与带alpha的格式共用
+ */
+static const TextureFormat textureFormats[] = {
+  { AV_PIX_FMT_YUV420P, SDL_PIXELFORMAT_YV12,   TextureUploadPlanar, "YV12"   },
+  { AV_PIX_FMT_YUV420P, SDL_PIXELFORMAT_IYUV,   TextureUploadPlanar, "IYUV"   },
+#if SDL_VERSION_ATLEAST(2, 0, 16)
+  { AV_PIX_FMT_NV12,    SDL_PIXELFORMAT_NV12,   TextureUploadNV,     "NV12"   },
+  { AV_PIX_FMT_NV21,    SDL_PIXELFORMAT_NV21,   TextureUploadNV,     "NV21"   },
+#endif
+  { AV_PIX_FMT_YUYV422, SDL_PIXELFORMAT_YUY2,   TextureUploadPacked, "YUY2"   },
+  { AV_PIX_FMT_UYVY422, SDL_PIXELFORMAT_UYVY,   TextureUploadPacked, "UYVY"   },
+  { AV_PIX_FMT_RGB24,   SDL_PIXELFORMAT_RGB24,  TextureUploadPacked, "RGB24"  },
+  { AV_PIX_FMT_BGR24,   SDL_PIXELFORMAT_BGR24,  TextureUploadPacked, "BGR24"  },
+  { AV_PIX_FMT_RGBA,    SDL_PIXELFORMAT_RGBA32, TextureUploadPacked, "RGBA32" },
+  { AV_PIX_FMT_RGB0,    SDL_PIXELFORMAT_RGBA32, TextureUploadPacked, "RGBA32" },
+  { AV_PIX_FMT_BGRA,    SDL_PIXELFORMAT_BGRA32, TextureUploadPacked, "BGRA32" },
+  { AV_PIX_FMT_BGR0,    SDL_PIXELFORMAT_BGRA32, TextureUploadPacked, "BGRA32" },
+  { AV_PIX_FMT_ARGB,    SDL_PIXELFORMAT_ARGB32, TextureUploadPacked, "ARGB32" },
+  { AV_PIX_FMT_0RGB,    SDL_PIXELFORMAT_ARGB32, TextureUploadPacked, "ARGB32" },
+  { AV_PIX_FMT_ABGR,    SDL_PIXELFORMAT_ABGR32, TextureUploadPacked, "ABGR32" },
+  { AV_PIX_FMT_0BGR,    SDL_PIXELFORMAT_ABGR32, TextureUploadPacked, "ABGR32" },
+};
+
+/*
+ @function negotiateTextureFormat
+ 为解码器输出的像素格式选择渲染器原生支持的纹理格式，使帧可以不经过转换直接上传。
+ 渲染器不支持时（SDL会在内部再做一次转换）返回nullptr，由调用者转换为YV12
+ */
+static const TextureFormat *negotiateTextureFormat(SDL_Renderer *renderer, int pixelFormat) {
+  SDL_RendererInfo info;
+  if (SDL_GetRendererInfo(renderer, &info) != 0) {
+    return nullptr;
+  }
+  
+  for (auto& tf : textureFormats) {
+    if (tf.pixelFormat != pixelFormat) {
+      continue;
+    }
+    
+    for (Uint32 i = 0; i < info.num_texture_formats; i += 1) {
+      if (info.texture_formats[i] == tf.sdlFormat) {
+        return &tf;
+      }
+    }
+  }
+  
+  return nullptr;
+}
+
+
+/*
+ @function lockedYV12Planes
+ 锁定的YV12纹理内存中各平面的地址，布局与SDL一致：Y平面之后依次是V、U平面，色度平面的pitch为Y的一半。
+ 按YUV420P的平面顺序（Y、U、V）输出，转换结果可以直接写入纹理
+ */
+static void lockedYV12Planes(void *pixels, int pitch, int height, uint8_t *planes[3], int linesizes[3]) {
+  int chromaPitch = (pitch + 1) / 2;
+  
+  planes[0] = (uint8_t *)pixels;
+  planes[2] = planes[0] + pitch * height;
+  planes[1] = planes[2] + chromaPitch * ((height + 1) / 2);
+  
+  linesizes[0] = pitch;
+  linesizes[1] = chromaPitch;
+  linesizes[2] = chromaPitch;
+}
+
 
 class SWSFrameScaler : virtual public lms::Object {
 public:
-  SWSFrameScaler(int width, int height, AVPixelFormat inputFormat, AVPixelFormat outputFormat, bool reuseFrame = true) {
+  /*
+   @param workers 分段转换所使用的工作队列，为空时不分段
+   */
+  SWSFrameScaler(int width, int height, AVPixelFormat inputFormat,
+                 int outputWidth, int outputHeight, AVPixelFormat outputFormat,
+                 const std::vector<lms::DispatchQueue *>& workers) {
     this->width        = width;
     this->height       = height;
     this->inputFormat  = inputFormat;
+    this->outputWidth  = outputWidth;
+    this->outputHeight = outputHeight;
     this->outputFormat = outputFormat;
+    this->inputDesc    = av_pix_fmt_desc_get(inputFormat);
+    this->outputDesc   = av_pix_fmt_desc_get(outputFormat);
+    
+    // 常见格式同尺寸转换为YUV420P时使用专门的转换内核，不经过swscale，输出与swscale一致
+    sameSize = width == outputWidth && height == outputHeight;
+    kernels  = nullptr;
+    if (sameSize && outputFormat == AV_PIX_FMT_YUV420P && canConvertToYUV420P(inputFormat)) {
+      kernels = bestPixelKernels();
+    }
+    
+    // 同尺寸转换按行分成若干段，由多个线程同时转换。段的边界按输入、输出格式的色度行对齐，使各段的色度行互不重叠；
+    // 缩小时各段的滤波范围会相互交叠，仍作为一段转换。swscale在输入、输出的色度垂直采样不同时（RGB、YUV444P、
+    // YUV422P转换为YUV420P）会在垂直方向上插值色度，分段后各段在边界处各自截断，产生接缝，同样作为一段转换
+    bool sliceable = sameSize && (kernels != nullptr || inputDesc->log2_chroma_h == outputDesc->log2_chroma_h);
     
-    swsContext = sws_getContext(width, height, inputFormat, width, height, outputFormat, SWS_BILINEAR, NULL, NULL, NULL);
+    int count = 1;
+    if (sliceable) {
+      count = std::min((int)workers.size() + 1, std::max(1, width * height / SliceMinPixels));
+    }
+    
+    int align = 1 << std::max(inputDesc->log2_chroma_h, outputDesc->log2_chroma_h);
+    int rows  = FFALIGN((height + count - 1) / count, align);
+    for (int y = 0; y < height; y += rows) {
+      sliceRows.push_back(y);
+    }
+    sliceRows.push_back(height);
     
-    if (reuseFrame) {
-      cacheFrame = createFrame();
+    for (int i = 0; i + 1 < (int)sliceRows.size(); i += 1) {
+      SwsContext *ctx = nullptr;
+      if (kernels == nullptr) {
+        int h  = sliceRows[i + 1] - sliceRows[i];
+        ctx = createMatchingSwsContext(width, sameSize ? h : height, inputFormat,
+                                       outputWidth, sameSize ? h : outputHeight, outputFormat);
+      }
+      swsContexts.push_back(ctx);
     }
+    
+    for (int i = 0; i + 2 < (int)sliceRows.size(); i += 1) {
+      this->workers.push_back(lms::retain(workers[i]));
+    }
+    sliceDone = SDL_CreateSemaphore(0);
+    
+    bufferPool = av_buffer_pool_init(av_image_get_buffer_size(outputFormat, outputWidth, outputHeight, 32), av_buffer_alloc);
   }
   
   ~SWSFrameScaler() {
-    destroyFrame(cacheFrame);
-    sws_freeContext(swsContext);
+    for (auto ctx : swsContexts) {
+      sws_freeContext(ctx);
+    }
+    for (auto q : workers) {
+      lms::release(q);
+    }
+    SDL_DestroySemaphore(sliceDone);
+    
+    // 仍在使用中的缓冲区归还后才会真正释放
+    av_buffer_pool_uninit(&bufferPool);
   }
   
-  AVFrame *scale(AVFrame *iframe) {
+  /*
+   @function scale
+   将iframe转换后写入dst指向的内存（锁定的纹理，或obtainBuffer取得的缓冲区）。
+   第一段在调用线程中转换，其余各段投递到工作队列，全部完成后返回。不能在多个线程中同时调用
+   */
+  void scale(const AVFrame *iframe, uint8_t *const dst[3], const int dstLinesize[3]) {
     assert(iframe->width == width);
     assert(iframe->height == height);
     assert(iframe->format == inputFormat);
     
-    AVFrame *oframe = cacheFrame;
-
-    // 如果不进行帧复用，则每一次转换都创建一个新的帧
-    if (oframe == nullptr) {
-      oframe = createFrame();
+    for (int i = 1; i < slices(); i += 1) {
+      lms::async(workers[i - 1], "ConvertSlice", [this, i, iframe, dst, dstLinesize] {
+        scaleSlice(i, iframe, dst, dstLinesize);
+        SDL_SemPost(sliceDone);
+      });
     }
     
-    sws_scale(swsContext,
-              (uint8_t const *const *)iframe->data,
-              iframe->linesize,
-              0,
-              iframe->height,
-              oframe->data,
-              oframe->linesize);
+    scaleSlice(0, iframe, dst, dstLinesize);
     
-    return  oframe;
+    for (int i = 1; i < slices(); i += 1) {
+      SDL_SemWait(sliceDone);
+    }
   }
   
-private:
-  AVFrame *createFrame() {
-    int bufferSize = av_image_get_buffer_size(outputFormat, width, height, 32);
-    uint8_t *buffer = (uint8_t *)av_malloc(bufferSize);
-    
-    AVFrame *frame = av_frame_alloc();
-    av_image_fill_arrays(frame->data, frame->linesize, buffer, AV_PIX_FMT_YUV420P, width, height, 32);
-
-    return frame;
+  /*
+   @function obtainBuffer
+   从缓冲池中取得一帧输出大小的缓冲区，并填充各平面的地址
+   */
+  AVBufferRef *obtainBuffer(uint8_t *data[4], int linesize[4]) {
+    AVBufferRef *buffer = av_buffer_pool_get(bufferPool);
+    if (buffer) {
+      av_image_fill_arrays(data, linesize, buffer->data, outputFormat, outputWidth, outputHeight, 32);
+    }
+    return buffer;
+  }
+  
+  int slices() const {
+    return (int)swsContexts.size();
   }
   
-  void destroyFrame(AVFrame *frame) {
-    if (frame == nullptr) {
+  // 每帧写入的字节数
+  int outputSize() const {
+    return av_image_get_buffer_size(outputFormat, outputWidth, outputHeight, 1);
+  }
+  
+private:
+  void scaleSlice(int index, const AVFrame *iframe, uint8_t *const dst[3], const int dstLinesize[3]) {
+    int begin = sliceRows[index];
+    int end   = sliceRows[index + 1];
+    
+    if (kernels) {
+      convertRowsToYUV420P(kernels, iframe, dst, dstLinesize, begin, end);
       return;
     }
-
-    av_freep(&frame);
+    
+    if (!sameSize) {
+      sws_scale(swsContexts[index], (uint8_t const *const *)iframe->data, iframe->linesize, 0, height, dst, dstLinesize);
+      return;
+    }
+    
+    // 各平面偏移到该段的起始行，色度平面按各自的垂直采样率换算，调色板（PAL8的第2个平面）不偏移
+    const uint8_t *src[4] = {};
+    for (int p = 0; p < 4 && iframe->data[p]; p += 1) {
+      bool palette = p == 1 && (inputDesc->flags & AV_PIX_FMT_FLAG_PAL);
+      int  shift   = (p == 1 || p == 2) ? inputDesc->log2_chroma_h : 0;
+      src[p] = iframe->data[p] + (palette ? 0 : (begin >> shift) * iframe->linesize[p]);
+    }
+    
+    uint8_t *out[3];
+    for (int p = 0; p < 3; p += 1) {
+      int shift = p > 0 ? outputDesc->log2_chroma_h : 0;
+      out[p] = dst[p] + (begin >> shift) * dstLinesize[p];
+    }
+    
+    sws_scale(swsContexts[index], src, iframe->linesize, 0, end - begin, out, dstLinesize);
   }
   
 private:
-  SwsContext *swsContext;
+  const PixelKernels *kernels;
+  std::vector<SwsContext *> swsContexts; // 每段一个，不分段时只有一个
+  std::vector<int> sliceRows;            // 各段的起始行，最后一个元素为height
+  std::vector<lms::DispatchQueue *> workers;
+  SDL_sem *sliceDone;
+  AVBufferPool *bufferPool;
+  bool sameSize;
   int width;
   int height;
   AVPixelFormat inputFormat;
+  int outputWidth;
+  int outputHeight;
   AVPixelFormat outputFormat;
-  AVFrame *cacheFrame;
+  const AVPixFmtDescriptor *inputDesc;
+  const AVPixFmtDescriptor *outputDesc;
+};
+
+// 用于识别AVFrame::opaque_ref是否关联了FrameConversion
+static const char FrameConversionTag = 0;
+
+/*
+ @class FrameConversion
+ 在呈现之前于转换队列中完成的一帧格式转换。通过AVFrame::opaque_ref随帧进入渲染端的帧队列，
+ 帧被丢弃或回收时随之释放；尚未开始的转换不再进行
+ */
+class FrameConversion : virtual public lms::Object {
+public:
+  FrameConversion(SWSFrameScaler *scaler) {
+    this->scaler    = lms::retain(scaler);
+    this->buffer    = scaler->obtainBuffer(data, linesize);
+    this->done      = SDL_CreateSemaphore(0);
+    this->abandoned = false;
+  }
+  
+  ~FrameConversion() {
+    av_buffer_unref(&buffer);
+    SDL_DestroySemaphore(done);
+    lms::release(scaler);
+  }
+  
+  // 将转换关联到frame上，由frame持有一个引用
+  void attach(AVFrame *frame) {
+    lms::retain(this);
+    frame->opaque_ref = av_buffer_create((uint8_t *)this, sizeof(*this), detach, (void *)&FrameConversionTag, 0);
+  }
+  
+  // 取得frame上关联的转换，没有时返回nullptr
+  static FrameConversion *from(const AVFrame *frame) {
+    if (frame->opaque_ref == nullptr || av_buffer_get_opaque(frame->opaque_ref) != &FrameConversionTag) {
+      return nullptr;
+    }
+    return (FrameConversion *)frame->opaque_ref->data;
+  }
+  
+  void run(const AVFrame *source) {
+    if (!abandoned) {
+      Uint64 t0 = SDL_GetPerformanceCounter();
+      scaler->scale(source, data, linesize);
+      Uint64 t1 = SDL_GetPerformanceCounter();
+      lms::metricsObserve("video.render.convert_ms", (t1 - t0) * 1000.0 / SDL_GetPerformanceFrequency());
+    }
+    SDL_SemPost(done);
+  }
+  
+  bool isFinished() {
+    return SDL_SemValue(done) > 0;
+  }
+  
+  void wait() {
+    SDL_SemWait(done);
+    SDL_SemPost(done);
+  }
+  
+public:
+  SWSFrameScaler *scaler;
+  AVBufferRef    *buffer;
+  uint8_t        *data[4];
+  int             linesize[4];
+  
+private:
+  static void detach(void *opaque, uint8_t *data) {
+    auto conv = (FrameConversion *)data;
+    conv->abandoned = true;
+    lms::release(conv);
+  }
+  
+  SDL_sem          *done;
+  std::atomic<bool> abandoned; // 帧的所有引用都已释放，转换结果不会再被使用
 };
 
 void SDLView::configure(const lms::StreamMeta &meta) {
@@ -120,11 +394,13 @@ void SDLView::start() {
   auto par = st->codecpar;
   
   // 创建一个SDL窗口用于在其中进行视频渲染
+  // 快速启动时视频尺寸可能尚未探测出来，先使用默认尺寸创建窗口，纹理在收到首帧时再创建
+  bool sizeKnown = par->width > 0 && par->height > 0;
   win = SDL_CreateWindow("LMS Window",
                          SDL_WINDOWPOS_CENTERED,
                          SDL_WINDOWPOS_CENTERED,
-                         par->width / 2,
-                         par->height / 2,
+                         sizeKnown ? par->width / 2 : DefaultWindowWidth,
+                         sizeKnown ? par->height / 2 : DefaultWindowHeight,
                          SDL_WINDOW_METAL | SDL_WINDOW_ALLOW_HIGHDPI | SDL_WINDOW_RESIZABLE);
   
   Uint32 renderFlags = SDL_RENDERER_ACCELERATED | SDL_RENDERER_TARGETTEXTURE;
@@ -140,25 +416,225 @@ void SDLView::start() {
 
   renderer = SDL_CreateRenderer(win, -1, renderFlags);
   
-  texture = SDL_CreateTexture(renderer,
-                              SDL_PIXELFORMAT_YV12,
-                              SDL_TEXTUREACCESS_STREAMING,
-                              par->width,
-                              par->height);
+  // 格式转换在呈现之前于转换队列中进行，高分辨率的帧再分段交给其余的工作队列并行处理
+  convertQueue = lms::createDispatchQueue("LMS_SDLViewConvert", lms::QueueTypeWorker);
+  int sliceWorkers = std::max(1, std::min(SDL_GetCPUCount() - 1, MaxSliceWorkers));
+  for (int i = 0; i < sliceWorkers; i += 1) {
+    sliceQueues.push_back(lms::createDispatchQueue("LMS_SDLViewSlice", lms::QueueTypeWorker));
+  }
+  
+  if (sizeKnown && par->format >= 0) {
+    updateTexture(par->width, par->height, par->format, 0, 0);
+  }
+}
+
+void SDLView::updateTexture(int width, int height, int format, int targetWidth, int targetHeight) {
+  // 帧明显大于显示区域时，纹理只需要显示尺寸，转换时一并缩小
+  int outputWidth  = width;
+  int outputHeight = height;
+  if (targetWidth > 0 && targetHeight > 0 && (int64_t)width * height >= (int64_t)DownscaleAreaRatio * targetWidth * targetHeight) {
+    outputWidth  = std::min(width, FFALIGN(targetWidth, DownscaleAlignment));
+    outputHeight = std::min(height, FFALIGN(targetHeight, DownscaleAlignment));
+  }
+  
+  if (textures[0] && width == frameWidth && height == frameHeight && format == frameFormat &&
+      outputWidth == textureWidth && outputHeight == textureHeight) {
+    return;
+  }
+  
+  destroyTextures();
+  
+  // 优先使用与帧格式一致的纹理格式直接上传，渲染器不支持或需要缩小时转换为YV12
+  bool downscale = outputWidth != width || outputHeight != height;
+  textureUpload = downscale ? nullptr : negotiateTextureFormat(renderer, format);
   
-  // 当输入的帧格式不是YV12时，需要对其进行格式转换，否则无法将yuv数据copy到texture中
-  if (par->format != AV_PIX_FMT_YUV420P) {
-    scaler = new SWSFrameScaler(par->width, par->height, (AVPixelFormat)par->format, AV_PIX_FMT_YUV420P);
+  // 多个纹理轮流使用，上传时不需要等待上一帧的呈现结束
+  for (int i = 0; i < TextureBufferCount; i += 1) {
+    textures[i] = SDL_CreateTexture(renderer,
+                                    textureUpload ? textureUpload->sdlFormat : SDL_PIXELFORMAT_YV12,
+                                    SDL_TEXTUREACCESS_STREAMING,
+                                    outputWidth,
+                                    outputHeight);
+    SDL_SetTextureBlendMode(textures[i], SDL_BLENDMODE_NONE);
   }
+  textureIndex = 0;
+  
+  // 渲染器不支持YV12时SDL内部会自行转换，同尺寸的YUV420P仍然直接上传
+  if (textureUpload == nullptr && (format != AV_PIX_FMT_YUV420P || downscale)) {
+    scaler = new SWSFrameScaler(width, height, (AVPixelFormat)format, outputWidth, outputHeight, AV_PIX_FMT_YUV420P, sliceQueues);
+  }
+  
+  LMSLogInfo("Update texture: size=%dx%d, format=%s, texture=%s %dx%d, convert=%s, slices=%d",
+             width, height, av_get_pix_fmt_name((AVPixelFormat)format),
+             textureUpload ? textureUpload->name : "YV12", outputWidth, outputHeight, scaler ? "yes" : "no",
+             scaler ? scaler->slices() : 0);
+  
+  frameWidth    = width;
+  frameHeight   = height;
+  frameFormat   = format;
+  textureWidth  = outputWidth;
+  textureHeight = outputHeight;
+}
+
+void SDLView::updateRenderSize(int width, int height) {
+  if (width == renderWidth && height == renderHeight) {
+    return;
+  }
+  
+  renderWidth  = width;
+  renderHeight = height;
+  
+  // 通知解码器，支持lowres的解码器据此降低解码分辨率
+  lms::fireEvent("update_render_size", st, {
+    { "stream_object", st },
+    { "width"        , (int64_t)width },
+    { "height"       , (int64_t)height },
+  });
+}
+
+void SDLView::destroyTextures() {
+  lms::release(scaler);
+  scaler = nullptr;
+  
+  for (int i = 0; i < TextureBufferCount; i += 1) {
+    if (textures[i]) {
+      SDL_DestroyTexture(textures[i]);
+    }
+    textures[i] = nullptr;
+  }
+  textureUpload = nullptr;
+}
+
+SDL_Texture *SDLView::uploadFrame(const AVFrame *frame) {
+  SDL_Texture *texture = textures[textureIndex];
+  textureIndex = (textureIndex + 1) % TextureBufferCount;
+  
+  Uint64 frequency = SDL_GetPerformanceFrequency();
+  Uint64 t0 = SDL_GetPerformanceCounter();
+  
+  // 每帧由CPU写入的字节数
+  int copyBytes = 0;
+  
+  FrameConversion *conv = FrameConversion::from(frame);
+  bool prepared = scaler && conv && conv->scaler == scaler;
+  
+  if (prepared) {
+    // 已经在转换队列中提前转换，通常在呈现之前就已完成
+    if (!conv->isFinished()) {
+      lms::metricsAdd("video.render.convert_late");
+    }
+    conv->wait();
+    
+    Uint64 t1 = SDL_GetPerformanceCounter();
+    lms::metricsObserve("video.render.convert_wait_ms", (t1 - t0) * 1000.0 / frequency);
+    
+    SDL_UpdateYUVTexture(texture,
+                         NULL,
+                         conv->data[0], conv->linesize[0],
+                         conv->data[1], conv->linesize[1],
+                         conv->data[2], conv->linesize[2]);
+    t0 = t1;
+    
+    // 转换结果写入缓冲区一次，上传时再复制一次
+    copyBytes = scaler->outputSize() * 2;
+  } else if (scaler) {
+    // 没有提前转换的帧（纹理刚刚重建）直接转换到锁定的纹理中
+    void *pixels;
+    int   pitch;
+    if (SDL_LockTexture(texture, NULL, &pixels, &pitch) != 0) {
+      LMSLogError("Lock texture failed: %s", SDL_GetError());
+      return nullptr;
+    }
+    
+    uint8_t *planes[3];
+    int      linesizes[3];
+    lockedYV12Planes(pixels, pitch, textureHeight, planes, linesizes);
+    
+    // 与转换队列中的任务共用同一组分段的转换上下文，需要在转换队列中执行
+    SWSFrameScaler *s = scaler;
+    lms::sync(convertQueue, "ConvertFrame", [s, frame, &planes, &linesizes] {
+      s->scale(frame, planes, linesizes);
+    });
+    SDL_UnlockTexture(texture);
+    
+    copyBytes = scaler->outputSize();
+  } else {
+    // 格式一致时由SDL从帧数据直接上传，只复制一次
+    TextureUploadMethod method = textureUpload ? textureUpload->method : TextureUploadPlanar;
+    switch (method) {
+#if SDL_VERSION_ATLEAST(2, 0, 16)
+      case TextureUploadNV:
+        SDL_UpdateNVTexture(texture,
+                            NULL,
+                            frame->data[0], frame->linesize[0],
+                            frame->data[1], frame->linesize[1]);
+        break;
+#endif
+      case TextureUploadPacked:
+        SDL_UpdateTexture(texture, NULL, frame->data[0], frame->linesize[0]);
+        break;
+      default:
+        SDL_UpdateYUVTexture(texture,
+                             NULL,
+                             frame->data[0], frame->linesize[0],
+                             frame->data[1], frame->linesize[1],
+                             frame->data[2], frame->linesize[2]);
+        break;
+    }
+    
+    copyBytes = av_image_get_buffer_size((AVPixelFormat)frame->format, frame->width, frame->height, 1);
+  }
+  
+  Uint64 t1 = SDL_GetPerformanceCounter();
+  
+  // 每帧上传到纹理的CPU耗时与复制的字节数，便于比较不同源格式直接上传与转换后上传的开销
+  lms::metricsObserve(scaler && !prepared ? "video.render.convert_upload_ms" : "video.render.upload_ms", (t1 - t0) * 1000.0 / frequency);
+  lms::metricsObserve("video.render.copy_bytes", copyBytes);
+  
+  return texture;
+}
+
+void SDLView::prepareFrame(AVFrame *frame) {
+  assert(lms::isHostThread());
+  
+  // 只为与当前纹理一致的帧提前转换，尺寸或格式变化后的帧在呈现时重建纹理并直接转换
+  if (scaler == nullptr || frame->opaque_ref != nullptr ||
+      frame->width != frameWidth || frame->height != frameHeight || frame->format != frameFormat) {
+    return;
+  }
+  
+  auto conv = new FrameConversion(scaler);
+  if (conv->buffer == nullptr) {
+    lms::release(conv);
+    return;
+  }
+  
+  // 转换任务引用帧的数据，但不引用其上关联的转换，帧被丢弃后转换随之释放
+  AVFrame *source = av_frame_clone(frame);
+  conv->attach(frame);
+  
+  lms::async(convertQueue, "ConvertFrame", [conv, source] {
+    AVFrame *f = source;
+    conv->run(f);
+    av_frame_free(&f);
+    lms::release(conv);
+  });
 }
 
 void SDLView::stop() {
   LMSLogDebug("SDLView=%p", this);
+  
+  // 工作队列释放时不会执行尚未开始的任务，先等待已经投递的转换完成
+  lms::sync(convertQueue, "DrainConvert", [] {});
+  lms::release(convertQueue);
+  convertQueue = nullptr;
 
-  lms::release(scaler);
+  destroyTextures();
   
-  SDL_DestroyTexture(texture);
-  texture = nullptr;
+  for (auto q : sliceQueues) {
+    lms::release(q);
+  }
+  sliceQueues.clear();
   
   SDL_DestroyRenderer(renderer);
   renderer = nullptr;
@@ -178,30 +654,36 @@ void SDLView::setContentMode(SDLView::ContentMode contentMode) {
 void SDLView::didReceivePipelineMessage(const lms::PipelineMessage &msg) {
   assert(lms::isHostThread());
   
-  AVFrame *inputFrame = (AVFrame *)msg.at("frame").value.ptr;
-  auto frame = av_frame_clone(inputFrame);
+  // 帧在该方法返回前一直有效，直接使用而不需要复制
+  AVFrame *frame = (AVFrame *)msg.at("frame").value.ptr;
+  
+  if (strcmp(lms::variantsGetCString(msg, "type", ""), "prepare_frame") == 0) {
+    prepareFrame(frame);
+    return;
+  }
   
   double ts = frame->best_effort_timestamp * av_q2d(st->time_base);
   LMSLogVerbose("Render video frame | ts:%.2lf, pts:%lld", ts, frame->pts);
   
   // 渲染、UI相关的处理只能在主线程调度
   Uint32 t0 = SDL_GetTicks();
-
-  AVFrame *yuv = scaler ? scaler->scale(frame) : frame;
-
-  SDL_UpdateYUVTexture(texture,
-                       NULL,
-                       yuv->data[0], yuv->linesize[0],
-                       yuv->data[1], yuv->linesize[1],
-                       yuv->data[2], yuv->linesize[2]);
-        
-  Uint32 t1 = SDL_GetTicks();
-
+  
   int winWidth, winHeight;
   SDL_GL_GetDrawableSize(win, &winWidth, &winHeight);
   SDL_Rect bounds = {0, 0, winWidth, winHeight};
 
   SDL_Rect drawRect = calcDrawRect(contentMode, frame->width, frame->height, bounds);
+  updateRenderSize(drawRect.w, drawRect.h);
+  
+  // 帧的尺寸或格式与纹理不一致时（快速启动时参数未知，或码流中途发生变化），或显示尺寸变化时重新创建纹理
+  updateTexture(frame->width, frame->height, frame->format, drawRect.w, drawRect.h);
+
+  SDL_Texture *texture = uploadFrame(frame);
+  if (texture == nullptr) {
+    return;
+  }
+        
+  Uint32 t1 = SDL_GetTicks();
 
   SDL_RenderClear(renderer);
   SDL_RenderCopy(renderer, texture, NULL, &drawRect);
@@ -209,8 +691,6 @@ void SDLView::didReceivePipelineMessage(const lms::PipelineMessage &msg) {
   
   Uint32 t2 = SDL_GetTicks();
 
-  av_frame_unref(frame);
-
   LMSLogDebug("Render cost: total=%2u, texture=%2u, present=%2u", t2 - t0, t1 - t0, t2 - t1);
 }
 
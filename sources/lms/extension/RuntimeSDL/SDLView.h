@@ -1,12 +1,15 @@
 #pragma once
 
 #include <lms/Cell.h>
+#include <lms/Runtime.h>
+#include <vector>
 extern "C" {
 #include <SDL2/SDL.h>
 #include <libavformat/avformat.h>
 }
 
 class SWSFrameScaler;
+struct TextureFormat;
 
 class SDLView : public lms::Cell {
 public:
@@ -28,10 +31,28 @@ protected:
   void didReceivePipelineMessage(const lms::PipelineMessage& cmsg) override;
   
 private:
+  void updateTexture(int width, int height, int format, int targetWidth, int targetHeight);
+  void updateRenderSize(int width, int height);
+  void destroyTextures();
+  SDL_Texture *uploadFrame(const AVFrame *frame);
+  void prepareFrame(AVFrame *frame);
+  
   AVStream *st;
   SDL_Window *win;
   SDL_Renderer *renderer = nullptr;
-  SDL_Texture *texture = nullptr;
+  static constexpr int TextureBufferCount = 3;
+  SDL_Texture *textures[TextureBufferCount] = {};
+  int textureIndex = 0;
   SWSFrameScaler *scaler = nullptr;
+  lms::DispatchQueue *convertQueue = nullptr;        // 在呈现之前进行格式转换
+  std::vector<lms::DispatchQueue *> sliceQueues;    // 分段转换的工作队列
+  const TextureFormat *textureUpload = nullptr; // 帧可以直接上传时纹理的格式与上传方式，需要转换时为nullptr
+  int frameWidth    = 0;
+  int frameHeight   = 0;
+  int frameFormat   = -1;
+  int textureWidth  = 0; // 纹理的尺寸，需要缩小时小于帧的尺寸
+  int textureHeight = 0;
+  int renderWidth   = 0; // 最近一次报告给解码器的显示尺寸
+  int renderHeight  = 0;
   ContentMode contentMode = aspectFit;
 };
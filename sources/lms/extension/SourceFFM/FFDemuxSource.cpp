@@ -0,0 +1,129 @@
+#include "FFDemuxSource.h"
+#include <lms/Logger.h>
+#include <lms/Runtime.h>
+#include <algorithm>
+#include <memory>
+
+FFDemuxSource::FFDemuxSource() {
+  this->context      = nullptr;
+  this->keyframeOnly = false;
+  this->q            = nullptr;
+}
+
+void FFDemuxSource::setKeyframeOnly(bool enabled) {
+  LMSLogInfo("Keyframe only: %d", enabled);
+
+  if (q == nullptr) {
+    keyframeOnly = enabled;
+    return;
+  }
+
+  async(q, "SetKeyframeOnly", [this, enabled] {
+    keyframeOnly = enabled;
+    applyStreamDiscard();
+  });
+}
+
+void FFDemuxSource::applyStreamDiscard() {
+  // 未被选中的流完全跳过；关键帧模式下让demuxer尽可能在读取阶段就跳过非关键帧，以及视频以外的所有流
+  for (unsigned i = 0; i < context->nb_streams; i += 1) {
+    AVStream *st = context->streams[i];
+
+    if (unselected[i]) {
+      st->discard = AVDISCARD_ALL;
+    } else if (!keyframeOnly) {
+      st->discard = AVDISCARD_DEFAULT;
+    } else if (st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+      st->discard = AVDISCARD_NONKEY;
+    } else {
+      st->discard = AVDISCARD_ALL;
+    }
+  }
+}
+
+bool FFDemuxSource::isEndOfInput(int rt) {
+  return rt == AVERROR_EOF;
+}
+
+void FFDemuxSource::requestPackets(const lms::PacketRequest& request, lms::PacketRequestCompletion completion) {
+  LMSLogVerbose("requestPackets: streams=%d, limit=%d", (int)request.quotas.size(), request.limit);
+
+  async(q, "LoadPackets", [this, request, completion] {
+    // 先读入复用的临时数据包，只有确定需要投递时才分配新的数据包，被过滤的数据包不产生任何分配
+    AVPacket *scratch = av_packet_alloc();
+
+    // 尚未满足的配额总数，没有配额时只受limit限制
+    std::map<lms::StreamId, int> remains = request.quotas;
+    int pending = 0;
+    for (auto& r : remains) {
+      pending += std::max(r.second, 0);
+    }
+
+    std::map<lms::StreamId, int> delivered;
+    bool eof = false;
+
+    int loaded = 0;
+    while (loaded < request.limit && (request.quotas.empty() || pending > 0)) {
+      int rt = av_read_frame(context, scratch);
+
+      if (isEndOfInput(rt)) {
+        eof = true;
+        break;
+      }
+
+      // 读取出错的情况同样计入加载数量，避免持续出错时陷入死循环
+      loaded += 1;
+
+      if (rt >= 0) {
+        // 并非所有demuxer都会遵循AVStream::discard，因此在这里再过滤一次，被过滤的数据包不计入加载数量
+        AVStream *st = context->streams[scratch->stream_index];
+        if (st->discard >= AVDISCARD_ALL || (keyframeOnly && !(scratch->flags & AV_PKT_FLAG_KEY))) {
+          av_packet_unref(scratch);
+          loaded -= 1;
+          continue;
+        }
+
+        willDeliverPacket(scratch);
+
+        delivered[scratch->stream_index] += 1;
+        auto remain = remains.find(scratch->stream_index);
+        if (remain != remains.end() && remain->second > 0) {
+          remain->second -= 1;
+          pending -= 1;
+        }
+
+        AVPacket *pkt = av_packet_alloc();
+        av_packet_move_ref(pkt, scratch);
+        std::shared_ptr<AVPacket> guard(pkt, [] (AVPacket *p) { av_packet_free(&p); });
+
+        LMSLogVerbose("Loaded: st=%d, flags=0x%-2x, dts=%" PRIu64
+                      ", pts=%" PRIu64 ", dur=%" PRIu64 ", sz=%-6d",
+                      pkt->stream_index,
+                      pkt->flags,
+                      pkt->dts,
+                      pkt->pts,
+                      pkt->duration,
+                      pkt->size);
+
+        uint64_t pktSerial = packetSerial();
+        async(lms::hostQueue(), "DeliverPacket", [this, pkt, guard, pktSerial] {
+          // 投递之前数据源可能已经被关闭
+          if (context == nullptr) {
+            return;
+          }
+
+          lms::PipelineMessage msg;
+          msg["type"]          = "media_packet";
+          msg["stream_object"] = context->streams[pkt->stream_index];
+          msg["packet_object"] = pkt;
+          msg["serial"]        = pktSerial;
+          deliverPacketMessage(msg);
+        });
+      }
+    }
+
+    av_packet_free(&scratch);
+
+    completion(delivered, eof);
+  });
+}
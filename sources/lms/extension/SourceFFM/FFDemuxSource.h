@@ -0,0 +1,42 @@
+#pragma once
+
+#include <lms/MediaSource.h>
+#include <vector>
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+namespace lms { class DispatchQueue; }
+
+/*
+ @class FFDemuxSource
+ 通过AVFormatContext解封装的数据源（FFMediaFile、FFPipeSource）的公共部分：
+ 根据流的选中状态与关键帧模式设置AVStream::discard，以及在工作队列q中读取、过滤并投递数据包。
+
+ @discussion
+ 子类负责创建context与q，并在open之后初始化unselected。读取过程中的差异通过以下虚函数调整：
+ isEndOfInput决定哪些读取错误视为到达结尾，willDeliverPacket在数据包通过过滤后调用，packetSerial为投递的数据包的序号
+ */
+class FFDemuxSource : public lms::MediaSource {
+public:
+  void setKeyframeOnly(bool enabled) override;
+  void requestPackets(const lms::PacketRequest& request, lms::PacketRequestCompletion completion) override;
+
+protected:
+  FFDemuxSource();
+
+  void applyStreamDiscard();
+
+  // 以下函数均在q中调用
+  virtual bool isEndOfInput(int rt);
+  virtual void willDeliverPacket(const AVPacket *pkt) {}
+  virtual uint64_t packetSerial() { return 0; }
+
+  AVFormatContext *context;
+
+  // 以下状态只在q中访问
+  bool keyframeOnly;
+  std::vector<bool> unselected;
+
+  lms::DispatchQueue *q;
+};
@@ -1,15 +1,31 @@
 #include "FFMediaFile.h"
+#include "MappedFileIO.h"
 #include <lms/MediaSource.h>
 #include <lms/Logger.h>
 #include <lms/Runtime.h>
 #include <lms/Events.h>
+#include <lms/Metrics.h>
+extern "C" {
+#include <libavutil/time.h>
+}
+#include <algorithm>
 
 
 FFMediaFile::FFMediaFile(const char *path) {
   LMSLogVerbose("Path=%s", path);
 
-  this->context = nullptr;
+  this->ioMode = FFMediaIODefault;
+  this->readAheadConfig = ReadAheadConfigDefault;
+  this->mappedIO = nullptr;
+  this->readAheadIO = nullptr;
+  this->probeOptions = FFProbeOptionsDefault;
   this->path = strdup(path);
+  this->serial = 0;
+  this->indexStream = -1;
+  this->indexedUntil = INT64_MIN;
+  this->indexContiguous = true;
+  this->containerIndexed = false;
+  this->probeCacheDirty = false;
 }
 
 FFMediaFile::~FFMediaFile() {
@@ -40,27 +56,83 @@ int FFMediaFile::open() {
   LMSLogDebug("source=%p", this);
   
   int rt = 0;
+  int64_t openBegin = av_gettime_relative();
+
+  AVIOContext *io = nullptr;
+  if (ioMode == FFMediaIOMapped) {
+    mappedIO = MappedFileIO::open(path);
+    io = mappedIO ? mappedIO->getIOContext() : nullptr;
+  } else if (ioMode == FFMediaIOReadAhead) {
+    readAheadIO = ReadAheadIO::open(path, readAheadConfig);
+    io = readAheadIO ? readAheadIO->getIOContext() : nullptr;
+  }
+  
+  if (io) {
+    context = avformat_alloc_context();
+    context->pb     = io;
+    context->flags |= AVFMT_FLAG_CUSTOM_IO;
+  }
+
+  AVDictionary *opts = nullptr;
+  if (probeOptions.probeSize > 0) {
+    av_dict_set_int(&opts, "probesize", probeOptions.probeSize, 0);
+  }
+  if (probeOptions.analyzeDuration > 0) {
+    av_dict_set_int(&opts, "analyzeduration", probeOptions.analyzeDuration, 0);
+  }
+  if (probeOptions.fpsProbeSize >= 0) {
+    av_dict_set_int(&opts, "fpsprobesize", probeOptions.fpsProbeSize, 0);
+  }
 
-  rt = avformat_open_input(&context, path, nullptr, nullptr);
+  rt = avformat_open_input(&context, path, nullptr, &opts);
+  av_dict_free(&opts);
   if (rt != 0) {
     LMSLogError("Failed opening video file: %s", path);
+    
+    // avformat_open_input失败时会释放context，但不会释放自定义的AVIOContext
+    releaseIO();
     return rt;
   }
 
-  rt = avformat_find_stream_info(context, nullptr);
-  if (rt != 0) {
-    LMSLogError("Failed finding stream info");
-    return rt;
+  int64_t probeBegin = av_gettime_relative();
+  lms::fireEvent("did_reach_milestone", this, {
+    { "milestone", "opened"   },
+    { "time"     , probeBegin },
+  });
+  
+  // 命中探测缓存时直接使用缓存中的流参数，跳过需要解码数据帧的avformat_find_stream_info
+  bool warm = probeCache.load(path) && probeCache.apply(context);
+  if (!warm) {
+    rt = probeStreams();
+    if (rt < 0) {
+      LMSLogError("Failed finding stream info");
+      avformat_close_input(&context);
+      releaseIO();
+      return rt;
+    }
+    
+    av_dump_format(context, 0, path, 0);
   }
   
-  av_dump_format(context, 0, path, 0);
+  int64_t openEnd = av_gettime_relative();
+  lms::fireEvent("did_reach_milestone", this, {
+    { "milestone", "probed" },
+    { "time"     , openEnd  },
+  });
   
-  q = lms::createDispatchQueue("LMS_FFMediaFile", lms::QueueTypeWorker);
+  double openMS  = (openEnd - openBegin) / 1000.0;
+  double probeMS = (openEnd - probeBegin) / 1000.0;
+  lms::metricsObserve(warm ? "source.open.warm_ms" : "source.open.cold_ms", openMS);
+  lms::metricsObserve("source.open.probe_ms", probeMS);
+  LMSLogInfo("Source opened: path=%s, probe_cache=%s, cost=%.2lfms, probe=%.2lfms", path, warm ? "hit" : "miss", openMS, probeMS);
   
-  obsLP = lms::addEventObserver("load_packets", nullptr, [this] (const char *nm, void *sender, const lms::EventParams& p) {
-    uint32_t count = lms::variantsGetInt(p, "count");
-    loadPackets(count);
-  });
+  // 默认选中所有流
+  unselected.assign(context->nb_streams, false);
+  
+  applyStreamDiscard();
+  buildKeyframeIndex();
+  
+  q = lms::createDispatchQueue("LMS_FFMediaFile", lms::QueueTypeWorker);
   
   return 0;
 }
@@ -68,41 +140,294 @@ int FFMediaFile::open() {
 void FFMediaFile::close() {
   LMSLogDebug("source=%p", this);
   
-  lms::removeEventObserver(obsLP);
-
   lms::release(q);
   q = nullptr;
 
+  saveProbeCache();
+  
   avformat_close_input(&context);
+  
+  // 自定义的AVIOContext需要在avformat_close_input之后自行释放
+  releaseIO();
+}
+
+static bool hasAudioParameters(const AVStream *st) {
+  auto par = st->codecpar;
+  return par->codec_type != AVMEDIA_TYPE_AUDIO || (par->sample_rate > 0 && par->channels > 0);
 }
 
-void FFMediaFile::loadPackets(int count) {
-  LMSLogVerbose("loadPackets: count=%d", count);
+static bool hasVideoParameters(const AVStream *st) {
+  auto par = st->codecpar;
+  return par->codec_type != AVMEDIA_TYPE_VIDEO || (par->width > 0 && par->height > 0 && par->format >= 0);
+}
+
+int FFMediaFile::probeStreams() {
+  int rt = avformat_find_stream_info(context, nullptr);
+  if (rt < 0) {
+    return rt;
+  }
+  
+  bool audioComplete = true;
+  bool videoComplete = true;
+  for (unsigned i = 0; i < context->nb_streams; i += 1) {
+    audioComplete = audioComplete && hasAudioParameters(context->streams[i]);
+    videoComplete = videoComplete && hasVideoParameters(context->streams[i]);
+  }
+  
+  // 音频输出在创建时就需要完整的参数，无法延后补全，只能放宽限制重新探测
+  if (!audioComplete) {
+    LMSLogWarning("Audio parameters incomplete after probing, retry with default probe options");
+    context->probesize            = 5000000;
+    context->max_analyze_duration = 0;
+    
+    rt = avformat_find_stream_info(context, nullptr);
+    if (rt < 0) {
+      return rt;
+    }
+  }
+  
+  // 尚不完整的参数不能写入缓存，否则之后每次打开都只能拿到不完整的参数
+  if (videoComplete) {
+    probeCache.capture(context);
+    probeCacheDirty = true;
+  } else {
+    LMSLogInfo("Video parameters incomplete after probing, will be refined by decoded frames");
+  }
+  
+  return rt;
+}
+
+void FFMediaFile::setProbeOptions(const FFProbeOptions& options) {
+  probeOptions = options;
+}
+
+void FFMediaFile::saveProbeCache() {
+  // 播放过程中扩展了关键帧索引的覆盖范围时，同样需要更新缓存
+  if (indexStream >= 0 && indexedUntil != INT64_MAX
+      && (probeCache.indexStream != indexStream || indexedUntil > probeCache.indexedUntil)) {
+    probeCache.indexStream  = indexStream;
+    probeCache.indexedUntil = indexedUntil;
+    probeCache.keyframes    = keyframeIndex;
+    probeCacheDirty = true;
+  }
+  
+  if (probeCacheDirty) {
+    probeCache.save();
+    probeCacheDirty = false;
+  }
+}
+
+void FFMediaFile::setIOMode(FFMediaIOMode mode, const ReadAheadConfig& config) {
+  ioMode = mode;
+  readAheadConfig = config;
+}
+
+void FFMediaFile::releaseIO() {
+  if (readAheadIO) {
+    LMSLogInfo("Read-ahead stalls: path=%s, count=%llu, time=%.3lfs",
+               path, (unsigned long long)readAheadIO->getStallCount(), readAheadIO->getStallTime());
+  }
+  
+  delete mappedIO;
+  mappedIO = nullptr;
+  
+  delete readAheadIO;
+  readAheadIO = nullptr;
+}
+
+int FFMediaFile::seek(double time, lms::SeekMode mode) {
+  LMSLogInfo("Seek: time=%.3lf, mode=%d", time, mode);
+  
+  if (q == nullptr) {
+    return -1;
+  }
+  
+  int64_t requestTime = av_gettime_relative();
+  async(q, "Seek", [this, time, mode, requestTime] {
+    int64_t ts = (int64_t)(time * AV_TIME_BASE);
+    
+    int rt = -1;
+    if (mode != lms::SeekModeNearestKeyframe) {
+      rt = seekByIndex(ts);
+    }
     
-  async(q, "LoadPackets", [this, count] {
-    for (int i = 0; i < count; i += 1) {
-      AVPacket *pkt = av_packet_alloc();
-      std::shared_ptr<AVPacket> guard(pkt, [] (AVPacket *p) {av_packet_unref(p); });
-      int rt = av_read_frame(context, pkt);
+    // 通过索引定位时，读取位置仍处于索引覆盖的范围内，之后读到的关键帧可以继续连续地扩展索引
+    indexContiguous = rt >= 0;
+    
+    if (rt < 0) {
+      int64_t maxTs = (mode == lms::SeekModeNearestKeyframe) ? INT64_MAX : ts;
+      
+      // stream_index为-1时，时间戳以AV_TIME_BASE为单位，由FFmpeg选择默认流进行定位
+      rt = avformat_seek_file(context, -1, INT64_MIN, ts, maxTs, 0);
+    }
+    
+    if (rt < 0) {
+      LMSLogError("Failed seeking: time=%.3lf, code=%d", time, rt);
+      return;
+    }
+    
+    serial += 1;
+    uint64_t flushSerial = serial;
+    int64_t  seekTarget  = (mode == lms::SeekModeAccurate) ? ts : -1;
+    
+    // 与数据包投递使用同一个队列，从而保证flush消息先于新位置的数据包到达
+    async(lms::hostQueue(), "DeliverFlush", [this, flushSerial, seekTarget, requestTime] {
+      // 投递之前数据源可能已经被关闭
+      if (context == nullptr) {
+        return;
+      }
       
-      if (rt >= 0) {
-        LMSLogVerbose("Loaded: st=%d, flags=0x%-2x, dts=%" PRIu64
-                      ", pts=%" PRIu64 ", dur=%" PRIu64 ", sz=%-6d",
-                      pkt->stream_index,
-                      pkt->flags,
-                      pkt->dts,
-                      pkt->pts,
-                      pkt->duration,
-                      pkt->size);
-        
-        async(lms::hostQueue(), "DeliverPacket", [this, pkt, guard] {
-          lms::PipelineMessage msg;
-          msg["type"]          = "media_packet";
-          msg["stream_object"] = context->streams[pkt->stream_index];
-          msg["packet_object"] = pkt;
-          deliverPacketMessage(msg);
-        });
+      for (unsigned i = 0; i < context->nb_streams; i += 1) {
+        lms::PipelineMessage msg;
+        msg["type"]          = "flush";
+        msg["stream_object"] = context->streams[i];
+        msg["serial"]        = flushSerial;
+        msg["request_time"]  = requestTime;
+        if (seekTarget >= 0) {
+          msg["seek_target"] = seekTarget;
+        }
+        deliverPacketMessage(msg);
       }
+    });
+  });
+  
+  return 0;
+}
+
+int FFMediaFile::seekByIndex(int64_t ts) {
+  if (indexStream < 0) {
+    return -1;
+  }
+  
+  AVStream *st = context->streams[indexStream];
+  int64_t target = av_rescale_q(ts, AV_TIME_BASE_Q, st->time_base);
+  
+  // 索引只覆盖已经解封装过的区域（或容器自带索引的范围），超出范围时无法确定之前最近的关键帧
+  auto found = keyframeIndex.upper_bound(target);
+  if (found == keyframeIndex.begin() || target > indexedUntil) {
+    return -1;
+  }
+  
+  --found;
+  int64_t kfPts = found->first;
+  int64_t kfPos = found->second;
+  
+  // 没有自带索引的容器（如MPEG-TS）按时间戳定位时需要反复二分查找，直接按字节跳转到关键帧要快得多。
+  // 自带索引的容器（MP4、MKV等）按时间戳定位已经足够快，而按字节跳转到簇的中间时demuxer会在下一个簇重新同步，
+  // 越过目标关键帧，因此只对索引由解封装过程建立的容器使用字节定位
+  int rt = -1;
+  bool byteSeekable = !containerIndexed && !(context->iformat->flags & AVFMT_NO_BYTE_SEEK);
+  if (byteSeekable && kfPos >= 0) {
+    rt = avformat_seek_file(context, -1, kfPos, kfPos, kfPos, AVSEEK_FLAG_BYTE);
+  }
+  
+  if (rt < 0) {
+    rt = avformat_seek_file(context, indexStream, INT64_MIN, kfPts, kfPts, 0);
+  }
+  
+  LMSLogInfo("Seek by keyframe index: target=%" PRIi64 ", keyframe=%" PRIi64 ", pos=%" PRIi64 ", byte=%d, code=%d",
+             target, kfPts, kfPos, byteSeekable, rt);
+  return rt;
+}
+
+void FFMediaFile::updateKeyframeIndex(const AVPacket *pkt) {
+  if (pkt->stream_index != indexStream) {
+    return;
+  }
+  
+  int64_t pts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+  if (pts == AV_NOPTS_VALUE) {
+    return;
+  }
+  
+  // 只有连续解封装过的区域才能保证其中的关键帧都已被记录。无法确定落点的seek之后，直到重新读到
+  // 索引范围内的关键帧，才能确认读取位置与已覆盖的区域相连
+  if (!indexContiguous && (pkt->flags & AV_PKT_FLAG_KEY) && pts <= indexedUntil) {
+    indexContiguous = true;
+  }
+  
+  if (indexContiguous) {
+    indexedUntil = std::max(indexedUntil, pts);
+  }
+  
+  if (pkt->flags & AV_PKT_FLAG_KEY) {
+    keyframeIndex[pts] = pkt->pos;
+  }
+}
+
+void FFMediaFile::buildKeyframeIndex() {
+  keyframeIndex.clear();
+  indexStream      = -1;
+  indexedUntil     = INT64_MIN;
+  indexContiguous  = true;
+  containerIndexed = false;
+  
+  // 以第一个被选中的视频流作为索引流，没有视频时使用第一个被选中的流
+  bool indexIsVideo = false;
+  for (unsigned i = 0; i < context->nb_streams; i += 1) {
+    if (unselected[i]) {
+      continue;
+    }
+    
+    bool isVideo = context->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO;
+    if (indexStream < 0 || (isVideo && !indexIsVideo)) {
+      indexStream  = i;
+      indexIsVideo = isVideo;
     }
+  }
+  
+  if (indexStream < 0) {
+    return;
+  }
+  
+  // 使用容器自带的索引（如MP4的stss、MKV的Cues）作为初始内容，其覆盖范围即为整个文件
+  AVStream *st = context->streams[indexStream];
+  int entries = avformat_index_get_entries_count(st);
+  for (int i = 0; i < entries; i += 1) {
+    const AVIndexEntry *e = avformat_index_get_entry(st, i);
+    if (e->flags & AVINDEX_KEYFRAME) {
+      keyframeIndex[e->timestamp] = e->pos;
+    }
+  }
+  
+  if (entries > 0) {
+    indexedUntil     = INT64_MAX;
+    containerIndexed = true;
+  }
+  
+  // 合并之前播放同一文件时建立的索引
+  if (entries == 0 && probeCache.indexStream == indexStream) {
+    keyframeIndex.insert(probeCache.keyframes.begin(), probeCache.keyframes.end());
+    indexedUntil = probeCache.indexedUntil;
+  }
+  
+  LMSLogInfo("Keyframe index: stream=%d, container_entries=%d, keyframes=%d",
+             indexStream, entries, (int)keyframeIndex.size());
+}
+
+void FFMediaFile::setStreamSelected(size_t streamIndex, bool selected) {
+  LMSLogInfo("Stream selected: stream=%zu, selected=%d", streamIndex, selected);
+  
+  if (streamIndex >= unselected.size()) {
+    return;
+  }
+  
+  if (q == nullptr) {
+    unselected[streamIndex] = !selected;
+    return;
+  }
+  
+  async(q, "SetStreamSelected", [this, streamIndex, selected] {
+    unselected[streamIndex] = !selected;
+    applyStreamDiscard();
+    buildKeyframeIndex();
   });
 }
+
+void FFMediaFile::willDeliverPacket(const AVPacket *pkt) {
+  updateKeyframeIndex(pkt);
+}
+
+uint64_t FFMediaFile::packetSerial() {
+  return serial;
+}
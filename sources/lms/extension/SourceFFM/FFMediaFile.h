@@ -1,13 +1,41 @@
 #pragma once
 
-#include <lms/MediaSource.h>
-extern "C" {
-#include <libavformat/avformat.h>
-}
+#include "FFDemuxSource.h"
+#include "ReadAheadIO.h"
+#include "ProbeCache.h"
+#include <map>
 
-namespace lms { class DispatchQueue; }
+class MappedFileIO;
 
-class FFMediaFile : public lms::MediaSource {
+/*
+ 本地文件的读取方式。无法使用指定方式读取（例如URL或不支持的平台）时，回退到FFmpeg默认的文件协议
+ */
+typedef enum {
+  FFMediaIODefault   = 0, // FFmpeg默认的文件协议
+  FFMediaIOMapped    = 1, // 通过mmap读取，参考MappedFileIO。只适用于打开后不再变化的文件：映射的长度在open时确定，
+                           // 看不到之后追加的数据；文件被截断后访问超出部分会触发SIGBUS，导致进程退出
+  FFMediaIOReadAhead = 2, // 后台线程异步预读，适用于冷缓存或网络存储，参考ReadAheadIO
+} FFMediaIOMode;
+
+/*
+ @struct FFProbeOptions
+ 流信息探测的参数，对应FFmpeg的probesize、analyzeduration与fpsprobesize选项，<=0（fpsProbeSize为<0）时使用FFmpeg的默认值
+ */
+typedef struct {
+  int64_t probeSize;       // 探测时最多读取的字节数
+  int64_t analyzeDuration; // 探测时最多分析的时长（微秒）
+  int     fpsProbeSize;    // 用于推算帧率的帧数，0表示不推算
+} FFProbeOptions;
+
+constexpr FFProbeOptions FFProbeOptionsDefault = { 0, 0, -1 };
+
+/*
+ 快速启动：只读取很少的数据进行探测。探测后仍缺失的视频参数（尺寸、像素格式、帧率）由解码出的首帧补全；
+ 音频参数缺失时无法创建音频输出，此时会退回到默认参数重新探测
+ */
+constexpr FFProbeOptions FFProbeOptionsFastStart = { 64 * 1024, 100 * 1000, 3 };
+
+class FFMediaFile : public FFDemuxSource {
 public:
   FFMediaFile(const char *path);
   ~FFMediaFile() override;
@@ -18,12 +46,54 @@ public:
   int open() override;
   void close() override;
 
+  int seek(double time, lms::SeekMode mode) override;
+  void setStreamSelected(size_t streamIndex, bool selected) override;
+
+  /*
+   @function setIOMode
+   设置本地文件的读取方式（默认为FFMediaIODefault），需要在open之前调用。
+   仍在写入（录制中）或可能被截断、轮转的文件不要使用FFMediaIOMapped
+
+   @param config 预读窗口配置，仅在FFMediaIOReadAhead模式下生效
+   */
+  void setIOMode(FFMediaIOMode mode, const ReadAheadConfig& config = ReadAheadConfigDefault);
+  
+  /*
+   @function setProbeOptions
+   设置流信息探测的参数，需要在open之前调用。命中探测缓存时不会进行探测
+   */
+  void setProbeOptions(const FFProbeOptions& options);
+
+protected:
+  void willDeliverPacket(const AVPacket *pkt) override;
+  uint64_t packetSerial() override;
+
 private:
-  void loadPackets(int numberRequested);
+  void releaseIO();
+  
+  int  seekByIndex(int64_t ts);
+  void buildKeyframeIndex();
+  void updateKeyframeIndex(const AVPacket *pkt);
+  void saveProbeCache();
+  int  probeStreams();
   
   char *path;
-  AVFormatContext *context;
-  void *obsLP;
+  FFMediaIOMode   ioMode;
+  ReadAheadConfig readAheadConfig;
+  MappedFileIO   *mappedIO;
+  ReadAheadIO    *readAheadIO;
+  FFProbeOptions  probeOptions;
+  
+  // 以下状态只在q中访问
+  uint64_t serial;
+  
+  // 关键帧索引：索引流中关键帧的pts -> 字节偏移（未知时为-1），由容器自带索引及解封装过程中读到的关键帧构成
+  int                        indexStream;
+  std::map<int64_t, int64_t> keyframeIndex;
+  int64_t                    indexedUntil;    // 索引完整覆盖的最大pts
+  bool                       indexContiguous; // 是否一直从头连续读取，seek之后为false
+  bool                       containerIndexed; // 索引来自容器自带的索引，而不是解封装过程
   
-  lms::DispatchQueue *q;
+  ProbeCache probeCache;
+  bool       probeCacheDirty;
 };
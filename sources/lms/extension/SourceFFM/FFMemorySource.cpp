@@ -0,0 +1,423 @@
+#include "FFMemorySource.h"
+#include <lms/Logger.h>
+#include <lms/Runtime.h>
+#include <lms/Events.h>
+#include <lms/Metrics.h>
+extern "C" {
+#include <libavutil/time.h>
+}
+#include <inttypes.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <memory>
+
+// arena的初始容量，之后按倍数增长
+constexpr size_t ArenaInitialSize = 1024 * 1024;
+
+// 数据包在arena中的起始位置按该值对齐，便于解码器使用SIMD读取
+constexpr size_t ArenaAlignment = 64;
+
+FFMemorySource::FFMemorySource(const char *path) {
+  LMSLogVerbose("Path=%s", path);
+
+  this->path         = strdup(path);
+  this->context      = nullptr;
+  this->arena        = nullptr;
+  this->arenaUsed    = 0;
+  this->memoryLimit  = FFMemorySourceLimitDefault;
+  this->clipDuration = 0;
+  this->cursor       = 0;
+  this->loops        = 0;
+  this->serial       = 0;
+  this->looping      = false;
+  this->keyframeOnly = false;
+  this->q            = nullptr;
+}
+
+FFMemorySource::~FFMemorySource() {
+  assert(context == nullptr);
+
+  free(this->path);
+}
+
+int FFMemorySource::numberOfStreams() {
+  return context->nb_streams;
+}
+
+lms::StreamMeta FFMemorySource::getStreamMeta(size_t streamIndex) {
+  lms::StreamMeta meta;
+
+  if (streamIndex < context->nb_streams) {
+    AVStream *stream = context->streams[streamIndex];
+    meta["source_type"]   = "avformat";
+    meta["media_type"]    = (uint64_t)stream->codecpar->codec_type;
+    meta["stream_class"]  = "AVStream";
+    meta["stream_object"] = stream;
+  }
+
+  return meta;
+}
+
+int FFMemorySource::open() {
+  LMSLogDebug("source=%p", this);
+
+  int64_t begin = av_gettime_relative();
+
+  int rt = avformat_open_input(&context, path, nullptr, nullptr);
+  if (rt != 0) {
+    LMSLogError("Failed opening video file: %s", path);
+    return rt;
+  }
+
+  lms::fireEvent("did_reach_milestone", this, {
+    { "milestone", "opened" },
+    { "time"     , (int64_t)av_gettime_relative() },
+  });
+
+  rt = avformat_find_stream_info(context, nullptr);
+  if (rt < 0) {
+    LMSLogError("Failed finding stream info");
+    avformat_close_input(&context);
+    return rt;
+  }
+
+  lms::fireEvent("did_reach_milestone", this, {
+    { "milestone", "probed" },
+    { "time"     , (int64_t)av_gettime_relative() },
+  });
+
+  rt = loadAll();
+  if (rt < 0) {
+    entries.clear();
+    av_buffer_unref(&arena);
+    arenaUsed = 0;
+    avformat_close_input(&context);
+    return rt;
+  }
+
+  unselected.assign(context->nb_streams, false);
+  cursor = 0;
+  loops  = 0;
+
+  q = lms::createDispatchQueue("LMS_FFMemorySource", lms::QueueTypeWorker);
+
+  double ms = (av_gettime_relative() - begin) / 1000.0;
+  lms::metricsObserve("source.memory.load_ms", ms);
+  LMSLogInfo("Memory source loaded: path=%s, packets=%d, arena=%zu, duration=%.3lfs, cost=%.2lfms",
+             path, (int)entries.size(), arenaUsed, clipDuration / (double)AV_TIME_BASE, ms);
+  return 0;
+}
+
+int FFMemorySource::loadAll() {
+  AVPacket *pkt = av_packet_alloc();
+
+  int64_t clipStart = INT64_MAX;
+  int64_t clipEnd   = INT64_MIN;
+
+  int rt = 0;
+  while ((rt = av_read_frame(context, pkt)) >= 0) {
+    // 每个数据包之后都保留解码器要求的填充字节
+    size_t end  = arenaUsed + pkt->size + AV_INPUT_BUFFER_PADDING_SIZE;
+    size_t next = (end + ArenaAlignment - 1) / ArenaAlignment * ArenaAlignment;
+    if (next > memoryLimit) {
+      LMSLogError("Clip exceeds memory limit: path=%s, limit=%zu", path, memoryLimit);
+      rt = AVERROR(ENOMEM);
+      break;
+    }
+
+    if (arena == nullptr || next > (size_t)arena->size) {
+      size_t capacity = arena ? (size_t)arena->size * 2 : ArenaInitialSize;
+      capacity = std::min(std::max(capacity, next), memoryLimit);
+
+      rt = av_buffer_realloc(&arena, (int)capacity);
+      if (rt < 0) {
+        break;
+      }
+    }
+
+    memcpy(arena->data + arenaUsed, pkt->data, pkt->size);
+    memset(arena->data + arenaUsed + pkt->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+    PacketEntry e;
+    e.offset      = arenaUsed;
+    e.size        = pkt->size;
+    e.streamIndex = pkt->stream_index;
+    e.flags       = pkt->flags;
+    e.pts         = pkt->pts;
+    e.dts         = pkt->dts;
+    e.duration    = pkt->duration;
+    entries.push_back(e);
+
+    arenaUsed = next;
+
+    AVStream *st = context->streams[pkt->stream_index];
+    int64_t ts = (pkt->pts != AV_NOPTS_VALUE) ? pkt->pts : pkt->dts;
+    if (ts != AV_NOPTS_VALUE) {
+      clipStart = std::min(clipStart, av_rescale_q(ts, st->time_base, AV_TIME_BASE_Q));
+      clipEnd   = std::max(clipEnd, av_rescale_q(ts + pkt->duration, st->time_base, AV_TIME_BASE_Q));
+    }
+
+    av_packet_unref(pkt);
+  }
+
+  av_packet_free(&pkt);
+
+  if (rt == AVERROR(ENOMEM)) {
+    return rt;
+  }
+
+  // 读取出错时保留已经载入的部分
+  if (rt != AVERROR_EOF) {
+    LMSLogWarning("Memory source truncated by read error: path=%s, code=%d, packets=%d", path, rt, (int)entries.size());
+  }
+
+  if (entries.empty()) {
+    return AVERROR_INVALIDDATA;
+  }
+
+  clipDuration = clipEnd > clipStart ? clipEnd - clipStart : 0;
+  return 0;
+}
+
+size_t FFMemorySource::getArenaSize() const {
+  return arenaUsed;
+}
+
+void FFMemorySource::close() {
+  LMSLogDebug("source=%p", this);
+
+  lms::release(q);
+  q = nullptr;
+
+  // 下游仍然持有的数据包各自引用着arena，会在它们全部释放之后才真正释放内存
+  av_buffer_unref(&arena);
+  arenaUsed = 0;
+  entries.clear();
+
+  avformat_close_input(&context);
+}
+
+void FFMemorySource::setLooping(bool looping) {
+  if (q == nullptr) {
+    this->looping = looping;
+    return;
+  }
+
+  async(q, "SetLooping", [this, looping] {
+    this->looping = looping;
+  });
+}
+
+void FFMemorySource::setMemoryLimit(size_t limit) {
+  // arena由单个AVBufferRef承载，其大小受int的范围限制
+  memoryLimit = std::min(limit, (size_t)INT_MAX);
+}
+
+void FFMemorySource::setKeyframeOnly(bool enabled) {
+  LMSLogInfo("Keyframe only: %d", enabled);
+
+  if (q == nullptr) {
+    keyframeOnly = enabled;
+    return;
+  }
+
+  async(q, "SetKeyframeOnly", [this, enabled] {
+    keyframeOnly = enabled;
+  });
+}
+
+void FFMemorySource::setStreamSelected(size_t streamIndex, bool selected) {
+  LMSLogInfo("Stream selected: stream=%zu, selected=%d", streamIndex, selected);
+
+  if (streamIndex >= unselected.size()) {
+    return;
+  }
+
+  if (q == nullptr) {
+    unselected[streamIndex] = !selected;
+    return;
+  }
+
+  async(q, "SetStreamSelected", [this, streamIndex, selected] {
+    unselected[streamIndex] = !selected;
+  });
+}
+
+int FFMemorySource::seek(double time, lms::SeekMode mode) {
+  LMSLogInfo("Seek: time=%.3lf, mode=%d", time, mode);
+
+  if (q == nullptr) {
+    return -1;
+  }
+
+  int64_t requestTime = av_gettime_relative();
+  async(q, "Seek", [this, time, mode, requestTime] {
+    int64_t ts = (int64_t)(time * AV_TIME_BASE);
+
+    // 以第一个被选中的视频流（没有时为第一个被选中的流）的关键帧作为定位点
+    int refStream = -1;
+    for (unsigned i = 0; i < context->nb_streams; i += 1) {
+      if (unselected[i]) {
+        continue;
+      }
+
+      if (context->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+        refStream = i;
+        break;
+      }
+
+      if (refStream < 0) {
+        refStream = i;
+      }
+    }
+
+    if (refStream < 0) {
+      return;
+    }
+
+    AVStream *st = context->streams[refStream];
+    size_t  target   = SIZE_MAX;
+    int64_t bestDiff = INT64_MAX;
+    for (size_t i = 0; i < entries.size(); i += 1) {
+      const PacketEntry& e = entries[i];
+      if (e.streamIndex != refStream || !(e.flags & AV_PKT_FLAG_KEY) || e.pts == AV_NOPTS_VALUE) {
+        continue;
+      }
+
+      int64_t pts = av_rescale_q(e.pts, st->time_base, AV_TIME_BASE_Q);
+      if (mode != lms::SeekModeNearestKeyframe && pts > ts) {
+        continue;
+      }
+
+      int64_t diff = std::abs(pts - ts);
+      if (diff < bestDiff) {
+        bestDiff = diff;
+        target   = i;
+      }
+    }
+
+    // 目标时间早于第一个关键帧时，从头开始
+    cursor = (target == SIZE_MAX) ? 0 : target;
+    loops  = 0;
+
+    serial += 1;
+    uint64_t flushSerial = serial;
+    int64_t  seekTarget  = (mode == lms::SeekModeAccurate) ? ts : -1;
+
+    // 与数据包投递使用同一个队列，从而保证flush消息先于新位置的数据包到达
+    async(lms::hostQueue(), "DeliverFlush", [this, flushSerial, seekTarget, requestTime] {
+      // 投递之前数据源可能已经被关闭
+      if (context == nullptr) {
+        return;
+      }
+
+      for (unsigned i = 0; i < context->nb_streams; i += 1) {
+        lms::PipelineMessage msg;
+        msg["type"]          = "flush";
+        msg["stream_object"] = context->streams[i];
+        msg["serial"]        = flushSerial;
+        msg["request_time"]  = requestTime;
+        if (seekTarget >= 0) {
+          msg["seek_target"] = seekTarget;
+        }
+        deliverPacketMessage(msg);
+      }
+    });
+  });
+
+  return 0;
+}
+
+void FFMemorySource::deliverEntry(const PacketEntry& e, int64_t loopOffset) {
+  AVStream *st = context->streams[e.streamIndex];
+  int64_t offset = loopOffset ? av_rescale_q(loopOffset, AV_TIME_BASE_Q, st->time_base) : 0;
+
+  // 数据包直接引用arena中的数据，不进行拷贝
+  AVPacket *pkt = av_packet_alloc();
+  pkt->buf          = av_buffer_ref(arena);
+  pkt->data         = arena->data + e.offset;
+  pkt->size         = e.size;
+  pkt->stream_index = e.streamIndex;
+  pkt->flags        = e.flags;
+  pkt->duration     = e.duration;
+  pkt->pts          = (e.pts == AV_NOPTS_VALUE) ? AV_NOPTS_VALUE : e.pts + offset;
+  pkt->dts          = (e.dts == AV_NOPTS_VALUE) ? AV_NOPTS_VALUE : e.dts + offset;
+
+  std::shared_ptr<AVPacket> guard(pkt, [] (AVPacket *p) { av_packet_free(&p); });
+
+  uint64_t pktSerial = serial;
+  async(lms::hostQueue(), "DeliverPacket", [this, pkt, guard, pktSerial] {
+    // 投递之前数据源可能已经被关闭
+    if (context == nullptr) {
+      return;
+    }
+
+    lms::PipelineMessage msg;
+    msg["type"]          = "media_packet";
+    msg["stream_object"] = context->streams[pkt->stream_index];
+    msg["packet_object"] = pkt;
+    msg["serial"]        = pktSerial;
+    deliverPacketMessage(msg);
+  });
+}
+
+void FFMemorySource::requestPackets(const lms::PacketRequest& request, lms::PacketRequestCompletion completion) {
+  LMSLogVerbose("requestPackets: streams=%d, limit=%d", (int)request.quotas.size(), request.limit);
+
+  async(q, "LoadPackets", [this, request, completion] {
+    std::map<lms::StreamId, int> remains = request.quotas;
+    int pending = 0;
+    for (auto& r : remains) {
+      pending += std::max(r.second, 0);
+    }
+
+    std::map<lms::StreamId, int> delivered;
+    bool eof = false;
+
+    // 连续被过滤的数据包数量，循环播放时用于避免在没有可投递数据包的情况下空转
+    size_t skipped = 0;
+
+    int loaded = 0;
+    while (loaded < request.limit && (request.quotas.empty() || pending > 0)) {
+      if (cursor >= entries.size()) {
+        if (!looping) {
+          eof = true;
+          break;
+        }
+
+        cursor = 0;
+        loops += 1;
+        lms::metricsAdd("source.memory.loops");
+      }
+
+      if (skipped >= entries.size()) {
+        eof = true;
+        break;
+      }
+
+      const PacketEntry& e = entries[cursor++];
+      AVStream *st = context->streams[e.streamIndex];
+
+      bool isVideo = st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO;
+      if (unselected[e.streamIndex] || (keyframeOnly && (!isVideo || !(e.flags & AV_PKT_FLAG_KEY)))) {
+        skipped += 1;
+        continue;
+      }
+
+      skipped = 0;
+      loaded += 1;
+      delivered[e.streamIndex] += 1;
+
+      auto remain = remains.find(e.streamIndex);
+      if (remain != remains.end() && remain->second > 0) {
+        remain->second -= 1;
+        pending -= 1;
+      }
+
+      deliverEntry(e, loops * clipDuration);
+    }
+
+    completion(delivered, eof);
+  });
+}
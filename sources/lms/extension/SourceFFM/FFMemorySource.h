@@ -0,0 +1,89 @@
+#pragma once
+
+#include <lms/MediaSource.h>
+#include <vector>
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+namespace lms { class DispatchQueue; }
+
+// 默认允许载入内存的数据包总大小
+constexpr size_t FFMemorySourceLimitDefault = 512 * 1024 * 1024;
+
+/*
+ @class FFMemorySource
+ 内存数据源：open时一次性解封装整个文件，把所有数据包紧凑地存放在同一块内存（arena）中，之后直接从内存中
+ 投递数据包，不再产生任何磁盘I/O。投递的数据包引用arena而不拷贝数据。
+
+ 适用于两类场景：
+   - 基准测试：排除I/O的波动，单独测量解码、重采样与渲染的吞吐量
+   - 反复播放的短片：配合循环播放，作为整个片段的缓存
+
+ @discussion
+ 循环播放时，每一轮的时间戳会在上一轮的基础上递增一个片段时长，使下游的播放时钟保持单调。
+ 数据包的side data不会被保存
+ */
+class FFMemorySource : public lms::MediaSource {
+public:
+  FFMemorySource(const char *path);
+  ~FFMemorySource() override;
+
+  int numberOfStreams() override;
+  lms::StreamMeta getStreamMeta(size_t streamIndex) override;
+
+  int open() override;
+  void close() override;
+
+  int seek(double time, lms::SeekMode mode) override;
+  void setKeyframeOnly(bool enabled) override;
+  void setStreamSelected(size_t streamIndex, bool selected) override;
+  void requestPackets(const lms::PacketRequest& request, lms::PacketRequestCompletion completion) override;
+
+  /*
+   @function setLooping
+   是否在到达结尾后从头循环播放
+   */
+  void setLooping(bool looping);
+
+  /*
+   @function setMemoryLimit
+   设置允许载入内存的数据包总大小，需要在open之前调用。超出限制时open失败
+   */
+  void setMemoryLimit(size_t limit);
+
+  // arena中数据包的总大小（含填充），open之后有效
+  size_t getArenaSize() const;
+
+private:
+  typedef struct {
+    size_t  offset;
+    int     size;
+    int     streamIndex;
+    int     flags;
+    int64_t pts;
+    int64_t dts;
+    int64_t duration;
+  } PacketEntry;
+
+  int  loadAll();
+  void deliverEntry(const PacketEntry& e, int64_t loopOffset);
+
+  char *path;
+  AVFormatContext *context;
+  AVBufferRef     *arena;
+  size_t           arenaUsed;
+  size_t           memoryLimit;
+  std::vector<PacketEntry> entries;
+  int64_t          clipDuration; // 片段时长（AV_TIME_BASE单位），用于循环播放时递增时间戳
+
+  // 以下状态只在q中访问
+  size_t   cursor;
+  int64_t  loops;
+  uint64_t serial;
+  bool     looping;
+  bool     keyframeOnly;
+  std::vector<bool> unselected;
+
+  lms::DispatchQueue *q;
+};
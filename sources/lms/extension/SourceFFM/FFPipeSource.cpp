@@ -0,0 +1,195 @@
+#include "FFPipeSource.h"
+#include <lms/Logger.h>
+#include <lms/Runtime.h>
+#include <lms/Events.h>
+#include <lms/Metrics.h>
+extern "C" {
+#include <libavutil/time.h>
+}
+
+// 低延迟模式的探测参数：最多读取的字节数与分析的时长（微秒），不推算帧率
+constexpr int64_t LowLatencyProbeSize       = 32 * 1024;
+constexpr int64_t LowLatencyAnalyzeDuration = 50 * 1000;
+
+FFPipeSource::FFPipeSource(int fd, bool ownsFd) {
+  LMSLogVerbose("fd=%d", fd);
+
+  this->fd            = fd;
+  this->ownsFd        = ownsFd;
+  this->lowLatency    = false;
+  this->hasPipeConfig = false;
+  this->pipeConfig    = PipeIOConfigDefault;
+  this->inputFormat   = nullptr;
+  this->pipeIO        = nullptr;
+}
+
+FFPipeSource::~FFPipeSource() {
+  assert(context == nullptr);
+}
+
+void FFPipeSource::setLowLatency(bool enabled) {
+  lowLatency = enabled;
+}
+
+void FFPipeSource::setInputFormat(const char *name) {
+  inputFormat = name ? av_find_input_format(name) : nullptr;
+  if (name && inputFormat == nullptr) {
+    LMSLogWarning("Unknown input format: %s, fallback to probing", name);
+  }
+}
+
+void FFPipeSource::setPipeConfig(const PipeIOConfig& config) {
+  pipeConfig    = config;
+  hasPipeConfig = true;
+}
+
+int FFPipeSource::numberOfStreams() {
+  return context->nb_streams;
+}
+
+lms::StreamMeta FFPipeSource::getStreamMeta(size_t streamIndex) {
+  lms::StreamMeta meta;
+
+  if (streamIndex < context->nb_streams) {
+    AVStream *stream = context->streams[streamIndex];
+    meta["source_type"]   = "avformat";
+    meta["media_type"]    = (uint64_t)stream->codecpar->codec_type;
+    meta["stream_class"]  = "AVStream";
+    meta["stream_object"] = stream;
+  }
+
+  return meta;
+}
+
+int FFPipeSource::open() {
+  LMSLogDebug("source=%p", this);
+
+  int64_t openBegin = av_gettime_relative();
+
+  PipeIOConfig config = hasPipeConfig ? pipeConfig : (lowLatency ? PipeIOConfigLowLatency : PipeIOConfigDefault);
+
+  // fd的所有权交给PipeIO，在close时随之关闭
+  pipeIO = PipeIO::open(fd, ownsFd, config);
+  if (pipeIO == nullptr) {
+    LMSLogError("Failed opening pipe: fd=%d", fd);
+    return AVERROR(EINVAL);
+  }
+
+  context = avformat_alloc_context();
+  context->pb     = pipeIO->getIOContext();
+  context->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+  AVDictionary *opts = nullptr;
+  if (lowLatency) {
+    av_dict_set_int(&opts, "probesize", LowLatencyProbeSize, 0);
+    av_dict_set_int(&opts, "analyzeduration", LowLatencyAnalyzeDuration, 0);
+    av_dict_set_int(&opts, "fpsprobesize", 0, 0);
+  }
+
+  int rt = avformat_open_input(&context, "pipe:", (AVInputFormat *)inputFormat, &opts);
+  av_dict_free(&opts);
+  if (rt != 0) {
+    LMSLogError("Failed opening pipe input: fd=%d, code=%d", fd, rt);
+
+    // avformat_open_input失败时会释放context，但不会释放自定义的AVIOContext
+    delete pipeIO;
+    pipeIO = nullptr;
+    return rt;
+  }
+
+  int64_t probeBegin = av_gettime_relative();
+  lms::fireEvent("did_reach_milestone", this, {
+    { "milestone", "opened"   },
+    { "time"     , probeBegin },
+  });
+
+  rt = avformat_find_stream_info(context, nullptr);
+
+  // 音频输出在创建时就需要完整的参数，探测量过小时放宽限制继续探测（已读取的数据不会丢失）
+  bool audioComplete = true;
+  for (unsigned i = 0; rt >= 0 && i < context->nb_streams; i += 1) {
+    auto par = context->streams[i]->codecpar;
+    if (par->codec_type == AVMEDIA_TYPE_AUDIO && (par->sample_rate <= 0 || par->channels <= 0)) {
+      audioComplete = false;
+    }
+  }
+
+  if (rt >= 0 && !audioComplete) {
+    LMSLogWarning("Audio parameters incomplete after probing, retry with default probe options");
+    context->probesize            = 5000000;
+    context->max_analyze_duration = 0;
+    rt = avformat_find_stream_info(context, nullptr);
+  }
+
+  if (rt < 0) {
+    LMSLogError("Failed finding stream info");
+    avformat_close_input(&context);
+    delete pipeIO;
+    pipeIO = nullptr;
+    return rt;
+  }
+
+  av_dump_format(context, 0, "pipe:", 0);
+
+  int64_t openEnd = av_gettime_relative();
+  lms::fireEvent("did_reach_milestone", this, {
+    { "milestone", "probed" },
+    { "time"     , openEnd  },
+  });
+
+  double openMS  = (openEnd - openBegin) / 1000.0;
+  double probeMS = (openEnd - probeBegin) / 1000.0;
+  lms::metricsObserve("source.pipe.open_ms", openMS);
+  lms::metricsObserve("source.open.probe_ms", probeMS);
+  LMSLogInfo("Pipe source opened: fd=%d, format=%s, low_latency=%d, cost=%.2lfms, probe=%.2lfms",
+             fd, context->iformat->name, lowLatency, openMS, probeMS);
+
+  // 默认选中所有流
+  unselected.assign(context->nb_streams, false);
+  applyStreamDiscard();
+
+  q = lms::createDispatchQueue("LMS_FFPipeSource", lms::QueueTypeWorker);
+
+  return 0;
+}
+
+void FFPipeSource::close() {
+  LMSLogDebug("source=%p", this);
+
+  // 先中断等待数据的读取，工作队列才能结束
+  if (pipeIO) {
+    pipeIO->abort();
+  }
+
+  lms::release(q);
+  q = nullptr;
+
+  avformat_close_input(&context);
+
+  // 自定义的AVIOContext需要在avformat_close_input之后自行释放
+  delete pipeIO;
+  pipeIO = nullptr;
+}
+
+void FFPipeSource::setStreamSelected(size_t streamIndex, bool selected) {
+  LMSLogInfo("Stream selected: stream=%zu, selected=%d", streamIndex, selected);
+
+  if (streamIndex >= unselected.size()) {
+    return;
+  }
+
+  if (q == nullptr) {
+    unselected[streamIndex] = !selected;
+    return;
+  }
+
+  async(q, "SetStreamSelected", [this, streamIndex, selected] {
+    unselected[streamIndex] = !selected;
+    applyStreamDiscard();
+  });
+}
+
+bool FFPipeSource::isEndOfInput(int rt) {
+  // 数据尚未到达时av_read_frame会等待，写入端关闭、close中断等待或读取出错后结束
+  return rt == AVERROR_EOF || rt == AVERROR_EXIT || (rt < 0 && context->pb->error < 0);
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "FFDemuxSource.h"
+#include "PipeIO.h"
+
+/*
+ @class FFPipeSource
+ 流式数据源：从任意fd（管道、Unix socket等）读取并解封装，适用于由其他本地进程实时写入的数据，
+ 例如录制进程通过管道输出的MPEG-TS。数据只能顺序读取，不支持seek。
+
+ @discussion
+ 低延迟模式下使用很小的探测量与AVIO缓冲区，并跳过帧率推算，尽早开始投递数据包；
+ 探测不出完整的音频参数时，与FFMediaFile一样会放宽限制重新探测。
+ 数据尚未到达时，加载请求会在数据源的工作队列中等待，close时中断等待
+ */
+class FFPipeSource : public FFDemuxSource {
+public:
+  /*
+   @param ownsFd 为true时fd在close时被关闭，之后不能再次open
+   */
+  FFPipeSource(int fd, bool ownsFd);
+  ~FFPipeSource() override;
+
+  int numberOfStreams() override;
+  lms::StreamMeta getStreamMeta(size_t streamIndex) override;
+
+  int open() override;
+  void close() override;
+
+  void setStreamSelected(size_t streamIndex, bool selected) override;
+
+  /*
+   @function setLowLatency
+   是否开启低延迟模式，需要在open之前调用
+   */
+  void setLowLatency(bool enabled);
+
+  /*
+   @function setInputFormat
+   指定输入格式的名称（例如"mpegts"），跳过格式探测。需要在open之前调用，默认自动探测
+   */
+  void setInputFormat(const char *name);
+
+  /*
+   @function setPipeConfig
+   设置缓冲配置，需要在open之前调用。默认根据是否为低延迟模式选择PipeIOConfigDefault或PipeIOConfigLowLatency
+   */
+  void setPipeConfig(const PipeIOConfig& config);
+
+protected:
+  bool isEndOfInput(int rt) override;
+
+private:
+  int  fd;
+  bool ownsFd;
+  bool lowLatency;
+  bool hasPipeConfig;
+  PipeIOConfig pipeConfig;
+  const AVInputFormat *inputFormat;
+
+  PipeIO *pipeIO;
+};
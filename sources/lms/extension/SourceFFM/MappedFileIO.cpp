@@ -0,0 +1,148 @@
+#include "MappedFileIO.h"
+#include <lms/Logger.h>
+#include <string.h>
+#include <algorithm>
+#if defined(__APPLE__) || defined(__unix__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define LMS_HAS_MMAP 1
+#endif
+
+// AVIO内部缓冲区大小，超过该大小的读取请求会直接从映射页拷贝到调用者的缓冲区
+constexpr int MappedIOBufferSize = 32 * 1024;
+
+// 读取位置前方保持的预读窗口大小，剩余预读量不足一半时再发起下一段预读
+constexpr size_t MappedReadAheadSize = 8 * 1024 * 1024;
+
+MappedFileIO::MappedFileIO() {
+  base       = nullptr;
+  size       = 0;
+  pos        = 0;
+  advisedEnd = 0;
+  io         = nullptr;
+}
+
+MappedFileIO::~MappedFileIO() {
+  if (io) {
+    av_freep(&io->buffer);
+    avio_context_free(&io);
+  }
+
+#ifdef LMS_HAS_MMAP
+  if (base) {
+    munmap(base, size);
+  }
+#endif
+}
+
+MappedFileIO *MappedFileIO::open(const char *path) {
+#ifdef LMS_HAS_MMAP
+  // 带协议前缀的路径（如http://、pipe:）交由FFmpeg处理，file:前缀则可以直接去掉
+  if (strncmp(path, "file:", 5) == 0) {
+    path += 5;
+  } else if (strstr(path, ":") != nullptr && access(path, F_OK) != 0) {
+    return nullptr;
+  }
+
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0) {
+    return nullptr;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    ::close(fd);
+    return nullptr;
+  }
+
+  void *addr = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  // 映射建立后文件描述符就不再需要了
+  ::close(fd);
+
+  if (addr == MAP_FAILED) {
+    LMSLogWarning("Failed mapping file: %s", path);
+    return nullptr;
+  }
+
+  auto mf = new MappedFileIO;
+  mf->base = (uint8_t *)addr;
+  mf->size = (size_t)st.st_size;
+
+  madvise(mf->base, mf->size, MADV_SEQUENTIAL);
+  mf->readAhead();
+
+  auto buffer = (unsigned char *)av_malloc(MappedIOBufferSize);
+  mf->io = avio_alloc_context(buffer, MappedIOBufferSize, 0, mf, readPacket, nullptr, seek);
+  if (mf->io == nullptr) {
+    av_free(buffer);
+    delete mf;
+    return nullptr;
+  }
+
+  LMSLogInfo("Mapped file: %s, size=%zu", path, mf->size);
+  return mf;
+#else
+  return nullptr;
+#endif
+}
+
+void MappedFileIO::readAhead() {
+#ifdef LMS_HAS_MMAP
+  if (advisedEnd >= size || advisedEnd - std::min(advisedEnd, pos) > MappedReadAheadSize / 2) {
+    return;
+  }
+
+  // madvise要求起始地址按页对齐
+  size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+  size_t begin    = std::max(pos, advisedEnd) / pageSize * pageSize;
+  size_t end      = std::min(pos + MappedReadAheadSize, size);
+  if (end <= begin) {
+    return;
+  }
+
+  madvise(base + begin, end - begin, MADV_WILLNEED);
+  advisedEnd = end;
+#endif
+}
+
+int MappedFileIO::readPacket(void *opaque, uint8_t *buf, int bufSize) {
+  auto self = (MappedFileIO *)opaque;
+
+  if (self->pos >= self->size) {
+    return AVERROR_EOF;
+  }
+
+  size_t n = std::min((size_t)bufSize, self->size - self->pos);
+  memcpy(buf, self->base + self->pos, n);
+  self->pos += n;
+
+  self->readAhead();
+  return (int)n;
+}
+
+int64_t MappedFileIO::seek(void *opaque, int64_t offset, int whence) {
+  auto self = (MappedFileIO *)opaque;
+
+  int64_t target;
+  switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE: return (int64_t)self->size;
+    case SEEK_SET:    target = offset; break;
+    case SEEK_CUR:    target = (int64_t)self->pos + offset; break;
+    case SEEK_END:    target = (int64_t)self->size + offset; break;
+    default:          return AVERROR(EINVAL);
+  }
+
+  if (target < 0 || target > (int64_t)self->size) {
+    return AVERROR(EINVAL);
+  }
+
+  // 跳转后原有的预读区域不再有意义，从新位置重新开始预读
+  self->pos        = (size_t)target;
+  self->advisedEnd = self->pos;
+  self->readAhead();
+
+  return target;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+/*
+ @class MappedFileIO
+ 基于mmap的AVIOContext。demuxer的读取操作直接从映射内存中拷贝数据，不再产生read()系统调用；
+ 同时在读取位置前方持续通过madvise(MADV_WILLNEED)发起异步预读，使缺页尽量在读取之前就已完成。
+
+ @discussion
+ avio_read在请求大小超过内部缓冲区时会绕开缓冲区直接调用read_packet，因此这里使用较小的内部缓冲区，
+ 让体积较大的视频数据包可以从映射页一次性拷贝到AVPacket中，而不必经过AVIO缓冲区中转。
+
+ 映射的长度固定为open时的文件大小：之后追加的数据不可见；文件在映射期间被截断时，访问超出新长度的页会收到SIGBUS，
+ 进程直接退出，而不是像read()那样返回EOF。因此只能用于打开后不再变化的文件
+ */
+class MappedFileIO {
+public:
+  /*
+   @function open
+   映射本地文件并创建对应的AVIOContext。不支持mmap的平台、非本地路径或映射失败时返回nullptr，
+   此时调用者应回退到FFmpeg默认的文件协议
+   */
+  static MappedFileIO *open(const char *path);
+
+  ~MappedFileIO();
+
+  AVIOContext *getIOContext() {
+    return io;
+  }
+
+  size_t getSize() const {
+    return size;
+  }
+
+private:
+  MappedFileIO();
+
+  static int     readPacket(void *opaque, uint8_t *buf, int bufSize);
+  static int64_t seek(void *opaque, int64_t offset, int whence);
+
+  void readAhead();
+
+  uint8_t     *base;
+  size_t       size;
+  size_t       pos;
+  size_t       advisedEnd; // 已发起预读的区域末尾
+  AVIOContext *io;
+};
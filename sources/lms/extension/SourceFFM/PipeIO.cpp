@@ -0,0 +1,255 @@
+#include "PipeIO.h"
+#include <lms/Logger.h>
+#include <lms/Metrics.h>
+#include <lms/Runtime.h>
+#include <errno.h>
+#include <string.h>
+extern "C" {
+#include <libavutil/time.h>
+}
+#include <algorithm>
+#if defined(__APPLE__) || defined(__unix__)
+#include <poll.h>
+#include <unistd.h>
+#define LMS_HAS_POLL 1
+#endif
+
+// 等待fd可读、或等待缓冲区状态变化的最长时间。只影响abort之后泵线程退出的延迟，不影响数据到达的延迟
+constexpr int PipeIOWaitMS = 50;
+
+PipeIO::PipeIO(int fd, bool ownsFd, const PipeIOConfig& config) {
+  size_t size = 4096;
+  while (size < config.ringSize) {
+    size <<= 1;
+  }
+
+  this->fd            = fd;
+  this->ownsFd        = ownsFd;
+  this->config        = config;
+  this->io            = nullptr;
+  this->pumpQueue     = nullptr;
+  this->ring.resize(size);
+  this->mask          = size - 1;
+  this->head          = 0;
+  this->tail          = 0;
+  this->readerWaiting = false;
+  this->writerWaiting = false;
+  this->finished      = false;
+  this->aborted       = false;
+  this->error         = 0;
+  this->peakBuffered  = 0;
+  this->mutex         = SDL_CreateMutex();
+  this->readable      = SDL_CreateCond();
+  this->writable      = SDL_CreateCond();
+}
+
+PipeIO::~PipeIO() {
+  // 释放队列会等待泵线程退出
+  abort();
+  lms::release(pumpQueue);
+
+  LMSLogInfo("Pipe closed: fd=%d, received=%llu, peak_buffered=%zu",
+             fd, (unsigned long long)head.load(), peakBuffered.load());
+
+  if (io) {
+    av_freep(&io->buffer);
+    avio_context_free(&io);
+  }
+
+#ifdef LMS_HAS_POLL
+  if (ownsFd) {
+    ::close(fd);
+  }
+#endif
+
+  SDL_DestroyCond(writable);
+  SDL_DestroyCond(readable);
+  SDL_DestroyMutex(mutex);
+}
+
+PipeIO *PipeIO::open(int fd, bool ownsFd, const PipeIOConfig& config) {
+#ifdef LMS_HAS_POLL
+  if (fd < 0 || config.ioBufferSize <= 0) {
+    LMSLogError("Invalid pipe: fd=%d, io_buffer_size=%d", fd, config.ioBufferSize);
+    return nullptr;
+  }
+
+  auto pio = new PipeIO(fd, ownsFd, config);
+
+  auto buffer = (unsigned char *)av_malloc(config.ioBufferSize);
+  pio->io = avio_alloc_context(buffer, config.ioBufferSize, 0, pio, readPacket, nullptr, nullptr);
+  if (pio->io == nullptr) {
+    av_free(buffer);
+    pio->ownsFd = false;
+    delete pio;
+    return nullptr;
+  }
+
+  pio->io->seekable = 0;
+
+  pio->pumpQueue = lms::createDispatchQueue("LMS_PipeIO", lms::QueueTypeWorker);
+  lms::async(pio->pumpQueue, "Pump", [pio] {
+    pio->pump();
+  });
+
+  LMSLogInfo("Pipe opened: fd=%d, ring_size=%zu, io_buffer_size=%d", fd, pio->ring.size(), config.ioBufferSize);
+  return pio;
+#else
+  return nullptr;
+#endif
+}
+
+void PipeIO::abort() {
+  aborted = true;
+
+  SDL_LockMutex(mutex);
+  {
+    SDL_CondBroadcast(readable);
+    SDL_CondBroadcast(writable);
+  }
+  SDL_UnlockMutex(mutex);
+}
+
+uint64_t PipeIO::getBytesReceived() const {
+  return head.load();
+}
+
+size_t PipeIO::getPeakBuffered() const {
+  return peakBuffered.load();
+}
+
+void PipeIO::pump() {
+#ifdef LMS_HAS_POLL
+  while (!aborted) {
+    uint64_t h = head.load(std::memory_order_relaxed);
+    uint64_t t = tail.load(std::memory_order_acquire);
+    size_t space = ring.size() - (size_t)(h - t);
+
+    // 缓冲区已满：等待demuxer取走数据。先声明等待再检查，与readPacket中的通知配合，不会错过唤醒
+    if (space == 0) {
+      SDL_LockMutex(mutex);
+      {
+        writerWaiting = true;
+        if (tail.load() == t && !aborted) {
+          SDL_CondWaitTimeout(writable, mutex, PipeIOWaitMS);
+        }
+        writerWaiting = false;
+      }
+      SDL_UnlockMutex(mutex);
+      continue;
+    }
+
+    struct pollfd pfd;
+    pfd.fd      = fd;
+    pfd.events  = POLLIN;
+    pfd.revents = 0;
+
+    int pr = poll(&pfd, 1, PipeIOWaitMS);
+    if (pr == 0 || (pr < 0 && errno == EINTR)) {
+      continue;
+    }
+
+    if (pr < 0) {
+      error = AVERROR(errno);
+      break;
+    }
+
+    // 一次最多读到环形缓冲区的末尾，回绕部分留给下一轮
+    size_t offset = (size_t)h & mask;
+    size_t want   = std::min(space, ring.size() - offset);
+
+    ssize_t n = ::read(fd, ring.data() + offset, want);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+      continue;
+    }
+
+    if (n < 0) {
+      error = AVERROR(errno);
+      LMSLogError("Failed reading pipe: fd=%d, errno=%d", fd, errno);
+      break;
+    }
+
+    if (n == 0) {
+      break;
+    }
+
+    head.store(h + n, std::memory_order_release);
+    peakBuffered = std::max(peakBuffered.load(), (size_t)(h + n - t));
+
+    if (readerWaiting) {
+      SDL_LockMutex(mutex);
+      {
+        SDL_CondSignal(readable);
+      }
+      SDL_UnlockMutex(mutex);
+    }
+  }
+#endif
+
+  finished = true;
+
+  SDL_LockMutex(mutex);
+  {
+    SDL_CondBroadcast(readable);
+  }
+  SDL_UnlockMutex(mutex);
+}
+
+int PipeIO::readPacket(void *opaque, uint8_t *buf, int bufSize) {
+  auto self = (PipeIO *)opaque;
+
+  int64_t waitBegin = 0;
+  while (true) {
+    uint64_t t = self->tail.load(std::memory_order_relaxed);
+    uint64_t h = self->head.load(std::memory_order_acquire);
+
+    if (h != t) {
+      size_t n      = std::min((size_t)bufSize, (size_t)(h - t));
+      size_t offset = (size_t)t & self->mask;
+      size_t first  = std::min(n, self->ring.size() - offset);
+
+      memcpy(buf, self->ring.data() + offset, first);
+      memcpy(buf + first, self->ring.data(), n - first);
+      self->tail.store(t + n, std::memory_order_release);
+
+      if (self->writerWaiting) {
+        SDL_LockMutex(self->mutex);
+        {
+          SDL_CondSignal(self->writable);
+        }
+        SDL_UnlockMutex(self->mutex);
+      }
+
+      if (waitBegin > 0) {
+        lms::metricsObserve("source.pipe.wait_ms", (av_gettime_relative() - waitBegin) / 1000.0);
+      }
+      return (int)n;
+    }
+
+    if (self->aborted) {
+      return AVERROR_EXIT;
+    }
+
+    // finished在最后一次推进写入位置之后才被设置，此时缓冲区中已经没有剩余数据
+    if (self->finished) {
+      if (self->head.load() != t) {
+        continue;
+      }
+      return self->error != 0 ? self->error.load() : AVERROR_EOF;
+    }
+
+    if (waitBegin == 0) {
+      waitBegin = av_gettime_relative();
+    }
+
+    SDL_LockMutex(self->mutex);
+    {
+      self->readerWaiting = true;
+      if (self->head.load() == t && !self->finished && !self->aborted) {
+        SDL_CondWaitTimeout(self->readable, self->mutex, PipeIOWaitMS);
+      }
+      self->readerWaiting = false;
+    }
+    SDL_UnlockMutex(self->mutex);
+  }
+}
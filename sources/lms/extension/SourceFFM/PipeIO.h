@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+extern "C" {
+#include <libavformat/avformat.h>
+#include <SDL2/SDL.h>
+}
+
+namespace lms { class DispatchQueue; }
+
+/*
+ @struct PipeIOConfig
+ 管道读取的缓冲配置
+ */
+typedef struct {
+  size_t ringSize;     // 环形缓冲区大小，向上取整为2的幂。缓冲区满时不再从fd读取，写入端随之被阻塞
+  int    ioBufferSize; // AVIO内部缓冲区大小，越小则单次读取返回得越早
+} PipeIOConfig;
+
+constexpr PipeIOConfig PipeIOConfigDefault    = { 4 * 1024 * 1024, 32 * 1024 };
+constexpr PipeIOConfig PipeIOConfigLowLatency = { 1 * 1024 * 1024, 4  * 1024 };
+
+/*
+ @class PipeIO
+ 从任意fd（管道、Unix socket、字符设备等）读取数据的AVIOContext，不支持seek。
+
+ 后台的泵线程在fd可读时立即把数据读入环形缓冲区，demuxer从环形缓冲区中取数据：有多少取多少，
+ 不会为了填满AVIO的缓冲区而等待，因此写入端写出的数据可以尽快到达解封装与解码。
+
+ @discussion
+ 环形缓冲区是单生产者单消费者的无锁结构，泵线程只推进写入位置，demuxer只推进读取位置；
+ 只有在缓冲区为空（demuxer等待数据）或已满（泵线程等待空间）时才通过条件变量等待。
+ 内存占用固定为ringSize，写入端快于读取端时，由fd自身的阻塞对写入端形成背压
+ */
+class PipeIO {
+public:
+  /*
+   @function open
+   开始从fd读取并创建对应的AVIOContext
+
+   @param ownsFd 为true时fd在PipeIO释放时被关闭
+   */
+  static PipeIO *open(int fd, bool ownsFd, const PipeIOConfig& config);
+
+  ~PipeIO();
+
+  AVIOContext *getIOContext() {
+    return io;
+  }
+
+  /*
+   @function abort
+   中断阻塞中的读取并停止泵线程，之后的读取均返回AVERROR_EXIT。用于在demuxer等待数据时关闭数据源
+   */
+  void abort();
+
+  // 累计收到的字节数与环形缓冲区中数据量的最大值
+  uint64_t getBytesReceived() const;
+  size_t   getPeakBuffered() const;
+
+private:
+  PipeIO(int fd, bool ownsFd, const PipeIOConfig& config);
+
+  static int readPacket(void *opaque, uint8_t *buf, int bufSize);
+
+  // 在泵线程中执行，直到读到结尾、出错或abort
+  void pump();
+
+  int  fd;
+  bool ownsFd;
+
+  PipeIOConfig config;
+  AVIOContext *io;
+  lms::DispatchQueue *pumpQueue;
+
+  std::vector<uint8_t>  ring;
+  size_t                mask;
+  std::atomic<uint64_t> head; // 累计写入的字节数，只由泵线程推进
+  std::atomic<uint64_t> tail; // 累计读出的字节数，只由demuxer推进
+
+  std::atomic<bool> readerWaiting;
+  std::atomic<bool> writerWaiting;
+  std::atomic<bool> finished;
+  std::atomic<bool> aborted;
+  std::atomic<int>  error;
+  std::atomic<size_t> peakBuffered;
+
+  SDL_mutex *mutex;
+  SDL_cond  *readable;
+  SDL_cond  *writable;
+};
@@ -0,0 +1,289 @@
+#include "ProbeCache.h"
+#include <lms/Logger.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__APPLE__) || defined(__unix__)
+#include <sys/stat.h>
+#include <sys/types.h>
+#define LMS_HAS_STAT 1
+#endif
+
+// 缓存文件的格式版本，格式发生变化时应递增，使旧版本的缓存自动失效
+constexpr int ProbeCacheVersion = 1;
+
+static std::string _cacheDir;
+static bool        _cacheDirInited = false;
+
+void setProbeCacheDirectory(const char *dir) {
+  _cacheDir = dir ? dir : "";
+  _cacheDirInited = true;
+}
+
+static const std::string& cacheDirectory() {
+  if (!_cacheDirInited) {
+    const char *home = getenv("HOME");
+    _cacheDir = home ? std::string(home) + "/.lms_probe_cache" : "";
+    _cacheDirInited = true;
+  }
+
+  return _cacheDir;
+}
+
+// FNV-1a，仅用于由文件身份生成缓存文件名，缓存内容中另外保存完整的身份信息用于校验
+static uint64_t hashIdentity(const std::string& s) {
+  uint64_t h = 14695981039346656037ULL;
+  for (unsigned char c : s) {
+    h ^= c;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+ProbeCache::ProbeCache() {
+  indexStream  = -1;
+  indexedUntil = INT64_MIN;
+  valid        = false;
+  startTime    = AV_NOPTS_VALUE;
+  duration     = AV_NOPTS_VALUE;
+  bitRate      = 0;
+}
+
+ProbeCache::~ProbeCache() {
+  clearStreams();
+}
+
+void ProbeCache::clearStreams() {
+  for (auto& s : streams) {
+    avcodec_parameters_free(&s.params);
+  }
+  streams.clear();
+}
+
+bool ProbeCache::load(const char *path) {
+  valid = false;
+  cachePath.clear();
+  identity.clear();
+
+#ifdef LMS_HAS_STAT
+  const std::string& dir = cacheDirectory();
+  if (dir.empty()) {
+    return false;
+  }
+
+  if (strncmp(path, "file:", 5) == 0) {
+    path += 5;
+  }
+
+  struct stat st;
+  if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+    return false;
+  }
+
+  char buffer[128];
+  snprintf(buffer, sizeof(buffer), "%llu:%llu:%lld:%lld",
+           (unsigned long long)st.st_dev, (unsigned long long)st.st_ino, (long long)st.st_size, (long long)st.st_mtime);
+  identity = buffer;
+
+  snprintf(buffer, sizeof(buffer), "/%016llx.probe", (unsigned long long)hashIdentity(identity));
+  cachePath = dir + buffer;
+
+  FILE *fp = fopen(cachePath.c_str(), "r");
+  if (fp == nullptr) {
+    return false;
+  }
+
+  int  version = 0;
+  char storedIdentity[128] = {0};
+  int  nbStreams = 0;
+  bool ok = fscanf(fp, "lms-probe-cache %d\n", &version) == 1 && version == ProbeCacheVersion
+         && fscanf(fp, "identity %127s\n", storedIdentity) == 1 && identity == storedIdentity
+         && fscanf(fp, "format %" SCNd64 " %" SCNd64 " %" SCNd64 " %d\n", &startTime, &duration, &bitRate, &nbStreams) == 4;
+
+  clearStreams();
+  for (int i = 0; ok && i < nbStreams; i += 1) {
+    StreamRecord r;
+    r.params = avcodec_parameters_alloc();
+    streams.push_back(r);
+
+    AVCodecParameters *p = r.params;
+    int codecType, codecId, extradataSize;
+    unsigned codecTag;
+    ok = fscanf(fp, "stream %d %d %u %d %" SCNd64 " %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %" SCNu64
+                    " %d %d %d %d %d %d %d\n",
+                &codecType, &codecId, &codecTag, &p->format, &p->bit_rate,
+                &p->bits_per_coded_sample, &p->bits_per_raw_sample, &p->profile, &p->level,
+                &p->width, &p->height, &p->sample_aspect_ratio.num, &p->sample_aspect_ratio.den,
+                (int *)&p->field_order, (int *)&p->color_range, (int *)&p->color_primaries, (int *)&p->color_trc,
+                (int *)&p->color_space, (int *)&p->chroma_location, &p->video_delay,
+                &p->channel_layout, &p->channels, &p->sample_rate, &p->block_align, &p->frame_size,
+                &p->initial_padding, &p->trailing_padding, &p->seek_preroll) == 28;
+
+    p->codec_type = (AVMediaType)codecType;
+    p->codec_id   = (AVCodecID)codecId;
+    p->codec_tag  = codecTag;
+
+    StreamRecord& rec = streams.back();
+    ok = ok && fscanf(fp, "timing %d %d %d %d %d %d %" SCNd64 " %" SCNd64 " %" SCNd64 "\n",
+                      &rec.avgFrameRate.num, &rec.avgFrameRate.den,
+                      &rec.rFrameRate.num, &rec.rFrameRate.den,
+                      &rec.sampleAspectRatio.num, &rec.sampleAspectRatio.den,
+                      &rec.startTime, &rec.duration, &rec.nbFrames) == 9;
+
+    ok = ok && fscanf(fp, "extradata %d", &extradataSize) == 1 && extradataSize >= 0;
+    if (ok && extradataSize > 0) {
+      p->extradata      = (uint8_t *)av_mallocz(extradataSize + AV_INPUT_BUFFER_PADDING_SIZE);
+      p->extradata_size = extradataSize;
+      for (int b = 0; ok && b < extradataSize; b += 1) {
+        unsigned v;
+        ok = fscanf(fp, "%2x", &v) == 1;
+        p->extradata[b] = (uint8_t)v;
+      }
+    }
+    fscanf(fp, "\n");
+  }
+
+  int nbKeyframes = 0;
+  keyframes.clear();
+  ok = ok && fscanf(fp, "keyframes %d %" SCNd64 " %d\n", &indexStream, &indexedUntil, &nbKeyframes) == 3;
+  for (int i = 0; ok && i < nbKeyframes; i += 1) {
+    int64_t pts, pos;
+    ok = fscanf(fp, "%" SCNd64 " %" SCNd64 "\n", &pts, &pos) == 2;
+    keyframes[pts] = pos;
+  }
+
+  fclose(fp);
+
+  if (!ok) {
+    LMSLogWarning("Probe cache ignored: path=%s, version=%d", cachePath.c_str(), version);
+    clearStreams();
+    keyframes.clear();
+    indexStream  = -1;
+    indexedUntil = INT64_MIN;
+    return false;
+  }
+
+  valid = true;
+  LMSLogInfo("Probe cache loaded: path=%s, streams=%d, keyframes=%d", cachePath.c_str(), nbStreams, nbKeyframes);
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool ProbeCache::apply(AVFormatContext *ctx) const {
+  if (!valid || ctx->nb_streams != streams.size()) {
+    return false;
+  }
+
+  // 容器头部已经给出了codec类型的流必须与缓存一致，否则说明文件内容与缓存不匹配
+  for (unsigned i = 0; i < ctx->nb_streams; i += 1) {
+    const AVCodecParameters *par = ctx->streams[i]->codecpar;
+    if (par->codec_id != AV_CODEC_ID_NONE && par->codec_id != streams[i].params->codec_id) {
+      return false;
+    }
+  }
+
+  for (unsigned i = 0; i < ctx->nb_streams; i += 1) {
+    AVStream *st = ctx->streams[i];
+    const StreamRecord& r = streams[i];
+
+    avcodec_parameters_copy(st->codecpar, r.params);
+    st->avg_frame_rate      = r.avgFrameRate;
+    st->r_frame_rate        = r.rFrameRate;
+    st->sample_aspect_ratio = r.sampleAspectRatio;
+    st->start_time          = r.startTime;
+    st->duration            = r.duration;
+    st->nb_frames           = r.nbFrames;
+  }
+
+  ctx->start_time = startTime;
+  ctx->duration   = duration;
+  ctx->bit_rate   = bitRate;
+  return true;
+}
+
+void ProbeCache::capture(const AVFormatContext *ctx) {
+  clearStreams();
+
+  for (unsigned i = 0; i < ctx->nb_streams; i += 1) {
+    const AVStream *st = ctx->streams[i];
+
+    StreamRecord r;
+    r.params = avcodec_parameters_alloc();
+    avcodec_parameters_copy(r.params, st->codecpar);
+    r.avgFrameRate      = st->avg_frame_rate;
+    r.rFrameRate        = st->r_frame_rate;
+    r.sampleAspectRatio = st->sample_aspect_ratio;
+    r.startTime         = st->start_time;
+    r.duration          = st->duration;
+    r.nbFrames          = st->nb_frames;
+    streams.push_back(r);
+  }
+
+  startTime = ctx->start_time;
+  duration  = ctx->duration;
+  bitRate   = ctx->bit_rate;
+  valid     = !identity.empty();
+}
+
+bool ProbeCache::save() const {
+#ifdef LMS_HAS_STAT
+  if (!valid || cachePath.empty()) {
+    return false;
+  }
+
+  mkdir(cacheDirectory().c_str(), 0755);
+
+  // 先写入临时文件再重命名，避免进程中途退出时留下残缺的缓存
+  std::string tmpPath = cachePath + ".tmp";
+  FILE *fp = fopen(tmpPath.c_str(), "w");
+  if (fp == nullptr) {
+    LMSLogWarning("Failed writing probe cache: %s", tmpPath.c_str());
+    return false;
+  }
+
+  fprintf(fp, "lms-probe-cache %d\n", ProbeCacheVersion);
+  fprintf(fp, "identity %s\n", identity.c_str());
+  fprintf(fp, "format %" PRId64 " %" PRId64 " %" PRId64 " %d\n", startTime, duration, bitRate, (int)streams.size());
+
+  for (auto& r : streams) {
+    const AVCodecParameters *p = r.params;
+    fprintf(fp, "stream %d %d %u %d %" PRId64 " %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %" PRIu64
+                " %d %d %d %d %d %d %d\n",
+            (int)p->codec_type, (int)p->codec_id, p->codec_tag, p->format, p->bit_rate,
+            p->bits_per_coded_sample, p->bits_per_raw_sample, p->profile, p->level,
+            p->width, p->height, p->sample_aspect_ratio.num, p->sample_aspect_ratio.den,
+            (int)p->field_order, (int)p->color_range, (int)p->color_primaries, (int)p->color_trc,
+            (int)p->color_space, (int)p->chroma_location, p->video_delay,
+            p->channel_layout, p->channels, p->sample_rate, p->block_align, p->frame_size,
+            p->initial_padding, p->trailing_padding, p->seek_preroll);
+
+    fprintf(fp, "timing %d %d %d %d %d %d %" PRId64 " %" PRId64 " %" PRId64 "\n",
+            r.avgFrameRate.num, r.avgFrameRate.den,
+            r.rFrameRate.num, r.rFrameRate.den,
+            r.sampleAspectRatio.num, r.sampleAspectRatio.den,
+            r.startTime, r.duration, r.nbFrames);
+
+    fprintf(fp, "extradata %d ", p->extradata_size);
+    for (int b = 0; b < p->extradata_size; b += 1) {
+      fprintf(fp, "%02x", p->extradata[b]);
+    }
+    fprintf(fp, "\n");
+  }
+
+  fprintf(fp, "keyframes %d %" PRId64 " %d\n", indexStream, indexedUntil, (int)keyframes.size());
+  for (auto& kf : keyframes) {
+    fprintf(fp, "%" PRId64 " %" PRId64 "\n", kf.first, kf.second);
+  }
+
+  fclose(fp);
+  rename(tmpPath.c_str(), cachePath.c_str());
+
+  LMSLogInfo("Probe cache saved: path=%s, streams=%d, keyframes=%d", cachePath.c_str(), (int)streams.size(), (int)keyframes.size());
+  return true;
+#else
+  return false;
+#endif
+}
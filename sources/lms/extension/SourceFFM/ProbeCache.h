@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+/*
+ @function setProbeCacheDirectory
+ 设置探测缓存的存放目录，默认为 $HOME/.lms_probe_cache。传入nullptr则关闭缓存，每次打开文件都重新探测
+ */
+void setProbeCacheDirectory(const char *dir);
+
+/*
+ @class ProbeCache
+ 本地文件的探测结果缓存。avformat_find_stream_info需要解码若干帧才能得到完整的流参数，对于较大的
+ MKV/TS文件往往需要数百毫秒。该缓存以文件身份（设备、inode、大小、修改时间）为键，持久化保存各个流的
+ 编码参数（含extradata）以及关键帧索引，再次打开同一文件时可以完全跳过探测过程。
+
+ @discussion
+ 缓存按版本号区分格式，版本不符、文件身份发生变化，或者缓存中的流与容器头部解析出的流不一致时，
+ 缓存都会被视为无效
+ */
+class ProbeCache {
+public:
+  ProbeCache();
+  ~ProbeCache();
+
+  /*
+   @function load
+   读取path对应的缓存，同时记录文件身份以便之后保存。缓存不存在或已失效时返回false
+   */
+  bool load(const char *path);
+
+  /*
+   @function apply
+   校验缓存中的流与ctx中由容器头部解析出的流是否一致，一致时将缓存的参数写入ctx，用于替代avformat_find_stream_info
+   */
+  bool apply(AVFormatContext *ctx) const;
+
+  /*
+   @function capture
+   记录ctx在探测完成后的流参数
+   */
+  void capture(const AVFormatContext *ctx);
+
+  bool save() const;
+
+  bool isValid() const {
+    return valid;
+  }
+
+public:
+  // 关键帧索引，含义与FFMediaFile中的索引一致
+  int                        indexStream;
+  int64_t                    indexedUntil;
+  std::map<int64_t, int64_t> keyframes;
+
+private:
+  typedef struct {
+    AVCodecParameters *params;
+    AVRational         avgFrameRate;
+    AVRational         rFrameRate;
+    AVRational         sampleAspectRatio;
+    int64_t            startTime;
+    int64_t            duration;
+    int64_t            nbFrames;
+  } StreamRecord;
+
+  void clearStreams();
+
+  std::string cachePath;
+  std::string identity;
+  bool        valid;
+
+  int64_t startTime;
+  int64_t duration;
+  int64_t bitRate;
+  std::vector<StreamRecord> streams;
+};
@@ -0,0 +1,313 @@
+#include "ReadAheadIO.h"
+#include <lms/Logger.h>
+#include <lms/Metrics.h>
+#include <lms/Runtime.h>
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+#if defined(__APPLE__) || defined(__unix__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#define LMS_HAS_PREAD 1
+#endif
+
+// AVIO内部缓冲区大小，超过该大小的读取请求会直接从数据块拷贝到调用者的缓冲区
+constexpr int ReadAheadIOBufferSize = 32 * 1024;
+
+ReadAheadIO::ReadAheadIO(int fd, size_t size, const ReadAheadConfig& config) {
+  this->fd         = fd;
+  this->size       = size;
+  this->pos        = 0;
+  this->config     = config;
+  this->io         = nullptr;
+  this->nextWorker = 0;
+  this->mutex      = SDL_CreateMutex();
+  this->cond       = SDL_CreateCond();
+  this->inFlight   = 0;
+  this->closing    = false;
+  this->stallTicks = 0;
+  this->stallCount = 0;
+
+  for (int i = 0; i < config.workers; i += 1) {
+    workers.push_back(lms::createDispatchQueue("LMS_ReadAhead", lms::QueueTypeWorker));
+  }
+}
+
+ReadAheadIO::~ReadAheadIO() {
+  // 等待所有已提交的读取结束，尚未开始执行的读取在closing后会直接返回
+  SDL_LockMutex(mutex);
+  {
+    closing = true;
+    while (inFlight > 0) {
+      SDL_CondWait(cond, mutex);
+    }
+    window.clear();
+  }
+  SDL_UnlockMutex(mutex);
+
+  for (auto q : workers) {
+    lms::release(q);
+  }
+
+  if (io) {
+    av_freep(&io->buffer);
+    avio_context_free(&io);
+  }
+
+#ifdef LMS_HAS_PREAD
+  ::close(fd);
+#endif
+
+  SDL_DestroyCond(cond);
+  SDL_DestroyMutex(mutex);
+}
+
+ReadAheadIO *ReadAheadIO::open(const char *path, const ReadAheadConfig& config) {
+#ifdef LMS_HAS_PREAD
+  if (strncmp(path, "file:", 5) == 0) {
+    path += 5;
+  } else if (strstr(path, ":") != nullptr && access(path, F_OK) != 0) {
+    return nullptr;
+  }
+
+  if (config.blockSize == 0 || config.blockCount <= 0 || config.workers <= 0) {
+    LMSLogError("Invalid read-ahead config: block_size=%zu, block_count=%d, workers=%d",
+                config.blockSize, config.blockCount, config.workers);
+    return nullptr;
+  }
+
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0) {
+    return nullptr;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    ::close(fd);
+    return nullptr;
+  }
+
+  auto ra = new ReadAheadIO(fd, (size_t)st.st_size, config);
+
+  auto buffer = (unsigned char *)av_malloc(ReadAheadIOBufferSize);
+  ra->io = avio_alloc_context(buffer, ReadAheadIOBufferSize, 0, ra, readPacket, nullptr, seek);
+  if (ra->io == nullptr) {
+    av_free(buffer);
+    delete ra;
+    return nullptr;
+  }
+
+  SDL_LockMutex(ra->mutex);
+  {
+    ra->updateWindow();
+  }
+  SDL_UnlockMutex(ra->mutex);
+
+  LMSLogInfo("Read-ahead file: %s, size=%zu, block_size=%zu, block_count=%d, workers=%d",
+             path, ra->size, config.blockSize, config.blockCount, config.workers);
+  return ra;
+#else
+  return nullptr;
+#endif
+}
+
+double ReadAheadIO::getStallTime() const {
+  uint64_t ticks;
+  SDL_LockMutex(mutex);
+  {
+    ticks = stallTicks;
+  }
+  SDL_UnlockMutex(mutex);
+
+  return (double)ticks / SDL_GetPerformanceFrequency();
+}
+
+uint64_t ReadAheadIO::getStallCount() const {
+  uint64_t count;
+  SDL_LockMutex(mutex);
+  {
+    count = stallCount;
+  }
+  SDL_UnlockMutex(mutex);
+
+  return count;
+}
+
+void ReadAheadIO::updateWindow() {
+  int64_t first = (int64_t)(pos / config.blockSize);
+  int64_t last  = std::min(first + config.blockCount, (int64_t)((size + config.blockSize - 1) / config.blockSize));
+
+  // 丢弃窗口之外的数据块。正在读取中的数据块仍被读取任务持有，读取完成后自行释放
+  for (auto it = window.begin(); it != window.end(); ) {
+    if (it->first < first || it->first >= last) {
+      it = window.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  for (int64_t index = first; index < last; index += 1) {
+    if (window.count(index) > 0) {
+      continue;
+    }
+
+    std::shared_ptr<Block> block(new Block);
+    block->index  = index;
+    block->ready  = false;
+    block->error  = 0;
+    block->length = 0;
+    window[index] = block;
+
+    inFlight += 1;
+    lms::DispatchQueue *q = workers[nextWorker];
+    nextWorker = (nextWorker + 1) % workers.size();
+
+    lms::async(q, "ReadBlock", [this, block] {
+      readBlock(block);
+    });
+  }
+}
+
+void ReadAheadIO::readBlock(std::shared_ptr<Block> block) {
+  bool skip;
+  SDL_LockMutex(mutex);
+  {
+    // 关闭中，或者数据块在开始读取之前就已经移出了窗口
+    skip = closing || window.count(block->index) == 0;
+  }
+  SDL_UnlockMutex(mutex);
+
+  int    error  = 0;
+  size_t length = 0;
+
+  if (!skip) {
+#ifdef LMS_HAS_PREAD
+    off_t  offset = (off_t)(block->index * config.blockSize);
+    size_t want   = std::min(config.blockSize, size - (size_t)offset);
+
+    block->data.resize(want);
+    while (length < want) {
+      ssize_t n = pread(fd, block->data.data() + length, want - length, offset + length);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+
+      if (n < 0) {
+        error = AVERROR(errno);
+        break;
+      }
+
+      // 文件在打开之后被截断
+      if (n == 0) {
+        break;
+      }
+
+      length += n;
+    }
+#endif
+  }
+
+  SDL_LockMutex(mutex);
+  {
+    block->length = length;
+    block->error  = error;
+    block->ready  = true;
+    inFlight -= 1;
+    SDL_CondBroadcast(cond);
+  }
+  SDL_UnlockMutex(mutex);
+}
+
+std::shared_ptr<ReadAheadIO::Block> ReadAheadIO::waitBlock(int64_t index) {
+  updateWindow();
+
+  auto block = window[index];
+  if (block->ready) {
+    return block;
+  }
+
+  uint64_t begin = SDL_GetPerformanceCounter();
+  while (!block->ready) {
+    SDL_CondWait(cond, mutex);
+  }
+
+  uint64_t ticks = SDL_GetPerformanceCounter() - begin;
+  stallTicks += ticks;
+  stallCount += 1;
+
+  double ms = ticks * 1000.0 / SDL_GetPerformanceFrequency();
+  lms::metricsObserve("source.io.stall_ms", ms);
+  LMSLogDebug("Read-ahead stalled: block=%lld, cost=%.2lfms", (long long)index, ms);
+
+  return block;
+}
+
+int ReadAheadIO::readPacket(void *opaque, uint8_t *buf, int bufSize) {
+  auto self = (ReadAheadIO *)opaque;
+
+  int copied = 0;
+  SDL_LockMutex(self->mutex);
+  {
+    while (copied < bufSize && self->pos < self->size) {
+      int64_t index = (int64_t)(self->pos / self->config.blockSize);
+
+      // 已经复制了部分数据时不再等待尚未就绪的数据块，先返回已有的数据，避免demuxer在读取跨块的请求时被阻塞
+      if (copied > 0) {
+        self->updateWindow();
+        if (!self->window[index]->ready) {
+          break;
+        }
+      }
+
+      auto block = self->waitBlock(index);
+
+      if (block->error != 0) {
+        copied = copied > 0 ? copied : block->error;
+        break;
+      }
+
+      size_t offset = self->pos - (size_t)index * self->config.blockSize;
+      if (offset >= block->length) {
+        break;
+      }
+
+      size_t n = std::min((size_t)(bufSize - copied), block->length - offset);
+      memcpy(buf + copied, block->data.data() + offset, n);
+      copied    += (int)n;
+      self->pos += n;
+    }
+
+    // 读取位置前移后补充窗口
+    self->updateWindow();
+  }
+  SDL_UnlockMutex(self->mutex);
+
+  return copied == 0 ? AVERROR_EOF : copied;
+}
+
+int64_t ReadAheadIO::seek(void *opaque, int64_t offset, int whence) {
+  auto self = (ReadAheadIO *)opaque;
+
+  int64_t target;
+  switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE: return (int64_t)self->size;
+    case SEEK_SET:    target = offset; break;
+    case SEEK_CUR:    target = (int64_t)self->pos + offset; break;
+    case SEEK_END:    target = (int64_t)self->size + offset; break;
+    default:          return AVERROR(EINVAL);
+  }
+
+  if (target < 0 || target > (int64_t)self->size) {
+    return AVERROR(EINVAL);
+  }
+
+  SDL_LockMutex(self->mutex);
+  {
+    self->pos = (size_t)target;
+    self->updateWindow();
+  }
+  SDL_UnlockMutex(self->mutex);
+
+  return target;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <vector>
+extern "C" {
+#include <libavformat/avformat.h>
+#include <SDL2/SDL.h>
+}
+
+namespace lms { class DispatchQueue; }
+
+/*
+ @struct ReadAheadConfig
+ 预读窗口配置。窗口由若干个按blockSize对齐的数据块组成，读取位置所在的块及其后blockCount-1个块
+ 会被同时提交给后台的读取线程
+ */
+typedef struct {
+  size_t blockSize;  // 单个数据块大小
+  int    blockCount; // 窗口内的数据块数量
+  int    workers;    // 并行执行pread的工作队列数量
+} ReadAheadConfig;
+
+constexpr ReadAheadConfig ReadAheadConfigDefault = { 1024 * 1024, 8, 2 };
+
+/*
+ @class ReadAheadIO
+ 带异步预读的AVIOContext。demuxer的读取只会从已经就绪的数据块中拷贝数据，真正的磁盘读取由
+ 工作队列中的pread在读取位置前方提前完成。这样在页缓存未命中或网络存储延迟较高时，单次慢速读取
+ 只会消耗预读窗口中的余量，而不会直接阻塞整个解封装流程。
+
+ @discussion
+ seek之后窗口会立即移动到新的位置，窗口外的数据块被丢弃（正在读取中的数据块在读取完成后释放）。
+ demuxer需要等待的数据块尚未就绪时，等待时长会被记录为该数据源的阻塞时间
+ */
+class ReadAheadIO {
+public:
+  /*
+   @function open
+   打开本地文件并创建对应的AVIOContext。非本地路径或打开失败时返回nullptr
+   */
+  static ReadAheadIO *open(const char *path, const ReadAheadConfig& config);
+
+  ~ReadAheadIO();
+
+  AVIOContext *getIOContext() {
+    return io;
+  }
+
+  // 累计阻塞时间（秒）与阻塞次数
+  double   getStallTime() const;
+  uint64_t getStallCount() const;
+
+private:
+  struct Block {
+    int64_t              index;
+    bool                 ready;
+    int                  error;
+    size_t               length;
+    std::vector<uint8_t> data;
+  };
+
+  ReadAheadIO(int fd, size_t size, const ReadAheadConfig& config);
+
+  static int     readPacket(void *opaque, uint8_t *buf, int bufSize);
+  static int64_t seek(void *opaque, int64_t offset, int whence);
+
+  // 以下方法需要在持有mutex的情况下调用
+  void updateWindow();
+  std::shared_ptr<Block> waitBlock(int64_t index);
+
+  void readBlock(std::shared_ptr<Block> block);
+
+  int    fd;
+  size_t size;
+  size_t pos;
+
+  ReadAheadConfig config;
+  AVIOContext    *io;
+
+  std::vector<lms::DispatchQueue *> workers;
+  int nextWorker;
+
+  SDL_mutex *mutex;
+  SDL_cond  *cond;
+  std::map<int64_t, std::shared_ptr<Block>> window;
+  int  inFlight;
+  bool closing;
+
+  uint64_t stallTicks; // SDL_GetPerformanceCounter计数
+  uint64_t stallCount;
+};
@@ -54,6 +54,18 @@ public:
     SDL_UnlockMutex(mtx);
   }
   
+  std::list<T> takeAll() {
+    std::list<T> taken;
+    
+    SDL_LockMutex(mtx);
+    {
+      taken.swap(items);
+    }
+    SDL_UnlockMutex(mtx);
+    
+    return taken;
+  }
+  
   void pushBack(T frame) {
     LMSLogVerbose("Frame: %p", frame);
     
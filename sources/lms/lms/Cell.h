@@ -16,6 +16,14 @@ typedef std::map<std::string, Variant> PipelineMessage;
 class Cell : virtual public Object {
 public:
   virtual void configure(const StreamMeta& meta) {}
+  
+  /*
+   @function prepare
+   完成start之前耗时的初始化工作（例如打开解码器），可以在工作线程中调用，返回<0表示初始化失败。
+   未调用prepare时，start需要自行完成这部分初始化
+   */
+  virtual int prepare() { return 0; }
+  
   virtual void start() = 0;
   virtual void stop() = 0;
   
@@ -1,16 +1,28 @@
 #include "Decoder.h"
+#include "DecoderRank.h"
 #include "Logger.h"
 #include "Runtime.h"
 #include "Events.h"
+#include "Module.h"
+#include "Metrics.h"
 extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
+#include <libavutil/time.h>
 #include <SDL2/SDL.h>
 }
 #include <inttypes.h>
+#include <algorithm>
+#include <list>
 
 namespace lms {
 
+// 用于解码器测速的样本数据包数量（从首个关键帧开始计数）
+constexpr size_t BenchmarkSampleCount = 60;
+
+// 数据包队列中表示编码参数变化的标记，其stream_index为该值
+constexpr int CodecChangeMarker = -1;
+
 static const char *_media_type_name(int media_type) {
   const char *mediaType = "Unkonwn";
   if (media_type == AVMEDIA_TYPE_VIDEO) {
@@ -23,17 +35,25 @@ static const char *_media_type_name(int media_type) {
 
 class FFMDecoder : public Cell {
 public:
-  FFMDecoder(AVStream *stream) {
+  FFMDecoder(AVStream *stream, const AVCodec *codec) {
     this->stream = stream;
     this->params = stream->codecpar;
+    this->codec  = codec;
     this->mtx    = SDL_CreateMutex();
+    this->serial = 0;
+    this->dropBefore = INT64_MIN;
+    this->skipLevel    = DecodeSkipNone;
+    this->keyframeOnly = false;
+    this->collectingSamples = false;
+    this->prepared = false;
+    this->renderWidth  = 0;
+    this->renderHeight = 0;
+    this->requestedLowres = 0;
+    this->maxLowres = codec->max_lowres;
+    
+    activeParams = avcodec_parameters_alloc();
+    avcodec_parameters_copy(activeParams, params);
     
-    codec = avcodec_find_decoder(params->codec_id);
-    if (codec == nullptr) {
-      LMSLogError("Unsupported codec: %d", params->codec_id);
-      return;
-    }
-
     codecContext = avcodec_alloc_context3(codec);
     int rt = avcodec_parameters_to_context(codecContext, params);
     if (rt != 0) {
@@ -43,27 +63,140 @@ public:
   }
   
   ~FFMDecoder() {
+    for (auto pkt : benchSamples) {
+      av_packet_free(&pkt);
+    }
+    
+    for (auto par : pendingParams) {
+      avcodec_parameters_free(&par);
+    }
+
+    avcodec_parameters_free(&activeParams);
+    avcodec_free_context(&codecContext);
     SDL_DestroyMutex(mtx);
   }
   
+  /*
+   收集该流的前若干个数据包作为样本，收集完成后提交给DecoderRank，在后台对同一codec的所有候选解码器
+   进行测速。测速结果会被缓存，之后创建的解码器将直接使用本机最快的实现
+   */
+  void collectBenchmarkSamples() {
+    collectingSamples = true;
+  }
+  
 protected:
+  int  prepare() override;
   void start() override;
   void stop() override;
   
   void didReceivePipelineMessage(const PipelineMessage& msg) override;
   
 private:
+  void collectBenchmarkSample(const AVPacket *pkt) {
+    // 样本需要从关键帧开始，否则部分解码器会因缺少参考帧而无法输出
+    if (benchSamples.empty() && !(pkt->flags & AV_PKT_FLAG_KEY)) {
+      return;
+    }
+    
+    benchSamples.push_back(av_packet_clone(pkt));
+    
+    if (benchSamples.size() >= BenchmarkSampleCount) {
+      // 样本的所有权随之转交
+      benchmarkDecoders(params, benchSamples);
+      benchSamples.clear();
+      collectingSamples = false;
+    }
+  }
+  
+  // 按流订阅，由发出事件的线程直接投递到解码队列中执行，不经过主线程
+  // 事件可被合并，"count" 为合并前的请求次数之和，逐帧解码直到满足请求或没有可用的数据
   static void onEventDecodeFrame(FFMDecoder *self, const char *evtName, void *sender, const EventParams& p) {
+    uint64_t count = std::max(variantsGetUInt(p, "count", 1), (uint64_t)1);
+    for (uint64_t i = 0; i < count; i += 1) {
+      if (!self->decodeFrame()) {
+        break;
+      }
+    }
+  }
+  
+  // AVCodecContext的skip相关字段只能在解码线程中修改，以免与正在进行的解码过程产生竞争，因此同样投递到解码队列
+  static void onEventUpdateDecodeSkip(FFMDecoder *self, const char *evtName, void *sender, const EventParams& p) {
+    int level = (int)variantsGetUInt(p, "level");
+    self->skipLevel = level;
+    
+    // 关键帧模式下始终只解码关键帧，自适应降级等级留待退出该模式后再生效
+    if (!self->keyframeOnly) {
+      self->applyDecodeSkip(level);
+    }
+  }
+  
+  static void onEventUpdateDecodeMode(FFMDecoder *self, const char *evtName, void *sender, const EventParams& p) {
     assert(isHostThread());
     
     AVStream *streamObject = (AVStream *)variantsGetPointer(p, "stream_object");
+    if (streamObject != self->stream) {
+      return;
+    }
+    
+    bool enabled = variantsGetBool(p, "keyframe_only");
+    self->keyframeOnly = enabled;
+    async(self->q, "UpdateDecodeMode", [self, enabled] {
+      self->applyDecodeSkip(enabled ? DecodeSkipNonKey : self->skipLevel);
+    });
+  }
+  
+  /*
+   渲染端的显示尺寸（"update_render_size"，参数：stream_object, width, height）变化时，重新选择lowres等级。
+   lowres只能在打开解码器时设置，因此在下一个关键帧到达时插入与编码参数变化相同的标记，以新的等级重新打开解码器，
+   从而不会因缺少参考帧而出现花屏
+   */
+  static void onEventUpdateRenderSize(FFMDecoder *self, const char *evtName, void *sender, const EventParams& p) {
+    assert(isHostThread());
+    
+    self->renderWidth  = (int)variantsGetInt(p, "width");
+    self->renderHeight = (int)variantsGetInt(p, "height");
+    
+    int lowres = self->chooseLowres(self->maxLowres, self->params);
+    if (lowres != self->requestedLowres) {
+      LMSLogInfo("Lowres requested: stream:%d, render=%dx%d, lowres=%d",
+                 self->stream->index, (int)self->renderWidth, (int)self->renderHeight, lowres);
+      self->requestedLowres = lowres;
+    }
+  }
+  
+  // 在不小于显示尺寸的前提下尽量降低解码分辨率，显示尺寸未知或解码器不支持时为0
+  int chooseLowres(int maxLevel, const AVCodecParameters *par) const {
+    int w = renderWidth;
+    int h = renderHeight;
+    if (w <= 0 || h <= 0 || par->width <= 0 || par->height <= 0) {
+      return 0;
+    }
     
-    // 仅当发起方为对应流时，才应该激活解码处理，否则可能会提前解码数据帧
-    if (streamObject == self->stream) {
-      async(self->q, "DecodeFrame", [self] {
-        self->decodeFrame();
-      });
+    int level = 0;
+    while (level < maxLevel && AV_CEIL_RSHIFT(par->width, level + 1) >= w && AV_CEIL_RSHIFT(par->height, level + 1) >= h) {
+      level += 1;
     }
+    return level;
+  }
+  
+  void applyDecodeSkip(int level) {
+    // 按DecodeSkipLevel的取值顺序排列
+    static_assert(DecodeSkipNone == 0 && DecodeSkipNonRef == 1 && DecodeSkipBidir == 2 && DecodeSkipNonKey == 3,
+                  "discards must follow the order of DecodeSkipLevel");
+    static const AVDiscard discards[] = {
+      AVDISCARD_DEFAULT, // DecodeSkipNone
+      AVDISCARD_NONREF,  // DecodeSkipNonRef
+      AVDISCARD_BIDIR,   // DecodeSkipBidir
+      AVDISCARD_NONKEY,  // DecodeSkipNonKey
+    };
+    
+    level = std::max((int)DecodeSkipNone, std::min(level, (int)DecodeSkipNonKey));
+    
+    codecContext->skip_frame       = discards[level];
+    codecContext->skip_loop_filter = discards[level];
+    codecContext->skip_idct        = discards[level];
+    
+    LMSLogInfo("Decode skip updated: stream:%d, level=%d", stream->index, level);
   }
   
   void notifyPacketsUpdated(uint64_t type) {
@@ -71,6 +204,7 @@ private:
       { "stream_object", stream },
       { "type"         , type   },
       { "count"        , (uint64_t)packets.size() },
+      { "received"     , (uint64_t)received },
     };
     
     if (type == 1) {
@@ -80,7 +214,7 @@ private:
       decrements = 0;
     }
     
-    fireEvent("did_update_packets", this, p);
+    fireEvent("did_update_packets", this, std::move(p));
   }
   
   void pushPacket(AVPacket *packet) {
@@ -94,21 +228,38 @@ private:
                   _media_type_name(stream->codecpar->codec_type), stream->index, (uint32_t)packets.size());
   }
   
+  // 在队列中插入标记，解码到标记处时以par（nullptr表示沿用当前参数）重新创建解码器，par的所有权随之转交
+  void pushCodecChange(AVCodecParameters *par) {
+    AVPacket *marker = av_packet_alloc();
+    marker->stream_index = CodecChangeMarker;
+    
+    SDL_LockMutex(mtx);
+    {
+      pendingParams.push_back(par);
+    }
+    SDL_UnlockMutex(mtx);
+    
+    pushPacket(marker);
+  }
+  
   AVPacket *popPacket() {
     AVPacket *packet = nullptr;
+    bool drained;
 
     SDL_LockMutex(mtx);
     {
       if (!packets.empty()) {
         packet = packets.front();
         packets.pop_front();
+        decrements += 1;
       }
       
-      decrements += 1;
+      drained = packets.empty();
     }
     SDL_UnlockMutex(mtx);
     
-    if (decrements >=10) {
+    // 队列耗尽时立即报告，使SourceDriver尽快补充，而不必等到累计消费足够多的数据包
+    if (decrements >= 10 || (drained && decrements > 0)) {
       notifyPacketsUpdated(2);
     }
     
@@ -118,6 +269,17 @@ private:
     return packet;
   }
   
+  bool peekCodecChange() {
+    bool marked;
+    SDL_LockMutex(mtx);
+    {
+      marked = !packets.empty() && packets.front()->stream_index == CodecChangeMarker;
+    }
+    SDL_UnlockMutex(mtx);
+    
+    return marked;
+  }
+  
   void refillPacket(AVPacket *packet) {
     SDL_LockMutex(mtx);
     {
@@ -129,8 +291,281 @@ private:
                   _media_type_name(stream->codecpar->codec_type), stream->index, (uint32_t)packets.size());
   }
   
-  void decodeFrame() {
+  void flush(const PipelineMessage& msg) {
+    assert(isHostThread());
+    
+    uint64_t newSerial = variantsGetUInt(msg, "serial");
+    
+    // 精确定位的目标时间，换算到流的时间基上
+    int64_t target = INT64_MIN;
+    if (msg.count("seek_target") > 0) {
+      target = av_rescale_q(variantsGetInt(msg, "seek_target"), AV_TIME_BASE_Q, stream->time_base);
+    }
+    
+    std::list<AVPacket *> dropped;
+    std::list<AVCodecParameters *> changes;
+    SDL_LockMutex(mtx);
+    {
+      dropped.swap(packets);
+      changes.swap(pendingParams);
+    }
+    SDL_UnlockMutex(mtx);
+    
+    for (auto pkt : dropped) {
+      av_packet_free(&pkt);
+    }
+    
+    // 同步等待解码线程完成当前的解码任务后再清空解码器内部状态，保证之后推入的新数据包不会被一并清除。
+    // serial也在解码线程中更新，使flush之前解出的帧仍然携带旧的serial，从而被下游丢弃
+    sync(q, "FlushCodec", [this, newSerial, target, &changes] {
+      // 尚未生效的编码参数变化随数据包一起被清除，之后的数据包已经属于新的参数，直接切换
+      if (!changes.empty()) {
+        auto last = std::find_if(changes.rbegin(), changes.rend(), [] (AVCodecParameters *par) { return par != nullptr; });
+        reconfigure(last != changes.rend() ? *last : nullptr);
+      }
+      
+      avcodec_flush_buffers(codecContext);
+      serial     = newSerial;
+      dropBefore = target;
+    });
+    
+    for (auto par : changes) {
+      avcodec_parameters_free(&par);
+    }
+    
+    LMSLogInfo("Decoder flushed: stream:%d, serial=%" PRIu64 ", dropped=%d, target=%" PRIi64,
+               stream->index, newSerial, (int)dropped.size(), target);
+    
+    // 队列已被清空，通知SourceDriver按新的水位重新加载
+    notifyPacketsUpdated(0);
+    
+    // flush消息原样向下游传递，下游同样可能需要其中的定位信息
+    deliverPipelineMessage(msg);
+  }
+  
+  /*
+   精确定位时，从关键帧开始解码出的、早于目标时间的帧需要被丢弃。判断依据是帧的结束时间，
+   从而保留显示区间覆盖目标时间的那一帧
+   */
+  bool isBeforeSeekTarget(const AVFrame *frame) {
+    if (dropBefore == INT64_MIN) {
+      return false;
+    }
+    
+    int64_t pts = frame->best_effort_timestamp;
+    if (pts == AV_NOPTS_VALUE) {
+      return false;
+    }
+    
+    int64_t duration = 0;
+    if (stream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO && frame->sample_rate > 0) {
+      duration = av_rescale_q(frame->nb_samples, AVRational{1, frame->sample_rate}, stream->time_base);
+    } else if (stream->avg_frame_rate.num > 0) {
+      duration = av_rescale_q(1, av_inv_q(stream->avg_frame_rate), stream->time_base);
+    }
+    
+    if (pts + duration > dropBefore) {
+      // 已经到达目标位置，之后的帧不再检查
+      dropBefore = INT64_MIN;
+      return false;
+    }
+    
+    return true;
+  }
+  
+  void fireMilestone(const char *milestone) {
+    fireEvent("did_reach_milestone", this, {
+      { "stream_object", stream },
+      { "milestone"    , milestone },
+      { "time"         , (int64_t)av_gettime_relative() },
+    });
+  }
+  
+  /*
+   快速启动时探测得到的视频参数可能并不完整，使用解码出的首帧补全缺失的部分。只补全缺失的字段，
+   不覆盖容器或探测给出的值
+   */
+  void refineStreamParameters(const AVFrame *frame, AVRational framerate) {
+    assert(isHostThread());
+    
+    AVCodecParameters *par = stream->codecpar;
+    if (par->codec_type != AVMEDIA_TYPE_VIDEO) {
+      return;
+    }
+    
+    bool refined = false;
+    if (par->width <= 0 || par->height <= 0) {
+      par->width  = frame->width;
+      par->height = frame->height;
+      refined = true;
+    }
+    
+    if (par->format < 0) {
+      par->format = frame->format;
+      refined = true;
+    }
+    
+    if (par->sample_aspect_ratio.num == 0 && frame->sample_aspect_ratio.num != 0) {
+      par->sample_aspect_ratio = frame->sample_aspect_ratio;
+      refined = true;
+    }
+    
+    if (stream->avg_frame_rate.num <= 0 || stream->avg_frame_rate.den <= 0) {
+      if (framerate.num > 0 && framerate.den > 0) {
+        stream->avg_frame_rate = framerate;
+        refined = true;
+      }
+    }
+    
+    if (refined) {
+      LMSLogInfo("Stream parameters refined: stream:%d, size=%dx%d, format=%d, fps=%.2lf",
+                 stream->index, par->width, par->height, par->format, av_q2d(stream->avg_frame_rate));
+    }
+  }
+  
+  /*
+   编码参数发生变化（例如播放列表切换到编码参数不同的下一个条目）时，以新的参数重新创建解码器。
+   仅在解码线程中调用，失败时保留原有的解码器
+   */
+  void reconfigure(const AVCodecParameters *par) {
+    // 只有lowres等级发生变化时，以当前的编码参数重新打开
+    if (par == nullptr) {
+      par = activeParams;
+    }
+    
+    const AVCodec *newCodec = codec;
+    if (par->codec_id != codec->id) {
+      auto candidates = rankDecoders(par->codec_id);
+      if (candidates.empty()) {
+        LMSLogError("Codec change failed, unsupported codec: stream:%d, codec=%d", stream->index, par->codec_id);
+        return;
+      }
+      newCodec = candidates.front();
+    }
+    
+    AVCodecContext *ctx = avcodec_alloc_context3(newCodec);
+    int rt = avcodec_parameters_to_context(ctx, par);
+    ctx->lowres = chooseLowres(newCodec->max_lowres, par);
+    if (rt == 0) {
+      rt = avcodec_open2(ctx, newCodec, 0);
+    }
+    
+    if (rt != 0) {
+      LMSLogError("Codec change failed: stream:%d, code=%d", stream->index, rt);
+      avcodec_free_context(&ctx);
+      return;
+    }
+    
+    bool changed = par != activeParams;
+    if (changed) {
+      avcodec_parameters_copy(activeParams, par);
+    }
+    
+    avcodec_free_context(&codecContext);
+    codecContext = ctx;
+    codec        = newCodec;
+    maxLowres    = newCodec->max_lowres;
+    applyDecodeSkip(keyframeOnly ? DecodeSkipNonKey : skipLevel);
+    
+    if (changed) {
+      metricsAdd("decoder.codec_changes");
+    }
+    LMSLogInfo("Codec %s: stream:%d, decoder=%s, lowres=%d",
+               changed ? "changed" : "reopened", stream->index, codec->name, codecContext->lowres);
+  }
+  
+  void applyCodecChange() {
+    AVCodecParameters *par = nullptr;
+    SDL_LockMutex(mtx);
+    {
+      if (!pendingParams.empty()) {
+        par = pendingParams.front();
+        pendingParams.pop_front();
+      }
+    }
+    SDL_UnlockMutex(mtx);
+    
+    // 标记可能只表示lowres等级的变化，此时没有对应的编码参数
+    reconfigure(par);
+    avcodec_parameters_free(&par);
+  }
+  
+  void deliverFrame(AVFrame *frame, std::shared_ptr<AVFrame> guard) {
+    LMSLogDebug("Frame decoded: type=%s, stream:%d, pts=%" PRIi64,
+                _media_type_name(stream->codecpar->codec_type), stream->index, frame->pts);
+    
+    bool isFirst = !firstFrameDecoded;
+    if (isFirst) {
+      firstFrameDecoded = true;
+      fireMilestone("first_decode");
+    }
+    
+    // AVCodecContext只能在解码线程中访问，因此在这里取出帧率再交给主线程
+    AVRational framerate = codecContext->framerate;
+    uint64_t frameSerial = serial;
+    async(lms::hostQueue(), "DeliverFrame", [this, frame, guard, frameSerial, isFirst, framerate] {
+      if (isFirst) {
+        refineStreamParameters(frame, framerate);
+      }
+      
+      PipelineMessage frameMsg;
+      frameMsg["type"]   = "media_frame";
+      frameMsg["frame"]  = frame;
+      frameMsg["serial"] = frameSerial;
+      deliverPipelineMessage(frameMsg);
+    });
+  }
+  
+  bool decodeKeyframe() {
     assert(!isHostThread());
+    
+    AVPacket *avpkt = popPacket();
+    if (avpkt == nullptr) {
+      return false;
+    }
+    
+    // 关键帧模式下每次解码后都会清空解码器，可以直接切换参数
+    if (avpkt->stream_index == CodecChangeMarker) {
+      av_packet_free(&avpkt);
+      applyCodecChange();
+      return true;
+    }
+
+    AVFrame *frame = av_frame_alloc();
+    std::shared_ptr<AVFrame> guard(frame, [] (AVFrame *f) { av_frame_unref(f); });
+    
+    // 关键帧不依赖其他帧，送入后立即排空解码器即可取得对应的帧，而不必等待后续数据包来填满重排序缓冲
+    int rt = avcodec_send_packet(codecContext, avpkt);
+    av_packet_free(&avpkt);
+    
+    if (rt == 0) {
+      avcodec_send_packet(codecContext, nullptr);
+      rt = avcodec_receive_frame(codecContext, frame);
+    }
+    
+    // 丢弃排空过程中可能残留的其他帧，并让解码器退出排空状态以便接收下一个关键帧
+    AVFrame *rest = av_frame_alloc();
+    while (avcodec_receive_frame(codecContext, rest) == 0) {
+      av_frame_unref(rest);
+    }
+    av_frame_free(&rest);
+    avcodec_flush_buffers(codecContext);
+    
+    if (rt == 0) {
+      deliverFrame(frame, guard);
+    } else {
+      LMSLogWarning("Keyframe not decoded: stream:%d, code=%d", stream->index, rt);
+    }
+    return rt == 0;
+  }
+  
+  // 返回是否输出了一帧
+  bool decodeFrame() {
+    assert(!isHostThread());
+    
+    if (keyframeOnly) {
+      return decodeKeyframe();
+    }
 
     AVFrame *frame = av_frame_alloc();
     std::shared_ptr<AVFrame> guard(frame, [] (AVFrame *f) { av_frame_unref(f); });
@@ -140,6 +575,11 @@ private:
       rt = avcodec_receive_frame(codecContext, frame);
       
       if (rt == 0) {
+        if (isBeforeSeekTarget(frame)) {
+          metricsAdd("decoder.seek.frames_discarded");
+          av_frame_unref(frame);
+          continue;
+        }
         break;
       } else if (rt == AVERROR(EAGAIN)) {
         AVPacket *avpkt = popPacket();
@@ -148,6 +588,13 @@ private:
           rt = AVERROR(EAGAIN);
           break;
         }
+        
+        // 编码参数变化：先排空旧的解码器，取出剩余的帧之后（AVERROR_EOF）再切换，标记放回队首等待排空完成
+        if (avpkt->stream_index == CodecChangeMarker) {
+          refillPacket(avpkt);
+          avcodec_send_packet(codecContext, nullptr);
+          continue;
+        }
 
         rt = avcodec_send_packet(codecContext, avpkt);
         if (rt == AVERROR(EAGAIN)) {
@@ -160,6 +607,10 @@ private:
             break;
           }
         }
+      } else if (rt == AVERROR_EOF && peekCodecChange()) {
+        AVPacket *marker = popPacket();
+        av_packet_free(&marker);
+        applyCodecChange();
       } else {
         LMSLogError("Error while decoding: stream:%d, code=%d", stream->index, rt);
         break;
@@ -167,43 +618,77 @@ private:
     } while (true);
     
     if (rt == 0) {
-      uint32_t now = SDL_GetTicks();
-      LMSLogDebug("Frame decoded: type=%s, stream:%d, pts=%" PRIi64,
-                  _media_type_name(stream->codecpar->codec_type), stream->index, frame->pts);
-      
-      async(lms::hostQueue(), "DeliverFrame", [this, frame, guard] {
-        PipelineMessage frameMsg;
-        frameMsg["type"]  = "media_frame";
-        frameMsg["frame"] = frame;
-        deliverPipelineMessage(frameMsg);
-      });
+      deliverFrame(frame, guard);
     }
-    
-    return rt == 0 || rt == AVERROR(EAGAIN);
+    return rt == 0;
   }
   
 private:
   AVStream *stream;
   AVCodecParameters *params;
   AVCodecContext *codecContext;
-  AVCodec *codec;
+  const AVCodec *codec;
+  
+  bool                    prepared;     // 解码器是否已经打开（avcodec_open2）
+  bool                    collectingSamples;
+  std::vector<AVPacket *> benchSamples;
   
+  int                   skipLevel;      // 自适应降级等级，仅在解码线程中访问
+  std::atomic<bool>     keyframeOnly;
+  
+  std::atomic<uint64_t> serial;         // 当前接受的数据序号，seek后由flush消息更新
+  int64_t               dropBefore;     // 精确定位的目标pts，早于该时间的帧会被丢弃，仅在解码线程中访问
   int                   decrements;
+  std::atomic<uint64_t> received;       // 累计收到的数据包数量（含被丢弃的旧数据包）
+  bool                  firstPacketReceived; // 启动后是否已收到首个数据包，用于统计启动耗时
+  bool                  firstFrameDecoded;   // 启动后是否已解出首帧，仅在解码线程中访问
   int64_t               cachingDuration;
   std::list<AVPacket *> packets;
+  std::list<AVCodecParameters *> pendingParams; // 尚未生效的编码参数变化，与队列中的标记一一对应，nullptr表示只改变lowres
+  AVCodecParameters    *activeParams;   // 当前解码器所使用的编码参数，仅在解码线程中访问
+  std::atomic<int>      renderWidth;    // 渲染端的显示尺寸
+  std::atomic<int>      renderHeight;
+  std::atomic<int>      maxLowres;      // 当前解码器支持的最大lowres等级
+  int                   requestedLowres; // 期望的lowres等级，仅在主线程中访问
+  int                   appliedLowres;  // 已经插入标记的lowres等级，仅在主线程中访问
   void                 *eoDecodeFrame;  // event observer: "decode_frame"
+  void                 *eoDecodeSkip;   // event observer: "update_decode_skip"
+  void                 *eoDecodeMode;   // event observer: "update_decode_mode"
+  void                 *eoRenderSize;   // event observer: "update_render_size"
   
   DispatchQueue        *q;
   SDL_mutex            *mtx;
 };
 
+int FFMDecoder::prepare() {
+  // 只访问codecContext，可以在工作线程中与其他流的解码器并行打开
+  if (prepared) {
+    return 0;
+  }
+  
+  int64_t begin = av_gettime_relative();
+  codecContext->lowres = chooseLowres(codec->max_lowres, params);
+  appliedLowres   = codecContext->lowres;
+  requestedLowres = codecContext->lowres;
+  int rt = avcodec_open2(codecContext, codec, 0);
+  if (rt != 0) {
+    LMSLogError("Couldn't open codec: stream:%d, code=%d", stream->index, rt);
+    return rt;
+  }
+  
+  prepared = true;
+  
+  double ms = (av_gettime_relative() - begin) / 1000.0;
+  metricsObserve("decoder.open_ms", ms);
+  LMSLogInfo("Decoder opened: stream:%d, codec=%s, cost=%.2lfms", stream->index, codec->name, ms);
+  return 0;
+}
+
 void FFMDecoder::start() {
   assert(isHostThread());
   LMSLogInfo("Start decoder | stream:%d, type:%d", stream->index, stream->codecpar->codec_type);
   
-  int rt = avcodec_open2(codecContext, codec, 0);
-  if (rt != 0) {
-    LMSLogError("Couldn't open codec: %d", rt);
+  if (prepare() != 0) {
     return;
   }
   
@@ -213,9 +698,15 @@ void FFMDecoder::start() {
   
   q = createDispatchQueue(qname, QueueTypeWorker);
   
-  eoDecodeFrame = addEventObserver("decode_frame", nullptr, this, (EventCallback)onEventDecodeFrame);
+  eoDecodeFrame = addEventObserver("decode_frame", stream, this, (EventCallback)onEventDecodeFrame, EventDeliveryQueue, q);
+  eoDecodeSkip  = addEventObserver("update_decode_skip", stream, this, (EventCallback)onEventUpdateDecodeSkip, EventDeliveryQueue, q);
+  eoDecodeMode  = addEventObserver("update_decode_mode", nullptr, this, (EventCallback)onEventUpdateDecodeMode);
+  eoRenderSize  = addEventObserver("update_render_size", stream, this, (EventCallback)onEventUpdateRenderSize);
   
   decrements = 0;
+  received   = 0;
+  firstPacketReceived = false;
+  firstFrameDecoded   = false;
   notifyPacketsUpdated(0);
 }
 
@@ -223,32 +714,176 @@ void FFMDecoder::stop() {
   assert(isHostThread());
   LMSLogInfo("Start decoder | stream:%d, type:%d", stream->index, stream->codecpar->codec_type);
 
+  // 投递到解码队列的观察者持有该队列，需要先移除，释放队列时才会等待已投递的任务结束
+  removeEventObserver(eoDecodeFrame);
+  removeEventObserver(eoDecodeSkip);
+  removeEventObserver(eoDecodeMode);
+  removeEventObserver(eoRenderSize);
+
   lms::release(q);
   q = nullptr;
 
-  // 需要在destroySemaphore前进行移除
-  removeEventObserver(eoDecodeFrame);
-
   avcodec_close(codecContext);
+  prepared = false;
 }
 
 void FFMDecoder::didReceivePipelineMessage(const PipelineMessage& msg) {
   assert(isHostThread());
   
+  const char *type = variantsGetCString(msg, "type", "");
+  uint64_t msgSerial = variantsGetUInt(msg, "serial");
+  
+  if (strcmp(type, "flush") == 0) {
+    flush(msg);
+    return;
+  }
+  
+  // 编码参数变化需要与数据包保持顺序：在队列中插入标记，解码到标记处再进行切换
+  if (strcmp(type, "codec_change") == 0) {
+    if (msgSerial != serial) {
+      return;
+    }
+    
+    AVCodecParameters *par = avcodec_parameters_alloc();
+    avcodec_parameters_copy(par, (const AVCodecParameters *)variantsGetPointer(msg, "codec_parameters"));
+    pushCodecChange(par);
+    return;
+  }
+  
+  // 所有投递到该流的数据包都计入，SourceDriver以此计算尚在投递途中的数据包数量
+  received += 1;
+  
+  // 丢弃seek之前就已经读出的旧数据包
+  if (msgSerial != serial) {
+    return;
+  }
+  
   auto srcpkt = (AVPacket *)msg.at("packet_object").value.ptr;
+  
+  // lowres等级的变化在关键帧处生效
+  if (requestedLowres != appliedLowres && (srcpkt->flags & AV_PKT_FLAG_KEY)) {
+    appliedLowres = requestedLowres;
+    pushCodecChange(nullptr);
+  }
+  
+  if (collectingSamples) {
+    collectBenchmarkSample(srcpkt);
+  }
+
   AVPacket *avpkt = av_packet_clone(srcpkt);
   assert(avpkt != nullptr);
   pushPacket(avpkt);
+  
+  if (!firstPacketReceived) {
+    firstPacketReceived = true;
+    fireMilestone("first_packet");
+  }
+  
+  // 关键帧模式下不再等待渲染端按时钟拉取，数据包到达即解码，以尽快呈现请求的关键帧。
+  // 解码器打开失败时start不会创建队列，数据包只留在队列中，与非关键帧模式一样不会被解码
+  if (keyframeOnly && prepared && q != nullptr) {
+    async(q, "DecodeKeyframe", [this] {
+      decodeFrame();
+    });
+  }
+}
+
+static std::list<DecoderFactory> _factories;
+
+void registerDecoderFactory(const DecoderFactory& factory) {
+  assert(isHostThread());
+
+  unregisterDecoderFactory(factory.name);
+  _factories.push_back(factory);
+  LMSLogInfo("Decoder factory registered: %s", factory.name);
+}
+
+void unregisterDecoderFactory(const char *name) {
+  assert(isHostThread());
+
+  _factories.remove_if([name] (const DecoderFactory& f) {
+    return strcmp(f.name, name) == 0;
+  });
 }
 
 Cell *createDecoder(const StreamMeta& meta) {
   assert(isHostThread());
 
   // 根据meta信息匹配一个可创建，且最合适的解码器
+  const DecoderFactory *matched = nullptr;
+  int bestScore = 0;
+  for (auto& f : _factories) {
+    int score = f.probe(meta);
+    if (score > bestScore) {
+      matched   = &f;
+      bestScore = score;
+    }
+  }
+  
+  if (matched == nullptr) {
+    LMSLogError("No decoder factory matches the stream");
+    return nullptr;
+  }
+
+  LMSLogInfo("Decoder factory matched: %s, score=%d", matched->name, bestScore);
+  return matched->create(meta);
+}
+
+static int probeFFMDecoder(const StreamMeta& meta) {
+  const char *sourceType = variantsGetCString(meta, "source_type");
+  auto st = (AVStream *)variantsGetPointer(meta, "stream_object");
+  if (sourceType == nullptr || strcmp(sourceType, "avformat") != 0 || st == nullptr) {
+    return 0;
+  }
+
+  return rankDecoders(st->codecpar->codec_id).empty() ? 0 : DecoderScoreFFmpeg;
+}
+
+static Cell *createFFMDecoder(const StreamMeta& meta) {
+  auto st = (AVStream *)variantsGetPointer(meta, "stream_object");
+  auto codecId = st->codecpar->codec_id;
+
+  auto candidates = rankDecoders(codecId);
+  if (candidates.empty()) {
+    LMSLogError("Unsupported codec: %d", codecId);
+    return nullptr;
+  }
 
-  // 为了测试，返回一个假的解码器
-  auto st = (AVStream *)meta.at("stream_object").value.ptr;
-  return new FFMDecoder(st);
+  const AVCodec *codec = candidates.front();
+  LMSLogInfo("Decoder selected: stream:%d, codec=%s, decoder=%s, candidates=%d",
+             st->index, avcodec_get_name(codecId), codec->name, (int)candidates.size());
+
+  auto decoder = new FFMDecoder(st, codec);
+  if (shouldBenchmarkDecoders(codecId)) {
+    decoder->collectBenchmarkSamples();
+  }
+
+  return decoder;
 }
 
+static void setupDecoderRegistry() {
+  setupDecoderRank();
+
+  // 渲染端成批请求解码、解码器频繁报告队列变化，尚未处理的同一个流的事件合并为一个
+  setEventCoalescing("decode_frame", { "count" });
+  setEventCoalescing("did_update_packets", { "increment", "decrement" });
+
+  registerDecoderFactory({
+    .name   = "FFMDecoder",
+    .probe  = probeFFMDecoder,
+    .create = createFFMDecoder,
+  });
+}
+
+static void teardownDecoderRegistry() {
+  _factories.clear();
+  teardownDecoderRank();
+}
+
+Module moduleDecoderRegistry = {
+  .name     = "DecoderRegistry",
+  .setup    = setupDecoderRegistry,
+  .teardown = teardownDecoderRegistry
+};
+
 }
@@ -5,6 +5,64 @@
 
 namespace lms {
 
+/*
+ @struct DecoderFactory
+ 解码器工厂。扩展模块可以通过registerDecoderFactory注册自己的解码器实现，createDecoder会询问
+ 每个工厂对当前流的匹配分值，并使用分值最高的工厂创建解码器（分值相同时，先注册者优先）。
+
+ @field name   工厂名称，同时作为注销时的标识。需要保证其生命周期不短于注册周期
+ @field probe  返回工厂对流的匹配分值，<= 0 表示无法处理该流
+ @field create 创建解码器实例，返回的实例由调用者负责release
+ */
+typedef struct {
+  const char *name;
+  int  (*probe)(const StreamMeta& meta);
+  Cell *(*create)(const StreamMeta& meta);
+} DecoderFactory;
+
+// 内置FFmpeg解码器工厂的匹配分值，扩展模块可以使用更高的分值覆盖它
+constexpr int DecoderScoreFFmpeg = 100;
+
+void registerDecoderFactory(const DecoderFactory& factory);
+void unregisterDecoderFactory(const char *name);
+
+/*
+ 同一个codec往往存在多个FFmpeg软件解码器实现（例如AV1的libdav1d与libaom-av1），
+ DecoderRankPolicy决定了内置工厂在它们之间进行选择的方式
+ */
+typedef enum {
+  DecoderRankDefault   = 0, // 总是使用avcodec_find_decoder的默认选择
+  DecoderRankBenchmark = 1, // 使用本机基准测试的结果，选择单帧耗时最低的解码器
+} DecoderRankPolicy;
+
+void setDecoderRankPolicy(DecoderRankPolicy policy);
+
+/*
+ @function setDecoderRankCachePath
+ 设置基准测试结果的磁盘缓存路径，默认为 $HOME/.lms_decoder_rank。传入nullptr则不进行持久化，
+ 每次进程启动后都需要重新测试。可以在lms::init之前调用，此时路径在init时生效
+ */
+void setDecoderRankCachePath(const char *path);
+
+/*
+ 解码降级等级。当渲染端持续丢帧时，VideoRenderDriver会通过 "update_decode_skip" 事件
+ （参数：stream_object, level）逐级提高该等级，让解码器直接跳过部分帧的解码工作；负载恢复后再逐级降低
+ */
+typedef enum {
+  DecodeSkipNone   = 0, // 完整解码
+  DecodeSkipNonRef = 1, // 跳过非参考帧
+  DecodeSkipBidir  = 2, // 跳过所有双向预测帧
+  DecodeSkipNonKey = 3, // 只解码关键帧
+} DecodeSkipLevel;
+
+/*
+ @function createDecoder
+ 为meta中的流创建解码器。
+
+ @discussion
+ 渲染端通过 "update_render_size" 事件（sender为流对象，参数：stream_object, width, height）报告视频在屏幕上的实际像素尺寸，
+ 解码器支持lowres时会在不小于该尺寸的前提下降低解码分辨率，新的等级从下一个关键帧开始生效
+ */
 Cell *createDecoder(const StreamMeta& meta);
 
 }
@@ -0,0 +1,311 @@
+#include "DecoderRank.h"
+#include "Decoder.h"
+#include "Logger.h"
+#include "Runtime.h"
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <SDL2/SDL.h>
+}
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <set>
+#include <string>
+
+namespace lms {
+
+// 缓存文件的格式版本，格式发生变化时应递增，使旧版本的缓存自动失效
+constexpr int RankCacheVersion = 1;
+
+// 解码器在本机不可用（无法打开，或样本中一帧都解不出来）时记录的耗时
+constexpr double UnusableCost = -1.0;
+
+typedef std::map<std::string, double> DecoderCosts; // 解码器名称 -> 平均单帧耗时(us)
+
+static SDL_mutex                          *_rankMutex;
+static DispatchQueue                      *_benchQueue;
+static DecoderRankPolicy                   _rankPolicy = DecoderRankBenchmark;
+static std::string                         _rankCachePath;
+static bool                                _rankCachePathSet;    // 是否通过setDecoderRankCachePath指定过路径
+static bool                                _benchCancelled;      // 模块销毁中，尚未完成的测速任务只释放资源
+static std::map<std::string, DecoderCosts> _ranks;       // codec名称 -> 各解码器耗时
+static std::set<int>                       _benchmarking; // 正在测速中的codec，避免重复提交
+
+static void loadRankCache() {
+  if (_rankCachePath.empty()) {
+    return;
+  }
+
+  FILE *fp = fopen(_rankCachePath.c_str(), "r");
+  if (fp == nullptr) {
+    return;
+  }
+
+  int version = 0;
+  if (fscanf(fp, "lms-decoder-rank %d\n", &version) != 1 || version != RankCacheVersion) {
+    LMSLogWarning("Decoder rank cache ignored: path=%s, version=%d", _rankCachePath.c_str(), version);
+    fclose(fp);
+    return;
+  }
+
+  char codecName[64], decoderName[64];
+  double cost;
+  while (fscanf(fp, "%63s %63s %lf\n", codecName, decoderName, &cost) == 3) {
+    _ranks[codecName][decoderName] = cost;
+  }
+
+  fclose(fp);
+  LMSLogInfo("Decoder rank cache loaded: path=%s, codecs=%d", _rankCachePath.c_str(), (int)_ranks.size());
+}
+
+static void saveRankCache() {
+  if (_rankCachePath.empty()) {
+    return;
+  }
+
+  // 先写入临时文件再重命名，避免进程中途退出时留下残缺的缓存
+  std::string tmpPath = _rankCachePath + ".tmp";
+  FILE *fp = fopen(tmpPath.c_str(), "w");
+  if (fp == nullptr) {
+    LMSLogWarning("Failed writing decoder rank cache: %s", tmpPath.c_str());
+    return;
+  }
+
+  fprintf(fp, "lms-decoder-rank %d\n", RankCacheVersion);
+  for (auto& codec : _ranks) {
+    for (auto& decoder : codec.second) {
+      fprintf(fp, "%s %s %.3lf\n", codec.first.c_str(), decoder.first.c_str(), decoder.second);
+    }
+  }
+
+  fclose(fp);
+  rename(tmpPath.c_str(), _rankCachePath.c_str());
+}
+
+void setDecoderRankPolicy(DecoderRankPolicy policy) {
+  _rankPolicy = policy;
+}
+
+void setDecoderRankCachePath(const char *path) {
+  // 在lms::init之前调用时只记录路径，由setupDecoderRank加载
+  if (_rankMutex == nullptr) {
+    _rankCachePath    = path ? path : "";
+    _rankCachePathSet = true;
+    return;
+  }
+
+  SDL_LockMutex(_rankMutex);
+  {
+    _rankCachePath    = path ? path : "";
+    _rankCachePathSet = true;
+    _ranks.clear();
+    loadRankCache();
+  }
+  SDL_UnlockMutex(_rankMutex);
+}
+
+std::vector<const AVCodec *> rankDecoders(int codecId) {
+  std::vector<const AVCodec *> decoders;
+
+  void *it = nullptr;
+  const AVCodec *codec = nullptr;
+  while ((codec = av_codec_iterate(&it)) != nullptr) {
+    if (!av_codec_is_decoder(codec) || codec->id != codecId) {
+      continue;
+    }
+
+    // 仅考虑可以直接在CPU上运行的稳定实现
+    if (codec->capabilities & (AV_CODEC_CAP_EXPERIMENTAL | AV_CODEC_CAP_HARDWARE)) {
+      continue;
+    }
+
+    decoders.push_back(codec);
+  }
+
+  // FFmpeg的默认选择排在首位，作为没有测速结果时的兜底
+  const AVCodec *preferred = avcodec_find_decoder((AVCodecID)codecId);
+  std::stable_partition(decoders.begin(), decoders.end(), [preferred] (const AVCodec *c) {
+    return c == preferred;
+  });
+
+  if (_rankPolicy != DecoderRankBenchmark || decoders.size() <= 1) {
+    return decoders;
+  }
+
+  DecoderCosts costs;
+  SDL_LockMutex(_rankMutex);
+  {
+    auto found = _ranks.find(avcodec_get_name((AVCodecID)codecId));
+    if (found != _ranks.end()) {
+      costs = found->second;
+    }
+  }
+  SDL_UnlockMutex(_rankMutex);
+
+  // 有测速结果的按耗时升序排列，没有结果的保持原顺序紧随其后，不可用的排在最后
+  auto costOf = [&costs] (const AVCodec *c) {
+    auto found = costs.find(c->name);
+    return found == costs.end() ? 0.0 : found->second;
+  };
+
+  auto order = [&costOf] (const AVCodec *c) {
+    double cost = costOf(c);
+    return cost > 0 ? 0 : (cost == 0 ? 1 : 2);
+  };
+
+  std::stable_sort(decoders.begin(), decoders.end(), [&] (const AVCodec *a, const AVCodec *b) {
+    int oa = order(a), ob = order(b);
+    if (oa != ob) {
+      return oa < ob;
+    }
+    return oa == 0 && costOf(a) < costOf(b);
+  });
+
+  return decoders;
+}
+
+bool shouldBenchmarkDecoders(int codecId) {
+  if (_rankPolicy != DecoderRankBenchmark || rankDecoders(codecId).size() <= 1) {
+    return false;
+  }
+
+  bool should;
+  SDL_LockMutex(_rankMutex);
+  {
+    bool measured = _ranks.find(avcodec_get_name((AVCodecID)codecId)) != _ranks.end();
+    bool pending  = _benchmarking.find(codecId) != _benchmarking.end();
+    should = !measured && !pending;
+  }
+  SDL_UnlockMutex(_rankMutex);
+
+  return should;
+}
+
+static double measureDecoder(const AVCodec *codec, const AVCodecParameters *params, const std::vector<AVPacket *>& samples) {
+  AVCodecContext *ctx = avcodec_alloc_context3(codec);
+  if (avcodec_parameters_to_context(ctx, params) != 0 || avcodec_open2(ctx, codec, nullptr) != 0) {
+    avcodec_free_context(&ctx);
+    return UnusableCost;
+  }
+
+  AVFrame *frame  = av_frame_alloc();
+  int      frames = 0;
+
+  auto drain = [ctx, frame, &frames] {
+    while (avcodec_receive_frame(ctx, frame) == 0) {
+      frames += 1;
+      av_frame_unref(frame);
+    }
+  };
+
+  Uint64 begin = SDL_GetPerformanceCounter();
+  {
+    // 每次送包后都会把输出取尽，因此这里不会出现EAGAIN
+    for (auto pkt : samples) {
+      if (avcodec_send_packet(ctx, pkt) == 0) {
+        drain();
+      }
+    }
+
+    avcodec_send_packet(ctx, nullptr);
+    drain();
+  }
+  Uint64 ticks = SDL_GetPerformanceCounter() - begin;
+
+  av_frame_free(&frame);
+  avcodec_free_context(&ctx);
+
+  if (frames == 0) {
+    return UnusableCost;
+  }
+
+  return (double)ticks * 1000000.0 / (double)SDL_GetPerformanceFrequency() / frames;
+}
+
+static bool isBenchCancelled() {
+  bool cancelled;
+  SDL_LockMutex(_rankMutex);
+  {
+    cancelled = _benchCancelled;
+  }
+  SDL_UnlockMutex(_rankMutex);
+  return cancelled;
+}
+
+void benchmarkDecoders(const AVCodecParameters *params, const std::vector<AVPacket *>& samples) {
+  AVCodecParameters *par = avcodec_parameters_alloc();
+  avcodec_parameters_copy(par, params);
+
+  int codecId = par->codec_id;
+  SDL_LockMutex(_rankMutex);
+  {
+    _benchmarking.insert(codecId);
+  }
+  SDL_UnlockMutex(_rankMutex);
+
+  async(_benchQueue, "BenchmarkDecoders", [par, samples, codecId] () mutable {
+    const char *codecName = avcodec_get_name((AVCodecID)codecId);
+    DecoderCosts costs;
+
+    for (auto codec : rankDecoders(codecId)) {
+      if (isBenchCancelled()) {
+        break;
+      }
+
+      double cost = measureDecoder(codec, par, samples);
+      costs[codec->name] = cost;
+      LMSLogInfo("Decoder benchmark: codec=%s, decoder=%s, cost=%.1lfus/frame", codecName, codec->name, cost);
+    }
+
+    SDL_LockMutex(_rankMutex);
+    {
+      // 被放弃的测速结果不完整，不写入缓存
+      if (!_benchCancelled) {
+        _ranks[codecName] = costs;
+        saveRankCache();
+      }
+      _benchmarking.erase(codecId);
+    }
+    SDL_UnlockMutex(_rankMutex);
+
+    for (auto pkt : samples) {
+      av_packet_free(&pkt);
+    }
+    avcodec_parameters_free(&par);
+  });
+}
+
+void setupDecoderRank() {
+  _rankMutex      = SDL_CreateMutex();
+  _benchQueue     = createDispatchQueue("LMS_DecoderBench", QueueTypeWorker);
+  _benchCancelled = false;
+
+  // 没有在init之前指定路径时使用默认路径
+  const char *home = getenv("HOME");
+  if (!_rankCachePathSet && home != nullptr) {
+    _rankCachePath = std::string(home) + "/.lms_decoder_rank";
+  }
+  loadRankCache();
+}
+
+void teardownDecoderRank() {
+  // 尚未完成的测速任务不再继续测速，但仍需执行以释放各自持有的样本与编码参数。
+  // 队列销毁时不会执行剩余的任务，因此先等待队列中的任务全部执行完毕
+  SDL_LockMutex(_rankMutex);
+  {
+    _benchCancelled = true;
+  }
+  SDL_UnlockMutex(_rankMutex);
+
+  sync(_benchQueue, "DrainDecoderBench", [] {});
+  lms::release(_benchQueue);
+  _benchQueue = nullptr;
+
+  _ranks.clear();
+  _benchmarking.clear();
+
+  SDL_DestroyMutex(_rankMutex);
+  _rankMutex = nullptr;
+}
+
+}
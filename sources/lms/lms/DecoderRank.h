@@ -0,0 +1,36 @@
+#pragma once
+
+#include "Foundation.h"
+#include <vector>
+
+FWD_DECLARE_STRUCT(AVCodec);
+FWD_DECLARE_STRUCT(AVCodecParameters);
+FWD_DECLARE_STRUCT(AVPacket);
+
+namespace lms {
+
+/*
+ @function rankDecoders
+ 列出本机可用于解码codecId的所有FFmpeg软件解码器，并按当前的排序策略排序，越靠前越优先
+ */
+std::vector<const AVCodec *> rankDecoders(int codecId);
+
+/*
+ @function shouldBenchmarkDecoders
+ 当codecId存在多个候选解码器，且尚无本机基准测试结果时返回true
+ */
+bool shouldBenchmarkDecoders(int codecId);
+
+/*
+ @function benchmarkDecoders
+ 在后台队列中，使用真实的数据包样本对codec的所有候选解码器进行测速，并将结果写入磁盘缓存
+
+ @param params  流的编码参数，内部会进行拷贝
+ @param samples 从关键帧开始的连续数据包，所有权转交给该函数
+ */
+void benchmarkDecoders(const AVCodecParameters *params, const std::vector<AVPacket *>& samples);
+
+void setupDecoderRank();
+void teardownDecoderRank();
+
+}
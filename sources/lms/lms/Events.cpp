@@ -7,7 +7,13 @@
 
 #include "Events.h"
 #include "Module.h"
-#include <list>
+#include "Runtime.h"
+#include "Metrics.h"
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+#include <vector>
 extern "C" {
 #include <SDL2/SDL.h>
 }
@@ -15,56 +21,532 @@ extern "C" {
 namespace lms {
 
 class EventCenter;
-class DispatchQueue;
 
 static EventCenter   *_eventCenter;
 
+/*
+ @struct EventCoalescing
+ 可合并事件的合并规则（见setEventCoalescing）
+ */
+struct EventCoalescing {
+  std::vector<std::string> summedKeys;
+  std::string              postedMetric; // 投递次数（含被合并的）
+  std::string              mergedMetric; // 被合并到尚未分发的事件中的次数
+};
+
+// 结果沿用尚未分发的参数的类型：Variant在类型不同时赋值不会生效，累加的结果会被丢弃。
+// Int与UInt共用同一个64bit的值，混合相加时按补码计算，结果不受影响
+static Variant _sum_variants(const Variant& pending, const Variant& v) {
+  assert(pending.type == Variant::Int || pending.type == Variant::UInt);
+  
+  if (pending.type == Variant::Int) {
+    return Variant((int64_t)(pending.value.i + v.value.i));
+  }
+  return Variant((uint64_t)(pending.value.u + v.value.u));
+}
+
+// 将新事件的参数合并到尚未分发的事件中：需要累加的参数相加，其余参数以新事件为准
+static void _merge_event_params(EventParams& pending, const EventParams& params, const EventCoalescing *coalescing) {
+  for (auto& kv : params) {
+    auto found = pending.find(kv.first);
+    if (found != pending.end() &&
+        std::find(coalescing->summedKeys.begin(), coalescing->summedKeys.end(), kv.first) != coalescing->summedKeys.end()) {
+      found->second = _sum_variants(found->second, kv.second);
+    } else {
+      pending[kv.first] = kv.second;
+    }
+  }
+}
+
+/*
+ @struct PendingEvent
+ 尚未分发的可合并事件。没有发生合并时直接引用发出时的参数，第一次合并时才复制出可以修改的副本
+ */
+struct PendingEvent {
+  EventPayload                 payload;
+  std::shared_ptr<EventParams> merged;
+
+  PendingEvent(const EventPayload& payload) : payload(payload) {}
+
+  void merge(const EventParams& params, const EventCoalescing *coalescing) {
+    if (!merged) {
+      merged = std::make_shared<EventParams>(*payload);
+    }
+    _merge_event_params(*merged, params, coalescing);
+  }
+
+  EventPayload result() const {
+    return merged ? EventPayload(merged) : payload;
+  }
+};
+
+typedef std::unordered_map<void *, PendingEvent> PendingEvents;
+
+// 从pending中取出sender对应的事件
+static EventPayload _take_pending_event(PendingEvents& pending, void *sender) {
+  auto found = pending.find(sender);
+  if (found == pending.end()) {
+    return std::make_shared<const EventParams>();
+  }
+
+  EventPayload payload = found->second.result();
+  pending.erase(found);
+  return payload;
+}
+
+/*
+ @struct EventMailbox
+ 投递到队列的观察者尚未执行的事件。可合并的事件按sender各保留一个，其余事件不经过这里
+ */
+struct EventMailbox {
+  std::atomic<bool> alive; // 已投递到队列、尚未执行的回调通过该标记得知观察者是否已被移除
+  std::string       name;  // 事件名称，回调执行时观察者可能已被释放
+  SDL_mutex        *mutex;
+  PendingEvents     pending;
+
+  EventMailbox(const char *name) : name(name) {
+    alive = true;
+    mutex = SDL_CreateMutex();
+  }
+
+  ~EventMailbox() {
+    SDL_DestroyMutex(mutex);
+  }
+
+  // 返回true表示已合并到尚未执行的事件中，不需要再投递
+  bool post(void *sender, const EventPayload& payload, const EventCoalescing *coalescing) {
+    bool merged;
+    SDL_LockMutex(mutex);
+    {
+      auto found = pending.find(sender);
+      merged = found != pending.end();
+      if (merged) {
+        found->second.merge(*payload, coalescing);
+      } else {
+        pending.emplace(sender, PendingEvent(payload));
+      }
+    }
+    SDL_UnlockMutex(mutex);
+    return merged;
+  }
+
+  EventPayload take(void *sender) {
+    EventPayload payload;
+    SDL_LockMutex(mutex);
+    {
+      payload = _take_pending_event(pending, sender);
+    }
+    SDL_UnlockMutex(mutex);
+    return payload;
+  }
+};
+
 struct EventObserver {
-  const char   *name;
-  void         *sender;
-  EventHandler *handler;
+  const char    *name;
+  void          *sender;
+  EventHandler  *handler;
+  EventDelivery  delivery;
+  DispatchQueue *queue;
+  bool           removed; // 在分发过程中被移除，等分发结束后再释放
 
-  EventObserver(const char *name, void *sender, EventHandler *handler) {
-    this->name    = strdup(name);
-    this->sender  = sender;
-    this->handler = lms::retain(handler);
+  std::shared_ptr<EventMailbox> mailbox;
+
+  EventObserver(const char *name, void *sender, EventHandler *handler, EventDelivery delivery, DispatchQueue *queue) {
+    this->name     = strdup(name);
+    this->sender   = sender;
+    this->handler  = lms::retain(handler);
+    this->delivery = delivery;
+    this->queue    = lms::retain(queue);
+    this->removed  = false;
+    this->mailbox  = std::make_shared<EventMailbox>(name);
   }
   
   ~EventObserver() {
+    lms::release(queue);
     lms::release(handler);
     free((void *)name);
   }
+  
+  // 投递到队列的回调只持有参数的引用，分发给多个观察者时不会复制参数
+  void deliver(const char *name, void *sender, const EventPayload& payload, const EventCoalescing *coalescing) {
+    if (delivery != EventDeliveryQueue) {
+      handler->handleEvent(name, sender, *payload);
+      return;
+    }
+    
+    EventHandler *h = lms::retain(handler);
+    std::shared_ptr<EventMailbox> box = mailbox;
+    
+    if (coalescing == nullptr) {
+      lms::async(queue, name, [h, box, sender, payload] {
+        if (box->alive) {
+          h->handleEvent(box->name.c_str(), sender, *payload);
+        }
+        lms::release(h);
+      });
+      return;
+    }
+    
+    metricsAdd(coalescing->postedMetric.c_str());
+    if (box->post(sender, payload, coalescing)) {
+      metricsAdd(coalescing->mergedMetric.c_str());
+      lms::release(h);
+      return;
+    }
+    
+    // 参数在执行时才取出，此前同一sender的后续事件都合并到其中
+    lms::async(queue, name, [h, box, sender] {
+      EventPayload merged = box->take(sender);
+      if (box->alive) {
+        h->handleEvent(box->name.c_str(), sender, *merged);
+      }
+      lms::release(h);
+    });
+  }
 };
 
-class EventCenter {
+// 事件名称的FNV-1a哈希。查找时直接对C字符串计算，不需要构造std::string
+static size_t _hash_event_name(const char *name) {
+  size_t h = (size_t)14695981039346656037ULL;
+  for (const char *c = name; *c; ++c) {
+    h ^= (unsigned char)*c;
+    h *= (size_t)1099511628211ULL;
+  }
+  return h;
+}
+
+struct EventNameKey {
+  const char *name;
+  size_t      hash;
+};
+
+struct EventNameKeyHash {
+  size_t operator()(const EventNameKey& k) const {
+    return k.hash;
+  }
+};
+
+struct EventNameKeyEqual {
+  bool operator()(const EventNameKey& a, const EventNameKey& b) const {
+    return a.hash == b.hash && strcmp(a.name, b.name) == 0;
+  }
+};
+
+typedef std::vector<EventObserver *> EventObserverList;
+
+/*
+ @struct EventSlot
+ 同名事件的所有观察者，按sender分组：未指定sender的观察者接收所有发送者的事件，其余的只接收对应sender的事件
+ */
+struct EventSlot {
+  char             *name;
+  EventObserverList anySender;
+  std::unordered_map<void *, EventObserverList> bySender;
+
+  // 以下字段只在直接投递的分发表中使用
+  int               hosted;      // 在主线程中回调的观察者数量
+  EventCoalescing  *coalescing;  // 不可合并的事件为nullptr
+  PendingEvents     hostPending; // 已投递到主队列、尚未分发的可合并事件，按sender区分
+  std::string       hostRunnableName;
+};
+
+/*
+ @class EventTable
+ 事件分发表：按事件名称、再按sender两级索引，分发一个事件只需要两次哈希查找，与观察者的总数无关。
+
+ @discussion
+ 分发过程中允许添加与移除观察者：新添加的观察者从下一个事件开始生效；被移除的观察者立即不再收到事件，
+ 但直到最外层的分发结束才真正从分发表中删除并释放
+ */
+class EventTable {
 public:
+  EventTable() {
+    count       = 0;
+    dispatching = 0;
+  }
+  
+  ~EventTable() {
+    for (auto& s : slots) {
+      free(s.second->name);
+      delete s.second->coalescing;
+      delete s.second;
+    }
+  }
+  
+  EventSlot *findSlot(const char *name) {
+    EventNameKey key = { name, _hash_event_name(name) };
+    auto found = slots.find(key);
+    return found != slots.end() ? found->second : nullptr;
+  }
+  
+  EventSlot *obtainSlot(const char *name) {
+    EventSlot *slot = findSlot(name);
+    if (slot == nullptr) {
+      slot = new EventSlot;
+      slot->name       = strdup(name);
+      slot->hosted     = 0;
+      slot->coalescing = nullptr;
+      slot->hostRunnableName = std::string("DispatchEvent:") + name;
+      
+      EventNameKey key = { slot->name, _hash_event_name(slot->name) };
+      slots[key] = slot;
+    }
+    return slot;
+  }
+  
   void addObserver(EventObserver *o) {
-    assert(hostQueue());
-    observers.push_back(o);
+    EventSlot *slot = obtainSlot(o->name);
+    
+    if (o->sender == nullptr) {
+      slot->anySender.push_back(o);
+    } else {
+      slot->bySender[o->sender].push_back(o);
+    }
+    
+    count += 1;
   }
   
   void removeObserver(EventObserver *o) {
-    observers.remove(o);
+    o->mailbox->alive = false;
+    
+    if (dispatching > 0) {
+      o->removed = true;
+      graveyard.push_back(o);
+      return;
+    }
+    
+    detach(o);
+    delete o;
   }
   
-  void dispatchEvent(const char *name, void *sender, const EventParams& params) {
-    std::string nm = name;
-    std::string rname = "DispatchEvent:" + nm;
-    lms::async(hostQueue(), rname.c_str(), [this, nm, sender, params] () {
-      fire(nm.c_str(), sender, params);
-    });
+  void fire(EventSlot *slot, const char *name, void *sender, const EventPayload& payload) {
+    dispatching += 1;
+    {
+      deliver(slot->anySender, name, sender, payload, slot->coalescing);
+      
+      if (sender != nullptr) {
+        auto group = slot->bySender.find(sender);
+        if (group != slot->bySender.end()) {
+          deliver(group->second, name, sender, payload, slot->coalescing);
+        }
+      }
+    }
+    dispatching -= 1;
+    
+    if (dispatching == 0 && !graveyard.empty()) {
+      purge();
+    }
   }
 
-  std::list<EventObserver *> observers;
+  size_t count; // 观察者总数
 
 private:
-  void fire(const char *name, void *sender, const EventParams& params) {
-    for (auto o : observers) {
-      if (strcmp(name, o->name) == 0 && (o->sender == nullptr || o->sender == sender)) {
-        o->handler->handleEvent(name, sender, params);
+  void deliver(EventObserverList& list, const char *name, void *sender, const EventPayload& payload, const EventCoalescing *coalescing) {
+    // 分发过程中添加的观察者会追加到列表末尾（可能导致重新分配），因此按下标访问，并且只分发到开始时的数量为止
+    size_t n = list.size();
+    for (size_t i = 0; i < n; ++i) {
+      EventObserver *o = list[i];
+      if (!o->removed) {
+        o->deliver(name, sender, payload, coalescing);
       }
     }
   }
+  
+  void detach(EventObserver *o) {
+    EventNameKey key = { o->name, _hash_event_name(o->name) };
+    auto found = slots.find(key);
+    if (found == slots.end()) {
+      return;
+    }
+    
+    EventSlot *slot = found->second;
+    if (o->sender == nullptr) {
+      slot->anySender.erase(std::remove(slot->anySender.begin(), slot->anySender.end(), o), slot->anySender.end());
+    } else {
+      auto group = slot->bySender.find(o->sender);
+      if (group != slot->bySender.end()) {
+        auto& list = group->second;
+        list.erase(std::remove(list.begin(), list.end(), o), list.end());
+        
+        // sender多为生命周期较短的对象，分组为空时立即删除，以免分发表随之不断增长
+        if (list.empty()) {
+          slot->bySender.erase(group);
+        }
+      }
+    }
+    
+    count -= 1;
+  }
+  
+  void purge() {
+    std::vector<EventObserver *> removed;
+    removed.swap(graveyard);
+    
+    for (auto o : removed) {
+      detach(o);
+      delete o;
+    }
+  }
+  
+  std::unordered_map<EventNameKey, EventSlot *, EventNameKeyHash, EventNameKeyEqual> slots;
+  std::vector<EventObserver *> graveyard;
+  int dispatching; // 分发的嵌套深度（处理事件时可能触发其他事件的分发）
+};
+
+/*
+ @class EventCenter
+ 主线程回调的观察者与直接投递的观察者分别放在两张分发表中：
+   - hostTable  ：只在主线程中访问，事件经由主队列分发
+   - directTable：由mutex保护，事件在fireEvent的调用线程中直接分发，回调在该线程中执行或投递到指定队列
+ directTable同时记录每个事件在主线程中的观察者数量与合并规则，没有主线程观察者的事件不再投递到主队列，
+ 可合并的事件在主队列中同一sender只保留一个尚未分发的事件
+ */
+class EventCenter {
+public:
+  EventCenter() {
+    mutex = SDL_CreateMutex();
+  }
+  
+  ~EventCenter() {
+    SDL_DestroyMutex(mutex);
+  }
+  
+  void addObserver(EventObserver *o) {
+    if (o->delivery == EventDeliveryHost) {
+      assert(isHostThread());
+      hostTable.addObserver(o);
+    }
+    
+    SDL_LockMutex(mutex);
+    {
+      if (o->delivery == EventDeliveryHost) {
+        directTable.obtainSlot(o->name)->hosted += 1;
+      } else {
+        directTable.addObserver(o);
+      }
+    }
+    SDL_UnlockMutex(mutex);
+  }
+  
+  void removeObserver(EventObserver *o) {
+    if (o->delivery == EventDeliveryHost) {
+      assert(isHostThread());
+      
+      SDL_LockMutex(mutex);
+      {
+        directTable.obtainSlot(o->name)->hosted -= 1;
+      }
+      SDL_UnlockMutex(mutex);
+      
+      hostTable.removeObserver(o);
+      return;
+    }
+    
+    // 其他线程中正在进行的分发结束之后才能获得锁，因此返回之后不会再有直接回调
+    SDL_LockMutex(mutex);
+    {
+      directTable.removeObserver(o);
+    }
+    SDL_UnlockMutex(mutex);
+  }
+  
+  void setCoalescing(const char *name, const std::vector<std::string>& summedKeys) {
+    std::string metric = std::string("events.coalesce.") + name;
+    
+    SDL_LockMutex(mutex);
+    {
+      EventSlot *slot = directTable.obtainSlot(name);
+      if (slot->coalescing == nullptr) {
+        slot->coalescing = new EventCoalescing;
+      }
+      slot->coalescing->summedKeys   = summedKeys;
+      slot->coalescing->postedMetric = metric + ".posted";
+      slot->coalescing->mergedMetric = metric + ".merged";
+    }
+    SDL_UnlockMutex(mutex);
+  }
+  
+  /*
+   @function dispatchEvent
+   参数只在发出时构造一次，之后直接回调、投递到各个队列与主队列的分发都共享同一份不可修改的参数
+   */
+  void dispatchEvent(const char *name, void *sender, const EventPayload& payload) {
+    EventSlot *hostSlot = nullptr; // 需要投递到主队列时为directTable中对应的slot，其名称在整个生命周期内有效
+    bool merged = false;
+    
+    // SDL_mutex可以重入，直接回调中再次发出事件不会死锁
+    SDL_LockMutex(mutex);
+    {
+      EventSlot *slot = directTable.findSlot(name);
+      if (slot) {
+        directTable.fire(slot, name, sender, payload);
+        
+        if (slot->hosted > 0) {
+          hostSlot = slot;
+          
+          if (slot->coalescing) {
+            auto found = slot->hostPending.find(sender);
+            merged = found != slot->hostPending.end();
+            if (merged) {
+              found->second.merge(*payload, slot->coalescing);
+            } else {
+              slot->hostPending.emplace(sender, PendingEvent(payload));
+            }
+          }
+        }
+      }
+    }
+    SDL_UnlockMutex(mutex);
+    
+    if (hostSlot == nullptr) {
+      return;
+    }
+    
+    if (hostSlot->coalescing) {
+      dispatchCoalescedToHost(hostSlot, sender, merged);
+      return;
+    }
+    
+    lms::async(hostQueue(), hostSlot->hostRunnableName.c_str(), [this, hostSlot, sender, payload] () {
+      fireHost(hostSlot->name, sender, payload);
+    });
+  }
+  
+  // 参数在主线程中分发时才取出，此前同一sender的后续事件都合并到其中
+  void dispatchCoalescedToHost(EventSlot *directSlot, void *sender, bool merged) {
+    metricsAdd(directSlot->coalescing->postedMetric.c_str());
+    if (merged) {
+      metricsAdd(directSlot->coalescing->mergedMetric.c_str());
+      return;
+    }
+    
+    lms::async(hostQueue(), directSlot->hostRunnableName.c_str(), [this, directSlot, sender] () {
+      EventPayload payload;
+      SDL_LockMutex(mutex);
+      {
+        payload = _take_pending_event(directSlot->hostPending, sender);
+      }
+      SDL_UnlockMutex(mutex);
+      
+      fireHost(directSlot->name, sender, payload);
+    });
+  }
+  
+  void fireHost(const char *name, void *sender, const EventPayload& payload) {
+    EventSlot *slot = hostTable.findSlot(name);
+    if (slot) {
+      hostTable.fire(slot, name, sender, payload);
+    }
+  }
+  
+  size_t count() {
+    return hostTable.count + directTable.count;
+  }
+
+private:
+  EventTable hostTable;
+  EventTable directTable;
+  SDL_mutex *mutex;
 };
 
 class LambdaEventHandler : public EventHandler {
@@ -96,7 +578,13 @@ public:
 };
 
 void* addEventObserver(const char *name, void *sender, EventHandler *handler) {
-  EventObserver *o = new EventObserver(name, sender, handler);
+  return addEventObserver(name, sender, handler, EventDeliveryHost);
+}
+
+void* addEventObserver(const char *name, void *sender, EventHandler *handler, EventDelivery delivery, DispatchQueue *queue) {
+  assert(delivery != EventDeliveryQueue || queue != nullptr);
+  
+  EventObserver *o = new EventObserver(name, sender, handler, delivery, queue);
   _eventCenter->addObserver(o);
   return o;
 }
@@ -110,21 +598,41 @@ void* addEventObserver(const char *name, void *sender, std::function<void(const
 }
 
 void* addEventObserver(const char *name, void *sender, void *context, EventCallback evtCallback) {
+  return addEventObserver(name, sender, context, evtCallback, EventDeliveryHost);
+}
+
+void* addEventObserver(const char *name, void *sender, void *context, EventCallback evtCallback,
+                       EventDelivery delivery, DispatchQueue *queue) {
   EventHandler *handler = new CallbackEventHandler(context, evtCallback);
-  void *obs = addEventObserver(name, sender, handler);
+  void *obs = addEventObserver(name, sender, handler, delivery, queue);
   lms::release(handler);
 
   return obs;
 }
 
 void removeEventObserver(void *observer) {
-  EventObserver *o = (EventObserver *)observer;
-  _eventCenter->removeObserver(o);
-  delete o;
+  // 观察者由EventCenter负责释放，分发过程中被移除时会延后到分发结束
+  _eventCenter->removeObserver((EventObserver *)observer);
+}
+
+void setEventCoalescing(const char *name, const std::vector<std::string>& summedKeys) {
+  _eventCenter->setCoalescing(name, summedKeys);
+}
+
+EventPayload makeEventPayload(EventParams&& params) {
+  return std::make_shared<const EventParams>(std::move(params));
 }
 
 void fireEvent(const char *name, void *sender, const EventParams& params) {
-  _eventCenter->dispatchEvent(name, sender, params);
+  _eventCenter->dispatchEvent(name, sender, std::make_shared<const EventParams>(params));
+}
+
+void fireEvent(const char *name, void *sender, EventParams&& params) {
+  _eventCenter->dispatchEvent(name, sender, makeEventPayload(std::move(params)));
+}
+
+void fireEventPayload(const char *name, void *sender, const EventPayload& payload) {
+  _eventCenter->dispatchEvent(name, sender, payload);
 }
 
 // ---
@@ -134,7 +642,7 @@ static void setupEventCenter() {
 }
 
 static void teardownEventCenter() {
-  assert(_eventCenter->observers.empty());
+  assert(_eventCenter->count() == 0);
   assert(isHostThread());
     
   delete _eventCenter;
@@ -9,12 +9,23 @@
 
 #include <lms/Foundation.h>
 #include <map>
+#include <memory>
 #include <string>
+#include <vector>
 
 namespace lms {
 
 typedef std::map<std::string, Variant> EventParams;
 
+/*
+ @typedef EventPayload
+ 构造完成后不再修改的事件参数，以引用计数共享。分发给多个观察者、投递到多个队列时都共享同一份参数，
+ 不会复制其中的键与Variant
+ */
+typedef std::shared_ptr<const EventParams> EventPayload;
+
+EventPayload makeEventPayload(EventParams&& params);
+
 class EventHandler : virtual public Object {
 public:
   virtual void handleEvent(const char *name, void *sender, const EventParams& params) = 0;
@@ -22,11 +33,67 @@ public:
 
 typedef void (*EventCallback)(void *context, const char *eventName, void *sender, const EventParams& params);
 
+class DispatchQueue;
+
+/*
+ @enum EventDelivery
+ 观察者接收事件的方式
+ */
+enum EventDelivery {
+  EventDeliveryHost   = 0, // 经由主队列，在主线程中回调（默认）
+  EventDeliveryInline = 1, // 在调用fireEvent的线程中直接回调
+  EventDeliveryQueue  = 2, // 在调用fireEvent的线程中直接投递到指定的DispatchQueue
+};
+
+/*
+ @function addEventObserver
+ 添加事件观察者，需要在主线程中调用。sender为nullptr时接收所有发送者的同名事件，否则只接收该sender发出的事件。
+ 事件按名称与sender建立索引，指定sender的观察者不会增加其他sender的事件的分发开销。
+
+ @discussion
+ 数据面的高频事件（"decode_frame"、"update_decode_skip"）以其所针对的流对象（AVStream）作为sender发出，
+ 只关心某个流的观察者应以该流对象订阅
+ */
 void* addEventObserver(const char *name, void *sender, EventHandler *handler);
 void* addEventObserver(const char *name, void *sender, std::function<void(const char *, void *, const EventParams&)> block);
 void* addEventObserver(const char *name, void *sender, void *context, EventCallback evtCallback);
+
+/*
+ @function addEventObserver
+ 以指定的方式接收事件，可以在任意线程中调用。适用于高频的数据面事件：回调本身只需要在某个工作队列中执行时，
+ 使用EventDeliveryQueue可以省去经由主队列的一次转发；没有主线程观察者的事件不会再投递到主队列。
+
+ @discussion
+ EventDeliveryInline的回调在发出事件的线程中、持有分发表的锁时执行，不能阻塞或等待其他线程，只适合极短的处理。
+ removeEventObserver返回之后不会再有新的直接回调；已经投递到队列、尚未执行的回调会被跳过，
+ 但正在队列中执行的回调不会被等待，通常应先移除观察者，再释放对应的队列
+ */
+void* addEventObserver(const char *name, void *sender, EventHandler *handler, EventDelivery delivery, DispatchQueue *queue = nullptr);
+void* addEventObserver(const char *name, void *sender, void *context, EventCallback evtCallback,
+                       EventDelivery delivery, DispatchQueue *queue = nullptr);
+
 void removeEventObserver(void *observer);
 
-void fireEvent(const char *name, void *sender, const EventParams& params = {});
+/*
+ @function setEventCoalescing
+ 将事件声明为可合并的，通常在模块的setup中、发出该事件之前调用。已投递（到主队列或观察者指定的队列）但尚未分发的
+ 同名、同sender的事件会合并为一个：summedKeys中的参数累加，其余参数取最新一次的值。
+ EventDeliveryInline的观察者不受影响，仍会逐个收到事件
+
+ @discussion
+ 适用于短时间内成批发出、只关心最新状态或累计数量的通知，例如 "decode_frame"（累加 "count"）与
+ "did_update_packets"（累加 "increment"、"decrement"）。合并情况记录在指标 "events.coalesce.<name>.posted"
+ 与 "events.coalesce.<name>.merged" 中，两者之比即为合并率
+ */
+void setEventCoalescing(const char *name, const std::vector<std::string>& summedKeys);
+
+/*
+ @function fireEvent
+ 发出事件。参数以右值传入（包括直接使用初始化列表）时会被移入事件中，否则复制一次；之后的分发过程不再复制参数。
+ 同一组参数需要反复发出时，可以先用makeEventPayload构造，再通过fireEventPayload发出
+ */
+void fireEvent(const char *name, void *sender, EventParams&& params = {});
+void fireEvent(const char *name, void *sender, const EventParams& params);
+void fireEventPayload(const char *name, void *sender, const EventPayload& payload);
 
 }
@@ -12,12 +12,16 @@ namespace lms {
 
 // TODO: 使用脚本进行注入，而不是手动导入符号
 extern Module moduleLogger;
+extern Module moduleMetrics;
 extern Module moduleRuntime;
 extern Module moduleEventCenter;
+extern Module moduleDecoderRegistry;
 
 static Module mods[] = {
+  moduleMetrics,
   moduleRuntime,
   moduleEventCenter,
+  moduleDecoderRegistry,
 };
 
 void init() {
@@ -9,8 +9,11 @@
 
 #include <lms/Foundation.h>
 #include <lms/Logger.h>
+#include <lms/Metrics.h>
 #include <lms/MediaSource.h>
+#include <lms/Decoder.h>
 #include <lms/Player.h>
+#include <lms/PlaylistSource.h>
 
 namespace lms {
 
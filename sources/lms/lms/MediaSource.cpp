@@ -1,4 +1,6 @@
 #include "MediaSource.h"
+#include "Events.h"
+#include <algorithm>
 
 namespace lms {
 
@@ -10,6 +12,23 @@ void MediaSource::removeReceiver(Cell *receiver) {
   receivers.remove(receiver);
 }
 
+void MediaSource::requestPackets(const PacketRequest& request, PacketRequestCompletion completion) {
+  int count = request.limit;
+  if (!request.quotas.empty()) {
+    int total = 0;
+    for (auto& q : request.quotas) {
+      total += q.second;
+    }
+    count = std::min(count, total);
+  }
+  
+  fireEvent("load_packets", this, {
+    { "count", count }
+  });
+  
+  completion(request.quotas, false);
+}
+
 void MediaSource::deliverPacketMessage(const PipelineMessage& msg) {
   for (auto r : receivers) {
     r->didReceivePipelineMessage(msg);
@@ -2,27 +2,95 @@
 
 #include <lms/Foundation.h>
 #include <lms/Cell.h>
+#include <functional>
 #include <list>
+#include <map>
 
 namespace lms {
 
 typedef int StreamId;
 
-const StreamId StreamIdAny = -1;
+const StreamId StreamIdAny  = -1;
+const StreamId StreamIdNone = -2;
 
 enum MediaType {
   MediaTypeVideo = 0,
   MediaTypeAudio = 1,
 };
 
+enum SeekMode {
+  SeekModeNearestKeyframe  = 0, // 定位到距目标时间最近的关键帧（前后均可）
+  SeekModePreviousKeyframe = 1, // 定位到目标时间之前（含）最近的关键帧
+  SeekModeAccurate         = 2, // 定位到目标时间之前最近的关键帧，并由解码器丢弃目标时间之前的帧，实现精确到帧的定位
+};
+
+/*
+ @struct PacketRequest
+ 数据包加载请求。quotas为空时不区分流，读取limit个数据包即可；否则读取到各个流的配额均已满足为止，
+ 但最多读取limit个数据包（包括其他流的数据包，它们同样会被投递），以免为了某个稀疏的流读入过多其他流的数据
+ */
+typedef struct {
+  std::map<StreamId, int> quotas; // 流索引 -> 需要的数据包数量
+  int                     limit;  // 本次最多读取的数据包数量
+} PacketRequest;
+
+/*
+ 加载请求完成的回调，可能在任意线程中调用。delivered为各个流实际投递的数据包数量，eof表示已经读到数据源的结尾
+ */
+typedef std::function<void(const std::map<StreamId, int>& delivered, bool eof)> PacketRequestCompletion;
+
+/*
+ @class MediaSource
+ 媒体数据源。数据包以PipelineMessage的形式投递给各个接收者：
+   - type="media_packet"：stream_object, packet_object, serial
+   - type="flush"       ：stream_object, serial。seek之后，在新位置的首个数据包之前为每个流各投递一次，
+                          接收者应丢弃所有缓存的数据，并只接受相同serial的后续数据。可选参数：
+                            request_time  发起seek时的av_gettime_relative()（微秒），用于统计定位耗时
+                            seek_target   精确定位的目标时间（AV_TIME_BASE单位），早于该时间的帧应被丢弃
+   - type="codec_change"：stream_object, codec_parameters, serial。之后的数据包使用新的编码参数，接收者应在
+                          处理完之前的数据包后按新参数重新初始化（参考PlaylistSource）
+ */
 class MediaSource : public Object {
 public:
+  /*
+   @function open
+   打开数据源并解析出各个流的信息。可能在工作线程中被调用（参考Player::prepareAsync），
+   实现中需要在主线程中完成的工作（例如注册事件观察者）应通过sync(hostQueue(), ...)完成。其余方法仍在主线程中调用
+   */
   virtual int open() = 0;
   virtual void close() = 0;
 
   virtual int numberOfStreams() = 0;
   virtual StreamMeta getStreamMeta(size_t streamIndex) = 0;
 
+  /*
+   @function seek
+   异步定位到time（秒，与流中时间戳的时间轴一致）附近的关键帧，成功时投递flush消息
+
+   @return 0表示请求已受理，<0表示该数据源不支持定位
+   */
+  virtual int seek(double time, SeekMode mode) { return -1; }
+
+  /*
+   @function setKeyframeOnly
+   开启后只解封装视频流的关键帧，其余数据包在读取时即被丢弃。适用于拖动预览、缩略图生成等场景
+   */
+  virtual void setKeyframeOnly(bool enabled) {}
+
+  /*
+   @function setStreamSelected
+   设置流是否需要被投递，需要在open之后调用。默认所有流都会被投递，未被选中的流的数据包应尽可能在解封装阶段
+   就被丢弃，不再产生内存分配和消息投递的开销
+   */
+  virtual void setStreamSelected(size_t streamIndex, bool selected) {}
+  
+  /*
+   @function requestPackets
+   异步加载数据包，可以在任意线程中调用（open之后、close之前）。默认实现通过 "load_packets" 事件
+   （参数：count）加载，由于无法得知实际投递的数量，会假定各个流的配额均已被满足
+   */
+  virtual void requestPackets(const PacketRequest& request, PacketRequestCompletion completion);
+
 public:
   void addReceiver(Cell *receiver);
   void removeReceiver(Cell *receiver);
@@ -30,9 +98,6 @@ public:
 protected:
   void deliverPacketMessage(const PipelineMessage& msg);
 
-private:
-  void loadPackets(int numberRequested);
-
 private:
   std::list<Cell *> receivers;
 };
@@ -0,0 +1,98 @@
+#include "Metrics.h"
+#include "Logger.h"
+#include "Module.h"
+extern "C" {
+#include <SDL2/SDL.h>
+}
+#include <algorithm>
+#include <limits>
+
+namespace lms {
+
+static SDL_mutex                          *_metricsMutex;
+static std::map<std::string, MetricValue>  _metrics;
+
+static void record(const char *name, double value, bool accumulate) {
+  SDL_LockMutex(_metricsMutex);
+  {
+    auto found = _metrics.find(name);
+    if (found == _metrics.end()) {
+      MetricValue initial = { 0, 0.0, std::numeric_limits<double>::max(), std::numeric_limits<double>::lowest(), 0.0 };
+      found = _metrics.insert({ name, initial }).first;
+    }
+
+    MetricValue& m = found->second;
+    m.count += 1;
+    m.sum   += value;
+    m.last   = accumulate ? m.sum : value;
+    m.min    = std::min(m.min, m.last);
+    m.max    = std::max(m.max, m.last);
+  }
+  SDL_UnlockMutex(_metricsMutex);
+}
+
+void metricsAdd(const char *name, double delta) {
+  record(name, delta, true);
+}
+
+void metricsObserve(const char *name, double value) {
+  record(name, value, false);
+}
+
+MetricValue getMetric(const char *name) {
+  MetricValue value = { 0, 0.0, 0.0, 0.0, 0.0 };
+
+  SDL_LockMutex(_metricsMutex);
+  {
+    auto found = _metrics.find(name);
+    if (found != _metrics.end()) {
+      value = found->second;
+    }
+  }
+  SDL_UnlockMutex(_metricsMutex);
+
+  return value;
+}
+
+std::map<std::string, MetricValue> snapshotMetrics() {
+  std::map<std::string, MetricValue> snapshot;
+
+  SDL_LockMutex(_metricsMutex);
+  {
+    snapshot = _metrics;
+  }
+  SDL_UnlockMutex(_metricsMutex);
+
+  return snapshot;
+}
+
+void dumpMetrics() {
+  auto snapshot = snapshotMetrics();
+
+  LMSLogInfo("Metrics: %d", (int)snapshot.size());
+  for (auto& item : snapshot) {
+    const MetricValue& m = item.second;
+    LMSLogInfo("  %-40s n=%-8llu last=%-10.3lf avg=%-10.3lf min=%-10.3lf max=%.3lf",
+               item.first.c_str(), (unsigned long long)m.count, m.last, m.sum / m.count, m.min, m.max);
+  }
+}
+
+static void setupMetrics() {
+  _metricsMutex = SDL_CreateMutex();
+}
+
+static void teardownMetrics() {
+  dumpMetrics();
+
+  _metrics.clear();
+  SDL_DestroyMutex(_metricsMutex);
+  _metricsMutex = nullptr;
+}
+
+Module moduleMetrics = {
+  .name     = "Metrics",
+  .setup    = setupMetrics,
+  .teardown = teardownMetrics
+};
+
+}
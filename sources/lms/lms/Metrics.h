@@ -0,0 +1,40 @@
+#pragma once
+
+#include <lms/Foundation.h>
+#include <map>
+#include <string>
+
+namespace lms {
+
+/*
+ @struct MetricValue
+ 进程内的运行指标。指标按名称区分，名称建议使用 "模块.对象.指标" 的分段格式，例如
+ "video.decode_skip.level"。以下所有接口都是线程安全的，可以在任意线程中调用
+ */
+typedef struct {
+  uint64_t count; // 记录次数
+  double   sum;   // 所有记录值之和，对于计数器即为当前累计值
+  double   min;
+  double   max;
+  double   last;  // 最近一次记录的值
+} MetricValue;
+
+/*
+ @function metricsAdd
+ 计数器：将delta累加到指标上
+ */
+void metricsAdd(const char *name, double delta = 1.0);
+
+/*
+ @function metricsObserve
+ 采样/仪表：记录一次观测值，同时维护次数、总和、最值与最近值
+ */
+void metricsObserve(const char *name, double value);
+
+MetricValue getMetric(const char *name);
+std::map<std::string, MetricValue> snapshotMetrics();
+
+// 将当前所有指标输出到日志中
+void dumpMetrics();
+
+}
@@ -3,6 +3,7 @@
 #include "Decoder.h"
 #include "Buffer.h"
 #include "Logger.h"
+#include "Metrics.h"
 #include "Runtime.h"
 #include "Cell.h"
 #include "Events.h"
@@ -18,6 +19,7 @@ extern "C" {
   #include <libswscale/swscale.h>
   #include <libswresample/swresample.h>
   #include <libavutil/imgutils.h>
+  #include <libavutil/time.h>
   #include <SDL2/SDL.h>
 }
 #include <vector>
@@ -38,12 +40,28 @@ Player::Player(MediaSource *mediaSource, Cell *vrender) {
   this->timesync    = new TimeSync;
   this->vstream     = nullptr;
   this->astream     = nullptr;
+  this->videoTrack  = StreamIdAny;
+  this->audioTrack  = StreamIdAny;
+  this->playingVideoTrack = StreamIdNone;
+  this->playingAudioTrack = StreamIdNone;
+  this->state       = PlayerStateIdle;
+  this->prepareCancelled  = false;
+  this->startWhenPrepared = false;
+  this->pendingStreams    = 0;
+  this->prepareQueue      = nullptr;
+  this->audioPrepareQueue = nullptr;
+  this->playBegin   = 0;
+  this->eoMilestone = nullptr;
+  this->keyframeOnly = false;
+  this->pendingKeyframeTime = -1.0;
 }
 
 Player::~Player() {
   assert(!vstream);
   assert(!astream);
 
+  lms::release(prepareQueue);
+  lms::release(audioPrepareQueue);
   lms::release(coordinator);
   lms::release(timesync);
   lms::release(source);
@@ -52,8 +70,39 @@ Player::~Player() {
 
 void Player::play() {
   sync(hostQueue(), "StartPlay", [this] {
-    doPlay();
+    if (state == PlayerStateIdle) {
+      playBegin = av_gettime_relative();
+      doPlay();
+    } else if (state == PlayerStatePrepared) {
+      startStreams();
+    } else if (state == PlayerStatePreparing) {
+      doPrepare(nullptr, true);
+    }
+  });
+}
+
+void Player::prepareAsync(PlayerCompletion completion) {
+  lms::retain(this);
+  async(hostQueue(), "PreparePlay", [this, completion] {
+    doPrepare(completion, false);
+    lms::release(this);
+  });
+}
+
+void Player::playAsync(PlayerCompletion completion) {
+  lms::retain(this);
+  async(hostQueue(), "PreparePlay", [this, completion] {
+    doPrepare(completion, true);
+    lms::release(this);
+  });
+}
+
+PlayerState Player::getState() {
+  PlayerState st;
+  sync(hostQueue(), "GetState", [this, &st] {
+    st = state;
   });
+  return st;
 }
 
 void Player::stop() {
@@ -62,25 +111,206 @@ void Player::stop() {
   });
 }
 
-void Player::doPlay() {
-  LMSLogInfo(nullptr);
+void Player::setVideoTrack(StreamId track) {
+  sync(hostQueue(), "SetVideoTrack", [this, track] {
+    videoTrack = track;
+  });
+}
 
-  // 必须先加载source的数据才能获取当中的元信息
-  if (source->open() != 0) {
+void Player::setAudioTrack(StreamId track) {
+  sync(hostQueue(), "SetAudioTrack", [this, track] {
+    audioTrack = track;
+  });
+}
+
+StreamId Player::getVideoTrack() {
+  StreamId track;
+  sync(hostQueue(), "GetVideoTrack", [this, &track] {
+    track = playingVideoTrack;
+  });
+  return track;
+}
+
+StreamId Player::getAudioTrack() {
+  StreamId track;
+  sync(hostQueue(), "GetAudioTrack", [this, &track] {
+    track = playingAudioTrack;
+  });
+  return track;
+}
+
+void Player::seek(double time) {
+  sync(hostQueue(), "Seek", [this, time] {
+    if (state != PlayerStatePlaying) {
+      return;
+    }
+    
+    double target = std::max(time, 0.0);
+    if (source->seek(target, SeekModeAccurate) != 0) {
+      LMSLogWarning("Seek not supported by source: time=%.3lf", target);
+      return;
+    }
+    
+    metricsAdd("player.seek.requests");
+    
+    // 有音频时由音频首帧重新建立播放时钟，纯视频时直接将时钟设置为目标时间
+    timesync->updateTimePivot(astream ? InvalidPlayingTime : target);
+    
+    // flush会清空链路上缓存的数据包，需要重新预加载
+    coordinator->preload();
+  });
+}
+
+void Player::setPacketWatermark(MediaType type, int low, int high) {
+  PacketWatermark watermark = { std::max(low, 1), std::max(high, low + 1) };
+  coordinator->setWatermark(type, watermark);
+}
+
+void Player::setLookAheadLimit(int limit) {
+  coordinator->setLookAheadLimit(limit);
+}
+
+void Player::setKeyframeOnly(bool enabled) {
+  sync(hostQueue(), "SetKeyframeOnly", [this, enabled] {
+    keyframeOnly = enabled;
+    source->setKeyframeOnly(enabled);
+    coordinator->setRefillEnabled(!enabled);
+    fireDecodeModeEvent();
+  });
+}
+
+void Player::requestKeyframe(double time) {
+  // 前一个请求尚未被处理时，只需更新目标时间即可
+  double pending = pendingKeyframeTime.exchange(std::max(time, 0.0));
+  if (pending >= 0) {
+    return;
+  }
+  
+  async(hostQueue(), "RequestKeyframe", [this] {
+    double target = pendingKeyframeTime.exchange(-1.0);
+    if (target < 0 || vstream == nullptr || state != PlayerStatePlaying) {
+      return;
+    }
+    
+    if (!keyframeOnly) {
+      LMSLogWarning("Keyframe requested without keyframe only mode: time=%.3lf", target);
+    }
+
+    // 关键帧模式下数据源只会读出关键帧，因此定位后加载一个数据包即可得到目标画面
+    if (source->seek(target, SeekModeNearestKeyframe) == 0) {
+      coordinator->reload(1);
+    }
+  });
+}
+
+void Player::fireDecodeModeEvent() {
+  if (vstream == nullptr) {
+    return;
+  }
+  
+  fireEvent("update_decode_mode", this, {
+    { "stream_object", vstream->getMeta().at("stream_object") },
+    { "keyframe_only", keyframeOnly },
+  });
+}
+
+void Player::onEventDidReachMilestone(Player *self, const char *evtName, void *sender, const EventParams& p) {
+  const char *milestone = variantsGetCString(p, "milestone", "");
+  int64_t     time      = variantsGetInt(p, "time");
+  void       *stream    = variantsGetPointer(p, "stream_object");
+  
+  std::map<std::string, int64_t> *milestones = nullptr;
+  const char *kind = nullptr;
+  if (sender == self->source) {
+    milestones = &self->sourceMilestones;
+  } else if (self->vstream && stream == self->vstream->getMeta().at("stream_object").value.ptr) {
+    milestones = &self->videoMilestones;
+    kind = "video";
+  } else if (self->astream && stream == self->astream->getMeta().at("stream_object").value.ptr) {
+    milestones = &self->audioMilestones;
+    kind = "audio";
+  } else {
+    return;
+  }
+  
+  // 只记录启动后第一次到达的时间
+  if (milestones->count(milestone) > 0) {
     return;
   }
+  (*milestones)[milestone] = time;
   
+  if (kind && strcmp(milestone, "first_present") == 0) {
+    self->reportStartup(kind, *milestones);
+  }
+}
+
+void Player::reportStartup(const char *kind, const std::map<std::string, int64_t>& milestones) {
+  // 按启动顺序依次计算各个阶段的耗时，缺失的阶段（例如数据源不提供open/probe的时间点）计入下一个阶段
+  static const char *stages[] = { "opened", "probed", "first_packet", "first_decode", "first_present" };
+  static const char *stageNames[] = { "open", "probe", "first_packet", "first_decode", "first_present" };
+  
+  char line[256];
+  int  len  = 0;
+  int64_t prev = playBegin;
+  for (int i = 0; i < 5; i += 1) {
+    auto& from = (i < 2) ? sourceMilestones : milestones;
+    auto found = from.find(stages[i]);
+    if (found == from.end()) {
+      continue;
+    }
+    
+    double ms = (found->second - prev) / 1000.0;
+    prev = found->second;
+    
+    std::string metric = std::string("player.startup.") + kind + "." + stageNames[i] + "_ms";
+    metricsObserve(metric.c_str(), ms);
+    len += snprintf(line + len, sizeof(line) - len, " %s=%.2lf", stageNames[i], ms);
+  }
+  
+  double total = (milestones.at("first_present") - playBegin) / 1000.0;
+  std::string metric = std::string("player.startup.") + kind + ".total_ms";
+  metricsObserve(metric.c_str(), total);
+  
+  LMSLogInfo("Time to first %s: total=%.2lfms |%s", kind, total, line);
+}
+
+void Player::beginPrepare() {
+  sourceMilestones.clear();
+  videoMilestones.clear();
+  audioMilestones.clear();
+  if (eoMilestone == nullptr) {
+    eoMilestone = addEventObserver("did_reach_milestone", nullptr, this, (EventCallback)onEventDidReachMilestone);
+  }
+}
+
+int Player::createStreams() {
   auto nbStreams = source->numberOfStreams();
-  int  streamId = -1;
   for (int i = 0; i < nbStreams; i += 1) {
     auto meta   = source->getStreamMeta(i);
     auto mtype  = meta.at("media_type").value.u;
     auto stream = (AVStream *)meta.at("stream_object").value.ptr;
 
+    if (mtype != MediaTypeVideo && mtype != MediaTypeAudio) {
+      continue;
+    }
+    
+    // 每种类型只播放一个流：已经选定了该类型的流，或者该流不是指定的流时跳过
+    bool isVideo = mtype == MediaTypeVideo;
+    StreamId wanted = isVideo ? videoTrack : audioTrack;
+    if ((isVideo ? vstream : astream) != nullptr || wanted == StreamIdNone || (wanted != StreamIdAny && wanted != i)) {
+      continue;
+    }
+    
+    Cell *decoder = createDecoder(meta);
+    if (decoder == nullptr) {
+      LMSLogWarning("Stream skipped, no decoder available: stream:%d", i);
+      continue;
+    }
+
     if (mtype == MediaTypeVideo) {
       Cell *driver = new VideoRenderDriver(stream, vrender, timesync);
-      Cell *decoder = createDecoder(meta);
       vstream = new Stream(meta, decoder, nullptr, driver);
+      playingVideoTrack = i;
 
       // Video Render 是外部传入的，所以需要认为配置一下，以便其获取stream相关的元信息
       vrender->configure(meta);
@@ -89,9 +319,9 @@ void Player::doPlay() {
       lms::release(decoder);
     } else if (mtype == MediaTypeAudio) {
       Cell *speaker = createSpeaker(stream, timesync);
-      Cell *decoder = createDecoder(meta);
       Cell *resampler = createAudioResampler(stream);
       astream = new Stream(meta, decoder, resampler, speaker);
+      playingAudioTrack = i;
       
       lms::release(resampler);
       lms::release(decoder);
@@ -101,9 +331,20 @@ void Player::doPlay() {
   
   if (vstream == nullptr && astream == nullptr) {
     LMSLogError("Failed creating video & audio stream");
-    return;
+    return AVERROR_STREAM_NOT_FOUND;
+  }
+  
+  LMSLogInfo("Tracks selected: video=%d, audio=%d", playingVideoTrack, playingAudioTrack);
+  
+  // 只投递正在播放的流，其余的流在解封装阶段即被丢弃
+  for (int i = 0; i < nbStreams; i += 1) {
+    source->setStreamSelected(i, i == playingVideoTrack || i == playingAudioTrack);
   }
   
+  return 0;
+}
+
+void Player::startStreams() {
   // [#55 避免视频的头几帧被丢弃]
   // 在player启动播放时，会立即开始帧渲染。但是视频的播放可能早于处理音频第一帧的时间。而播放时间轴的初始化是在音频首帧播放
   // 时设置的。这会导致部分部分视频帧被丢弃。所以，在astream, vstream启动前，应手动重置播放时间轴为无效状态。直到音频首帧加载后将时间轴
@@ -112,39 +353,261 @@ void Player::doPlay() {
   
   if (vstream) {
     source->addReceiver(vstream);
+    coordinator->addStream(playingVideoTrack, vstream->getMeta());
     vstream->start();
   }
   
   if (astream) {
     source->addReceiver(astream);
+    coordinator->addStream(playingAudioTrack, astream->getMeta());
     astream->start();
   }
   
+  if (keyframeOnly) {
+    coordinator->setRefillEnabled(false);
+    fireDecodeModeEvent();
+  }
+  
   coordinator->start();
+  state = PlayerStatePlaying;
 }
 
-void Player::doStop() {
+void Player::releaseStreams() {
+  lms::release(vstream);
+  vstream = nullptr;
+  
+  lms::release(astream);
+  astream = nullptr;
+  
+  playingVideoTrack = StreamIdNone;
+  playingAudioTrack = StreamIdNone;
+}
+
+void Player::doPlay() {
   LMSLogInfo(nullptr);
   
-  coordinator->stop();
+  beginPrepare();
+
+  // 必须先加载source的数据才能获取当中的元信息
+  if (source->open() != 0) {
+    return;
+  }
   
-  if (astream) {
-    astream->stop();
-    source->removeReceiver(astream);
+  if (createStreams() != 0) {
+    source->close();
+    return;
   }
   
-  if (vstream) {
-    vstream->stop();
-    source->removeReceiver(vstream);
+  state = PlayerStatePrepared;
+  startStreams();
+}
+
+void Player::doPrepare(PlayerCompletion completion, bool autoStart) {
+  if (state == PlayerStatePrepared || state == PlayerStatePlaying) {
+    if (autoStart && state == PlayerStatePrepared) {
+      startStreams();
+    }
+    
+    if (completion) {
+      completion(0);
+    }
+    return;
+  }
+  
+  if (completion) {
+    completions.push_back(completion);
   }
+  startWhenPrepared = startWhenPrepared || autoStart;
+  
+  // 已被取消、但后台任务尚未返回的准备过程可以直接继续使用
+  if (state == PlayerStatePreparing) {
+    prepareCancelled = false;
+    return;
+  }
+  
+  LMSLogInfo(nullptr);
+  
+  state = PlayerStatePreparing;
+  playBegin = av_gettime_relative();
+  beginPrepare();
+  
+  if (prepareQueue == nullptr) {
+    prepareQueue      = createDispatchQueue("LMS_PlayerPrepare(V)", QueueTypeWorker);
+    audioPrepareQueue = createDispatchQueue("LMS_PlayerPrepare(A)", QueueTypeWorker);
+  }
+  
+  // 准备过程结束（finishPrepare）之前需要保持player存活
+  lms::retain(this);
+  async(prepareQueue, "OpenSource", [this] {
+    int rt = source->open();
+    async(hostQueue(), "DidOpenSource", [this, rt] {
+      didOpenSource(rt);
+    });
+  });
+}
 
-  source->close();
+void Player::didOpenSource(int result) {
+  if (prepareCancelled) {
+    if (result == 0) {
+      source->close();
+    }
+    finishPrepare(AVERROR_EXIT);
+    return;
+  }
+  
+  if (result != 0) {
+    LMSLogError("Failed opening source: code=%d", result);
+    finishPrepare(result);
+    return;
+  }
+  
+  // 流的创建需要访问解码器注册表以及视频渲染端，在主线程中完成，开销较小
+  int rt = createStreams();
+  if (rt != 0) {
+    source->close();
+    finishPrepare(rt);
+    return;
+  }
+  
+  // 音频、视频解码器分别在各自的工作线程中并行打开
+  Stream        *streams[] = { vstream, astream };
+  DispatchQueue *queues[]  = { prepareQueue, audioPrepareQueue };
+  
+  pendingStreams = 0;
+  for (int i = 0; i < 2; i += 1) {
+    Stream *s = streams[i];
+    if (s == nullptr) {
+      continue;
+    }
+    
+    pendingStreams += 1;
+    lms::retain(s);
+    async(queues[i], "PrepareStream", [this, s] {
+      int rt = s->prepare();
+      async(hostQueue(), "DidPrepareStream", [this, s, rt] {
+        didPrepareStream(s, rt);
+        lms::release(s);
+      });
+    });
+  }
+}
 
-  lms::release(vstream);
-  vstream = nullptr;
+void Player::didPrepareStream(Stream *stream, int result) {
+  // 解码器无法打开时放弃该流，另一种类型的流仍然可以播放
+  if (result != 0 && !prepareCancelled) {
+    bool isVideo = stream == vstream;
+    StreamId track = isVideo ? playingVideoTrack : playingAudioTrack;
+    LMSLogWarning("Stream skipped, decoder not opened: stream:%d, code=%d", track, result);
+    
+    source->setStreamSelected(track, false);
+    if (isVideo) {
+      lms::release(vstream);
+      vstream = nullptr;
+      playingVideoTrack = StreamIdNone;
+    } else {
+      lms::release(astream);
+      astream = nullptr;
+      playingAudioTrack = StreamIdNone;
+    }
+  }
   
-  lms::release(astream);
-  astream = nullptr;
+  pendingStreams -= 1;
+  if (pendingStreams > 0) {
+    return;
+  }
+  
+  if (prepareCancelled || (vstream == nullptr && astream == nullptr)) {
+    int rt = prepareCancelled ? AVERROR_EXIT : result;
+    if (!prepareCancelled) {
+      LMSLogError("Failed opening video & audio decoder");
+    }
+    
+    releaseStreams();
+    source->close();
+    finishPrepare(rt);
+    return;
+  }
+  
+  state = PlayerStatePrepared;
+  if (startWhenPrepared) {
+    startStreams();
+  }
+  
+  finishPrepare(0);
+}
+
+void Player::finishPrepare(int result) {
+  if (result != 0) {
+    state = PlayerStateIdle;
+  }
+  
+  // 被取消时stop已经移除了其余的资源，只剩下里程碑的观察者
+  if (prepareCancelled && eoMilestone) {
+    removeEventObserver(eoMilestone);
+    eoMilestone = nullptr;
+  }
+  
+  double ms = (av_gettime_relative() - playBegin) / 1000.0;
+  if (result == 0) {
+    metricsObserve("player.prepare_ms", ms);
+  }
+  LMSLogInfo("Player prepared: result=%d, state=%d, cost=%.2lfms", result, state, ms);
+  
+  prepareCancelled  = false;
+  startWhenPrepared = false;
+  
+  std::vector<PlayerCompletion> callbacks;
+  callbacks.swap(completions);
+  for (auto& cb : callbacks) {
+    cb(result);
+  }
+  
+  // 对应doPrepare中的retain，可能是最后一个引用
+  lms::release(this);
+}
+
+void Player::doStop() {
+  LMSLogInfo(nullptr);
+  
+  // 后台任务仍在进行中，数据源与解码器在其返回主线程后（finishPrepare之前）释放
+  if (state == PlayerStatePreparing) {
+    prepareCancelled  = true;
+    startWhenPrepared = false;
+    
+    std::vector<PlayerCompletion> callbacks;
+    callbacks.swap(completions);
+    for (auto& cb : callbacks) {
+      cb(AVERROR_EXIT);
+    }
+    return;
+  }
+  
+  if (eoMilestone) {
+    removeEventObserver(eoMilestone);
+    eoMilestone = nullptr;
+  }
+  
+  if (state == PlayerStateIdle) {
+    return;
+  }
+  
+  if (state == PlayerStatePlaying) {
+    coordinator->stop();
+    
+    if (astream) {
+      astream->stop();
+      source->removeReceiver(astream);
+    }
+    
+    if (vstream) {
+      vstream->stop();
+      source->removeReceiver(vstream);
+    }
+  }
+
+  source->close();
+  releaseStreams();
+  state = PlayerStateIdle;
 }
 
 } // namespace lms
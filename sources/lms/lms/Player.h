@@ -1,6 +1,12 @@
 #pragma once
 
 #include <lms/Foundation.h>
+#include <lms/MediaSource.h>
+#include <lms/Events.h>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
 
 namespace lms {
 
@@ -9,18 +15,120 @@ class Stream;
 class SourceDriver;
 class Cell;
 class TimeSync;
+class DispatchQueue;
+
+/*
+ 异步准备完成的回调，在主线程中执行。result为0表示成功，<0为错误码；准备过程被stop取消时为AVERROR_EXIT
+ */
+typedef std::function<void(int result)> PlayerCompletion;
+
+typedef enum {
+  PlayerStateIdle      = 0,
+  PlayerStatePreparing = 1, // 正在后台打开数据源、解码器
+  PlayerStatePrepared  = 2, // 流已创建、解码器已打开，尚未开始播放
+  PlayerStatePlaying   = 3,
+} PlayerState;
 
 class Player : virtual public Object {
 public:
   Player(MediaSource *mediaSource, Cell *vrender);
   ~Player();
   
+  /*
+   @function play
+   同步打开数据源并开始播放，数据源的I/O、探测以及解码器的初始化都在主线程中完成。
+   已经通过prepareAsync准备完成时立即开始播放；正在准备中时，在准备完成后开始播放
+   */
   void play();
   void stop();
   
+  /*
+   @function prepareAsync
+   异步准备播放：数据源的打开与探测在工作线程中完成，随后在主线程中创建流，再在各自的工作线程中并行打开
+   音频、视频解码器。整个过程中主线程不会因媒体I/O或解码器初始化而阻塞。准备完成后调用completion，
+   之后调用play即可立即开始播放
+   
+   @discussion
+   准备过程中调用stop会取消本次准备，completion以AVERROR_EXIT被调用，已经打开的数据源与解码器在后台
+   任务返回后释放
+   */
+  void prepareAsync(PlayerCompletion completion);
+  
+  /*
+   @function playAsync
+   异步准备并在完成后立即开始播放，completion在开始播放（或准备失败）时调用
+   */
+  void playAsync(PlayerCompletion completion);
+  
+  PlayerState getState();
+  
+  /*
+   @function setVideoTrack / setAudioTrack
+   选择需要播放的视频、音频流（流在MediaSource中的索引），需要在play之前调用。
+   StreamIdAny（默认）表示选择第一个可以解码的对应类型的流，StreamIdNone表示不播放该类型的流。
+   未被选中的流不会被解封装和投递
+   */
+  void setVideoTrack(StreamId track);
+  void setAudioTrack(StreamId track);
+  
+  /*
+   @function getVideoTrack / getAudioTrack
+   获取实际正在播放的流索引，没有播放对应类型的流时返回StreamIdNone
+   */
+  StreamId getVideoTrack();
+  StreamId getAudioTrack();
+  
+  /*
+   @function seek
+   精确定位到time（秒）：数据源跳转到之前最近的关键帧，解码器从该关键帧开始解码并丢弃目标时间之前的帧。
+   从发起定位到呈现首帧的耗时记录在 "player.seek.first_frame_ms" 指标中
+   */
+  void seek(double time);
+  
+  /*
+   @function setPacketWatermark
+   设置某种类型的流在链路上缓存的数据包数量的目标区间：低于low时开始加载，一次补充到high为止。
+   每个流的水位独立计算，某个流不会因为其他流的数据包堆积而得不到补充
+   */
+  void setPacketWatermark(MediaType type, int low, int high);
+  
+  /*
+   @function setLookAheadLimit
+   单次加载最多读取的数据包数量（包括其他流的数据包）。为稀疏的流补充数据时，用于限制其他流被一并读入的数据量
+   */
+  void setLookAheadLimit(int limit);
+  
+  /*
+   @function setKeyframeOnly
+   关键帧模式：只解封装、解码视频流的关键帧，并在解码完成后立即渲染，不再跟随播放时钟。
+   适用于拖动预览、生成缩略图等只需要稀疏画面的场景
+   */
+  void setKeyframeOnly(bool enabled);
+  
+  /*
+   @function requestKeyframe
+   请求渲染距离time（秒）最近的关键帧，需要先开启关键帧模式。连续的多次请求会被合并，只处理最新的一次
+   */
+  void requestKeyframe(double time);
+  
 private:
   void doPlay();
   void doStop();
+  void doPrepare(PlayerCompletion completion, bool autoStart);
+  void fireDecodeModeEvent();
+  
+  void beginPrepare();
+  int  createStreams();
+  void startStreams();
+  void releaseStreams();
+  
+  // 异步准备的各个阶段完成后回到主线程的处理
+  void didOpenSource(int result);
+  void didPrepareStream(Stream *stream, int result);
+  void finishPrepare(int result);
+  
+  static void onEventDidReachMilestone(Player *self, const char *evtName, void *sender, const EventParams& p);
+  void reportStartup(const char *kind, const std::map<std::string, int64_t>& milestones);
 
 private:
   MediaSource *source;
@@ -31,6 +139,31 @@ private:
 
   Stream *astream;
   TimeSync *timesync;
+  
+  // 以下状态只在主线程中访问
+  PlayerState state;
+  bool        prepareCancelled;  // 准备过程被stop取消，等待后台任务返回后释放资源
+  bool        startWhenPrepared;
+  int         pendingStreams;    // 尚未完成打开的解码器数量
+  std::vector<PlayerCompletion> completions;
+  
+  DispatchQueue *prepareQueue;      // 数据源I/O、探测以及视频解码器的打开
+  DispatchQueue *audioPrepareQueue; // 音频解码器的打开，与视频解码器并行
+  
+  StreamId videoTrack;
+  StreamId audioTrack;
+  StreamId playingVideoTrack;
+  StreamId playingAudioTrack;
+  
+  // 启动耗时统计：play被调用的时间，以及各个阶段到达的时间（av_gettime_relative，微秒）
+  int64_t                        playBegin;
+  std::map<std::string, int64_t> sourceMilestones;
+  std::map<std::string, int64_t> videoMilestones;
+  std::map<std::string, int64_t> audioMilestones;
+  void                          *eoMilestone;
+  
+  bool                keyframeOnly;
+  std::atomic<double> pendingKeyframeTime; // 尚未处理的关键帧请求时间，<0 表示没有待处理的请求
 };
 
 }
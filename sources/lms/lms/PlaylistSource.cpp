@@ -0,0 +1,694 @@
+//
+//  PlaylistSource.cpp
+//  lms
+//
+
+#include "PlaylistSource.h"
+#include "Runtime.h"
+#include "Events.h"
+#include "Logger.h"
+#include "Metrics.h"
+#include <algorithm>
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/time.h>
+}
+
+namespace lms {
+
+// 预加载时单次请求读取的数据包数量
+constexpr int PreloadRequestLimit = 32;
+
+/*
+ @class PlaylistSource::Tap
+ 作为条目数据源的接收者，把条目投递的消息转交给播放列表
+ */
+class PlaylistSource::Tap : public Cell {
+public:
+  Tap(PlaylistSource *owner, Item *item) : owner(owner), item(item) {}
+
+  void start() override {}
+  void stop() override {}
+
+  void didReceivePipelineMessage(const PipelineMessage& msg) override {
+    owner->didReceiveItemMessage(item, msg);
+  }
+
+private:
+  PlaylistSource *owner;
+  Item           *item;
+};
+
+struct PlaylistSource::Item {
+  MediaSource *source;
+  Tap         *tap;
+
+  // 流映射，open之后由mapStreams建立，之后不再改变
+  std::vector<void *>   innerStreams; // 条目自身的流对象
+  std::vector<StreamId> toOuter;      // 条目的流索引 -> 对外的流索引
+  std::map<StreamId, StreamId> toInner;
+  std::vector<bool>     codecChanged; // 对外的流索引 -> 编码参数是否与对外的流不一致
+
+  int64_t  startTime;   // 条目自身时间轴的起点（AV_TIME_BASE单位）
+  int64_t  offset;      // 条目的起点在对外时间轴上的位置（AV_TIME_BASE单位）
+  uint64_t innerSerial; // 条目当前的serial，切换为当前条目后以收到的第一条消息为准
+  bool     serialKnown;
+
+  // 预加载状态
+  int      openResult;  // 在q中写入，q被释放（线程结束）之后才在close中读取
+  bool     opening;
+  bool     opened;
+  bool     loading;
+  bool     preloadEof;
+  std::list<std::pair<StreamId, AVPacket *>> buffered; // 条目的流索引, 预读的数据包
+  int64_t  bufferedFrom;
+  int64_t  bufferedTo;
+};
+
+static bool _same_codec_parameters(const AVCodecParameters *a, const AVCodecParameters *b) {
+  if (a->codec_type != b->codec_type || a->codec_id != b->codec_id) {
+    return false;
+  }
+
+  if (a->extradata_size != b->extradata_size ||
+      (a->extradata_size > 0 && memcmp(a->extradata, b->extradata, a->extradata_size) != 0)) {
+    return false;
+  }
+
+  if (a->codec_type == AVMEDIA_TYPE_VIDEO) {
+    return a->width == b->width && a->height == b->height && a->format == b->format;
+  }
+
+  return a->sample_rate == b->sample_rate && a->channels == b->channels &&
+         a->channel_layout == b->channel_layout && a->format == b->format;
+}
+
+PlaylistSource::PlaylistSource(MediaSource *first) {
+  mtx             = SDL_CreateMutex();
+  keyframeOnly    = false;
+  preloadDuration = PreloadDurationDefault;
+  itemIndex       = 0;
+  serial          = 0;
+  generation      = 0;
+  q               = nullptr;
+
+  head = new Item();
+  head->source = lms::retain(first);
+  head->tap    = new Tap(this, head);
+  current      = head;
+}
+
+PlaylistSource::~PlaylistSource() {
+  assert(q == nullptr);
+
+  releaseItem(head);
+  for (auto item : upcoming) {
+    releaseItem(item);
+  }
+
+  SDL_DestroyMutex(mtx);
+}
+
+void PlaylistSource::enqueue(MediaSource *next) {
+  Item *item = new Item();
+  item->source = lms::retain(next);
+  item->tap    = new Tap(this, item);
+
+  SDL_LockMutex(mtx);
+  {
+    upcoming.push_back(item);
+  }
+  SDL_UnlockMutex(mtx);
+
+  if (q) {
+    preloadNext();
+  }
+}
+
+void PlaylistSource::setPreloadDuration(double seconds) {
+  preloadDuration = std::max(seconds, 0.0);
+}
+
+int PlaylistSource::open() {
+  int rt = head->source->open();
+  if (rt < 0) {
+    return rt;
+  }
+
+  int count = head->source->numberOfStreams();
+  for (int i = 0; i < count; ++i) {
+    metas.push_back(head->source->getStreamMeta(i));
+  }
+
+  selected.assign(count, true);
+  streamEnds.assign(count, INT64_MIN);
+  mapStreams(head);
+
+  SDL_LockMutex(mtx);
+  {
+    current = head;
+  }
+  SDL_UnlockMutex(mtx);
+
+  // open可能在工作线程中调用，接收者的注册与预加载在主线程中进行
+  sync(hostQueue(), "OpenPlaylist", [this] {
+    head->serialKnown = false;
+    head->source->addReceiver(head->tap);
+
+    q = createDispatchQueue("LMS_PlaylistPreload", QueueTypeWorker);
+    preloadNext();
+  });
+
+  return 0;
+}
+
+void PlaylistSource::close() {
+  // 释放队列会等待正在进行的open完成，之后发起的回调都会因generation不匹配而被忽略
+  lms::release(q);
+  q = nullptr;
+  generation += 1;
+  pendingCompletion = nullptr;
+  pendingDelivered.clear();
+
+  SDL_LockMutex(mtx);
+  std::list<Item *> items;
+  items.swap(upcoming);
+  Item *playing = current;
+  current = head;
+  SDL_UnlockMutex(mtx);
+
+  // 尚未播放的条目随close一起清空
+  for (auto item : items) {
+    releaseItem(item);
+  }
+
+  if (playing != head) {
+    releaseItem(playing);
+  }
+
+  head->source->removeReceiver(head->tap);
+  head->source->close();
+
+  metas.clear();
+  selected.clear();
+  streamEnds.clear();
+  itemIndex = 0;
+}
+
+int PlaylistSource::numberOfStreams() {
+  return (int)metas.size();
+}
+
+StreamMeta PlaylistSource::getStreamMeta(size_t streamIndex) {
+  return metas[streamIndex];
+}
+
+int PlaylistSource::seek(double time, SeekMode mode) {
+  Item *item = current;
+
+  // 转换为条目自身的时间轴，只在当前条目范围内定位
+  double shift = (double)(item->offset - item->startTime) / AV_TIME_BASE;
+  return item->source->seek(std::max(time - shift, 0.0), mode);
+}
+
+void PlaylistSource::setKeyframeOnly(bool enabled) {
+  keyframeOnly = enabled;
+
+  current->source->setKeyframeOnly(enabled);
+  for (auto item : upcoming) {
+    if (item->opened) {
+      item->source->setKeyframeOnly(enabled);
+    }
+  }
+}
+
+void PlaylistSource::setStreamSelected(size_t streamIndex, bool selected) {
+  this->selected[streamIndex] = selected;
+
+  auto forward = [streamIndex, selected] (Item *item) {
+    auto found = item->toInner.find((StreamId)streamIndex);
+    if (found != item->toInner.end()) {
+      item->source->setStreamSelected(found->second, selected);
+    }
+  };
+
+  forward(current);
+  for (auto item : upcoming) {
+    if (item->opened) {
+      forward(item);
+    }
+  }
+}
+
+void PlaylistSource::requestPackets(const PacketRequest& request, PacketRequestCompletion completion) {
+  Item *item;
+  SDL_LockMutex(mtx);
+  {
+    item = current;
+  }
+  SDL_UnlockMutex(mtx);
+
+  PacketRequest req;
+  req.quotas = toItemQuotas(item, request.quotas);
+  req.limit  = request.limit;
+
+  item->source->requestPackets(req, [this, item, completion] (const std::map<StreamId, int>& delivered, bool eof) {
+    std::map<StreamId, int> counts = fromItemCounts(item, delivered);
+    if (!eof) {
+      completion(counts, false);
+      return;
+    }
+
+    // 条目的数据包都是在主线程中投递的，切换也在主线程中进行，保证新条目的数据包排在旧条目之后
+    async(hostQueue(), "SwitchItem", [this, completion, counts] {
+      std::map<StreamId, int> d = counts;
+      if (switchToNext(d)) {
+        completion(d, false);
+        return;
+      }
+
+      bool waiting;
+      SDL_LockMutex(mtx);
+      {
+        waiting = !upcoming.empty();
+      }
+      SDL_UnlockMutex(mtx);
+
+      // 下一个条目尚未打开或预加载请求尚未完成，等就绪之后再完成本次请求
+      if (waiting && q) {
+        pendingCompletion = completion;
+        pendingDelivered  = d;
+        return;
+      }
+
+      completion(d, true);
+    });
+  });
+}
+
+std::map<StreamId, int> PlaylistSource::toItemQuotas(Item *item, const std::map<StreamId, int>& quotas) {
+  std::map<StreamId, int> result;
+  for (auto& q : quotas) {
+    auto found = item->toInner.find(q.first);
+    if (found != item->toInner.end()) {
+      result[found->second] = q.second;
+    }
+  }
+  return result;
+}
+
+std::map<StreamId, int> PlaylistSource::fromItemCounts(Item *item, const std::map<StreamId, int>& counts) {
+  std::map<StreamId, int> result;
+  for (auto& c : counts) {
+    if (c.first >= 0 && c.first < (StreamId)item->toOuter.size() && item->toOuter[c.first] != StreamIdNone) {
+      result[item->toOuter[c.first]] += c.second;
+    }
+  }
+  return result;
+}
+
+void PlaylistSource::mapStreams(Item *item) {
+  MediaSource *src = item->source;
+  int count = src->numberOfStreams();
+
+  item->innerStreams.clear();
+  item->toOuter.assign(count, StreamIdNone);
+  item->toInner.clear();
+  item->codecChanged.assign(metas.size(), false);
+  item->startTime = INT64_MAX;
+
+  // 按媒体类型依次对应：条目的第k个视频流映射到对外的第k个视频流，音频同理
+  std::map<uint64_t, int> used;
+  for (int i = 0; i < count; ++i) {
+    StreamMeta meta = src->getStreamMeta(i);
+    AVStream  *st   = (AVStream *)meta.at("stream_object").value.ptr;
+    uint64_t   type = meta.at("media_type").value.u;
+    item->innerStreams.push_back(st);
+
+    if (st->start_time != AV_NOPTS_VALUE) {
+      item->startTime = std::min(item->startTime, av_rescale_q(st->start_time, st->time_base, AV_TIME_BASE_Q));
+    }
+
+    int k = used[type]++;
+    for (size_t o = 0; o < metas.size(); ++o) {
+      if (metas[o].at("media_type").value.u != type || k-- != 0) {
+        continue;
+      }
+
+      AVStream *out = (AVStream *)metas[o].at("stream_object").value.ptr;
+      item->toOuter[i] = (StreamId)o;
+      item->toInner[(StreamId)o] = i;
+      item->codecChanged[o] = (out != st) && !_same_codec_parameters(out->codecpar, st->codecpar);
+      break;
+    }
+  }
+
+  if (item->startTime == INT64_MAX) {
+    item->startTime = 0;
+  }
+
+  // 第一个条目的时间轴即对外的时间轴
+  item->offset = (item == head) ? item->startTime : 0;
+}
+
+void PlaylistSource::preloadNext() {
+  if (q == nullptr) {
+    return;
+  }
+
+  Item *next;
+  SDL_LockMutex(mtx);
+  {
+    next = upcoming.empty() ? nullptr : upcoming.front();
+  }
+  SDL_UnlockMutex(mtx);
+
+  if (next == nullptr || next->opening || next->opened) {
+    return;
+  }
+
+  LMSLogInfo("Preload playlist item: index=%d", itemIndex + 1);
+
+  next->opening = true;
+  uint64_t gen = generation;
+  async(q, "OpenNext", [this, next, gen] {
+    int64_t begin = av_gettime_relative();
+    next->openResult = next->source->open();
+    metricsObserve("source.playlist.open_ms", (av_gettime_relative() - begin) / 1000.0);
+
+    async(hostQueue(), "DidOpenNext", [this, next, gen] {
+      didOpenNext(next, gen);
+    });
+  });
+}
+
+void PlaylistSource::didOpenNext(Item *item, uint64_t gen) {
+  if (gen != generation) {
+    return;
+  }
+
+  item->opening = false;
+
+  if (item->openResult < 0) {
+    LMSLogError("Failed to open playlist item: index=%d, code=%d", itemIndex + 1, item->openResult);
+
+    SDL_LockMutex(mtx);
+    {
+      upcoming.remove(item);
+    }
+    SDL_UnlockMutex(mtx);
+
+    releaseItem(item);
+    itemIndex += 1;
+
+    // 跳过打不开的条目，继续打开之后的条目；没有更多条目时结束等待中的请求
+    preloadNext();
+    if (pendingCompletion && upcoming.empty()) {
+      PacketRequestCompletion completion = pendingCompletion;
+      pendingCompletion = nullptr;
+      completion(pendingDelivered, true);
+    }
+    return;
+  }
+
+  item->opened = true;
+  mapStreams(item);
+
+  for (size_t i = 0; i < item->toOuter.size(); ++i) {
+    StreamId o = item->toOuter[i];
+    item->source->setStreamSelected(i, o != StreamIdNone && selected[o]);
+  }
+  item->source->setKeyframeOnly(keyframeOnly);
+  item->source->addReceiver(item->tap);
+
+  item->serialKnown  = false;
+  item->bufferedFrom = INT64_MAX;
+  item->bufferedTo   = INT64_MIN;
+
+  if (pendingCompletion) {
+    PacketRequestCompletion completion = pendingCompletion;
+    std::map<StreamId, int> d = pendingDelivered;
+    pendingCompletion = nullptr;
+
+    switchToNext(d);
+    completion(d, false);
+    return;
+  }
+
+  requestPreload(item);
+}
+
+void PlaylistSource::requestPreload(Item *item) {
+  if (item == current || item->loading || item->preloadEof) {
+    return;
+  }
+
+  if (item->bufferedTo > item->bufferedFrom &&
+      item->bufferedTo - item->bufferedFrom >= (int64_t)(preloadDuration * AV_TIME_BASE)) {
+    return;
+  }
+
+  item->loading = true;
+
+  PacketRequest req;
+  req.limit = PreloadRequestLimit;
+
+  uint64_t gen = generation;
+  item->source->requestPackets(req, [this, item, gen] (const std::map<StreamId, int>& delivered, bool eof) {
+    async(hostQueue(), "DidPreload", [this, item, gen, eof] {
+      if (gen != generation) {
+        return;
+      }
+
+      item->loading    = false;
+      item->preloadEof = item->preloadEof || eof;
+
+      // 当前条目在预加载期间已经读完，等待中的请求在这里切换到该条目
+      if (pendingCompletion) {
+        PacketRequestCompletion completion = pendingCompletion;
+        std::map<StreamId, int> d = pendingDelivered;
+        pendingCompletion = nullptr;
+
+        switchToNext(d);
+        completion(d, false);
+        return;
+      }
+
+      requestPreload(item);
+    });
+  });
+}
+
+int PlaylistSource::switchToNext(std::map<StreamId, int>& delivered) {
+  Item *prev, *next;
+  SDL_LockMutex(mtx);
+  {
+    // 预加载请求进行中时不切换：该请求读出的数据包在完成之前陆续到达，切换后它们的数量不会计入任何一次请求的结果
+    next = upcoming.empty() ? nullptr : upcoming.front();
+    if (next == nullptr || !next->opened || next->loading) {
+      SDL_UnlockMutex(mtx);
+      return 0;
+    }
+
+    upcoming.pop_front();
+    prev    = current;
+    current = next;
+  }
+  SDL_UnlockMutex(mtx);
+
+  itemIndex += 1;
+
+  // 新条目紧接在音频流的结尾之后，保证切换点精确到样本；没有音频时接在最晚结束的流之后
+  int64_t audioEnd = INT64_MIN, anyEnd = INT64_MIN;
+  for (size_t o = 0; o < metas.size(); ++o) {
+    if (metas[o].at("media_type").value.u == MediaTypeAudio) {
+      audioEnd = std::max(audioEnd, streamEnds[o]);
+    }
+    anyEnd = std::max(anyEnd, streamEnds[o]);
+  }
+  int64_t end = (audioEnd != INT64_MIN) ? audioEnd : anyEnd;
+  next->offset = (end != INT64_MIN) ? end : prev->offset;
+
+  LMSLogInfo("Switch playlist item: index=%d, offset=%" PRIi64, itemIndex, next->offset);
+
+  // 第一个条目的流对象仍被下游使用，保持打开直到close
+  prev->source->removeReceiver(prev->tap);
+  if (prev != head) {
+    releaseItem(prev);
+  }
+
+  // 编码参数变化的消息需要排在新条目的首个数据包之前
+  for (auto& m : next->toInner) {
+    if (!next->codecChanged[m.first]) {
+      continue;
+    }
+
+    AVStream *st = (AVStream *)next->innerStreams[m.second];
+    PipelineMessage msg;
+    msg["type"]             = "codec_change";
+    msg["stream_object"]    = metas[m.first].at("stream_object").value.ptr;
+    msg["codec_parameters"] = (void *)st->codecpar;
+    msg["serial"]           = serial;
+    deliverPacketMessage(msg);
+  }
+
+  // 接续投递预读的数据包
+  std::list<std::pair<StreamId, AVPacket *>> packets;
+  packets.swap(next->buffered);
+  for (auto& p : packets) {
+    PipelineMessage msg;
+    msg["type"]          = "media_packet";
+    msg["stream_object"] = next->innerStreams[p.first];
+    msg["packet_object"] = p.second;
+    msg["serial"]        = next->innerSerial;
+    deliverItemPacket(next, msg);
+    av_packet_free(&p.second);
+
+    delivered[next->toOuter[p.first]] += 1;
+  }
+
+  metricsAdd("source.playlist.switches");
+
+  fireEvent("did_switch_item", this, {
+    { "index", itemIndex }
+  });
+
+  preloadNext();
+  return 1;
+}
+
+void PlaylistSource::didReceiveItemMessage(Item *item, const PipelineMessage& msg) {
+  const char *type   = variantsGetCString(msg, "type");
+  void       *object = variantsGetPointer(msg, "stream_object");
+  uint64_t    s      = variantsGetUInt(msg, "serial");
+
+  auto found = std::find(item->innerStreams.begin(), item->innerStreams.end(), object);
+  if (found == item->innerStreams.end()) {
+    return;
+  }
+  StreamId inner = (StreamId)(found - item->innerStreams.begin());
+  StreamId outer = item->toOuter[inner];
+  if (outer == StreamIdNone) {
+    return;
+  }
+
+  // 预加载中的条目：暂存数据包，等待切换
+  if (item != current) {
+    if (strcmp(type, "media_packet") != 0) {
+      return;
+    }
+
+    if (!item->serialKnown) {
+      item->innerSerial = s;
+      item->serialKnown = true;
+    }
+
+    AVStream *st  = (AVStream *)object;
+    AVPacket *pkt = av_packet_clone((AVPacket *)variantsGetPointer(msg, "packet_object"));
+    item->buffered.push_back({ inner, pkt });
+
+    int64_t ts = (pkt->pts != AV_NOPTS_VALUE) ? pkt->pts : pkt->dts;
+    if (ts != AV_NOPTS_VALUE) {
+      ts = av_rescale_q(ts, st->time_base, AV_TIME_BASE_Q);
+      item->bufferedFrom = std::min(item->bufferedFrom, ts);
+      item->bufferedTo   = std::max(item->bufferedTo, ts);
+    }
+    return;
+  }
+
+  if (strcmp(type, "flush") == 0) {
+    if (!item->serialKnown || s != item->innerSerial) {
+      item->innerSerial = s;
+      item->serialKnown = true;
+      serial += 1;
+    }
+
+    PipelineMessage out = msg;
+    out["stream_object"] = metas[outer].at("stream_object").value.ptr;
+    out["serial"]        = serial;
+    if (msg.find("seek_target") != msg.end()) {
+      int64_t target = variantsGetInt(msg, "seek_target");
+      out["seek_target"] = target - item->startTime + item->offset;
+    }
+
+    streamEnds[outer] = INT64_MIN;
+    deliverPacketMessage(out);
+    return;
+  }
+
+  if (strcmp(type, "media_packet") == 0) {
+    if (!item->serialKnown) {
+      item->innerSerial = s;
+      item->serialKnown = true;
+    }
+
+    // seek之前就已经读出的旧数据包
+    if (s != item->innerSerial) {
+      return;
+    }
+
+    deliverItemPacket(item, msg);
+  }
+}
+
+void PlaylistSource::deliverItemPacket(Item *item, const PipelineMessage& msg) {
+  AVStream *in  = (AVStream *)variantsGetPointer(msg, "stream_object");
+  AVPacket *src = (AVPacket *)variantsGetPointer(msg, "packet_object");
+
+  auto found = std::find(item->innerStreams.begin(), item->innerStreams.end(), (void *)in);
+  StreamId outer = item->toOuter[found - item->innerStreams.begin()];
+  AVStream *out  = (AVStream *)metas[outer].at("stream_object").value.ptr;
+
+  PipelineMessage m;
+  m["type"]          = "media_packet";
+  m["stream_object"] = out;
+  m["serial"]        = serial;
+
+  // 第一个条目直接使用对外的流，时间戳无需转换
+  AVPacket *pkt = src;
+  if (in != out) {
+    int64_t shift = av_rescale_q(item->offset - item->startTime, AV_TIME_BASE_Q, out->time_base);
+
+    pkt = av_packet_clone(src);
+    pkt->pts      = (pkt->pts == AV_NOPTS_VALUE) ? AV_NOPTS_VALUE : av_rescale_q(pkt->pts, in->time_base, out->time_base) + shift;
+    pkt->dts      = (pkt->dts == AV_NOPTS_VALUE) ? AV_NOPTS_VALUE : av_rescale_q(pkt->dts, in->time_base, out->time_base) + shift;
+    pkt->duration = av_rescale_q(pkt->duration, in->time_base, out->time_base);
+    pkt->stream_index = out->index;
+  }
+
+  int64_t ts = (pkt->pts != AV_NOPTS_VALUE) ? pkt->pts : pkt->dts;
+  if (ts != AV_NOPTS_VALUE) {
+    streamEnds[outer] = std::max(streamEnds[outer], av_rescale_q(ts + pkt->duration, out->time_base, AV_TIME_BASE_Q));
+  }
+
+  m["packet_object"] = pkt;
+  deliverPacketMessage(m);
+
+  if (pkt != src) {
+    av_packet_free(&pkt);
+  }
+}
+
+void PlaylistSource::releaseItem(Item *item) {
+  item->source->removeReceiver(item->tap);
+
+  // 打开中的条目在q释放之后才会走到这里，此时open已经完成
+  if (item->opened || (item->opening && item->openResult >= 0)) {
+    item->source->close();
+  }
+
+  for (auto& p : item->buffered) {
+    av_packet_free(&p.second);
+  }
+
+  lms::release(item->tap);
+  
+  // 预加载中的条目已经向主队列投递了数据包，这些任务引用着数据源，等主队列中已有的任务执行完毕后再释放
+  MediaSource *source = item->source;
+  async(hostQueue(), "ReleasePlaylistItem", [source] {
+    lms::release(source);
+  });
+  delete item;
+}
+
+}
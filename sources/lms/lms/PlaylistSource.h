@@ -0,0 +1,102 @@
+//
+//  PlaylistSource.h
+//  lms
+//
+
+#pragma once
+
+#include <lms/MediaSource.h>
+#include <list>
+#include <vector>
+extern "C" {
+#include <SDL2/SDL.h>
+}
+
+namespace lms {
+
+class DispatchQueue;
+
+// 默认为下一个条目预缓冲的时长（秒）
+constexpr double PreloadDurationDefault = 2.0;
+
+/*
+ @class PlaylistSource
+ 无缝连续播放多个数据源的播放列表。对外暴露的是第一个条目的流，之后的条目的数据包会被映射到相同类型的流上，
+ 时间戳紧接在上一个条目的结尾之后，因此下游的解码器、音频设备与播放时钟都不需要重建。
+
+ 当前条目播放期间，下一个条目在后台队列中打开、探测，并预先读取preloadDuration时长的数据包。
+ 当前条目读到结尾时，预读的数据包立即接续投递，切换点精确到音频样本。
+
+ @discussion
+ 下一个条目的流与当前流的编码参数一致时，沿用同一个解码器上下文；不一致时，在新条目的首个数据包之前投递
+ type="codec_change" 的消息（参数：stream_object, codec_parameters, serial），由解码器在排空旧数据后重新创建。
+ 切换条目时会发出 "did_switch_item" 事件（参数：index，新条目在播放列表中的序号）。
+ seek只在当前条目内进行
+ */
+class PlaylistSource : public MediaSource {
+public:
+  PlaylistSource(MediaSource *first);
+  ~PlaylistSource() override;
+
+  /*
+   @function enqueue
+   在播放列表末尾添加一个条目。排在当前条目之后的第一个条目会立即在后台开始预加载
+   */
+  void enqueue(MediaSource *next);
+
+  /*
+   @function setPreloadDuration
+   设置为下一个条目预缓冲的时长（秒）
+   */
+  void setPreloadDuration(double seconds);
+
+  int open() override;
+  void close() override;
+
+  int numberOfStreams() override;
+  StreamMeta getStreamMeta(size_t streamIndex) override;
+
+  int seek(double time, SeekMode mode) override;
+  void setKeyframeOnly(bool enabled) override;
+  void setStreamSelected(size_t streamIndex, bool selected) override;
+  void requestPackets(const PacketRequest& request, PacketRequestCompletion completion) override;
+
+private:
+  class Tap;
+  struct Item;
+
+  // 以下方法需要在主线程中调用
+  void didReceiveItemMessage(Item *item, const PipelineMessage& msg);
+  void deliverItemPacket(Item *item, const PipelineMessage& msg);
+  void preloadNext();
+  void didOpenNext(Item *item, uint64_t gen);
+  void requestPreload(Item *item);
+  int  switchToNext(std::map<StreamId, int>& delivered);
+  void mapStreams(Item *item);
+  void releaseItem(Item *item);
+
+  std::map<StreamId, int> toItemQuotas(Item *item, const std::map<StreamId, int>& quotas);
+  std::map<StreamId, int> fromItemCounts(Item *item, const std::map<StreamId, int>& counts);
+
+  std::vector<StreamMeta> metas;    // 对外暴露的流（第一个条目的流）
+  std::vector<bool>       selected;
+  bool                    keyframeOnly;
+  double                  preloadDuration;
+
+  SDL_mutex       *mtx;   // 保护current与upcoming，requestPackets可能在工作线程中调用
+  Item            *head;  // 第一个条目，对外暴露的流属于该条目，因此在close之前始终保持打开
+  Item            *current;
+  std::list<Item*> upcoming;
+  int              itemIndex;
+
+  // 以下状态只在主线程中访问
+  uint64_t serial;                 // 对外投递的serial
+  std::vector<int64_t> streamEnds; // 各个流已投递数据包的结束时间（AV_TIME_BASE单位）
+  PacketRequestCompletion pendingCompletion; // 当前条目已读完、但下一个条目尚未就绪时暂存的请求回调
+  std::map<StreamId, int> pendingDelivered;
+  uint64_t generation;             // 每次close后递增，用于忽略之前发起的后台任务的结果
+
+  DispatchQueue *q; // 下一个条目的打开与探测
+};
+
+}
@@ -25,7 +25,7 @@ void async(DispatchQueue *queue, Runnable *runnable) {
 }
 
 void async(DispatchQueue *queue, const char *name, std::function<void()> action) {
-  auto r = new LambdaRunnable(name, action);
+  auto r = new LambdaRunnable(name, std::move(action));
   queue->async(r);
   lms::release(r);
 }
@@ -35,7 +35,7 @@ void sync(DispatchQueue *queue, Runnable *r) {
 }
 
 void sync(DispatchQueue *queue, const char *name, std::function<void()> action) {
-  auto r = new LambdaRunnable(name, action);
+  auto r = new LambdaRunnable(name, std::move(action));
   queue->sync(r);
   lms::release(r);
 }
@@ -43,7 +43,7 @@ public:
 
 class LambdaRunnable : public Runnable {
 public:
-  LambdaRunnable(const char *nm, std::function<void()> a) : Runnable(nm), act(a) { }
+  LambdaRunnable(const char *nm, std::function<void()> a) : Runnable(nm), act(std::move(a)) { }
   
   void run() override {
     act();
@@ -119,7 +119,20 @@ class Timer : virtual public Object {};
 // Creates a timer and schedules it on a new thread.
 Timer *scheduleTimer(const char *name, double interval, std::function<void()> action);
 
-// Invalidates the timer scheduled by scheduleTimer()
+/*
+ @function scheduleDeadlineTimer
+ 创建一个按截止时间运行的定时器，在新线程中执行。action的返回值为距离下一次执行的秒数，
+ 小于0表示一直等待，直到wakeTimer被调用
+
+ @discussion
+ 等待的前一段使用条件变量休眠，临近截止时间时改为短暂的睡眠，唤醒误差通常在1ms以内
+ */
+Timer *scheduleDeadlineTimer(const char *name, std::function<double()> action);
+
+// 唤醒正在等待的定时器，立即再执行一次action。只对scheduleDeadlineTimer创建的定时器有效
+void wakeTimer(Timer *timer);
+
+// Invalidates the timer scheduled by scheduleTimer() or scheduleDeadlineTimer()
 void invalidateTimer(Timer *timer);
 
 }
@@ -6,43 +6,226 @@
 //
 
 #include "SourceDriver.h"
+#include "Runtime.h"
+#include "Metrics.h"
+#include <algorithm>
 
 namespace lms {
 
 SourceDriver::SourceDriver(MediaSource *src) {
   source = lms::retain(src);
+  q      = createDispatchQueue("LMS_SourceDriver", QueueTypeWorker);
+  eoDUP  = nullptr;
+
+  watermarks[MediaTypeVideo] = VideoPacketWatermarkDefault;
+  watermarks[MediaTypeAudio] = AudioPacketWatermarkDefault;
+  lookAheadLimit = LookAheadLimitDefault;
+  running        = false;
+  refillEnabled  = true;
+  loading        = false;
+  eof            = false;
+  generation     = 0;
+  epoch          = 0;
 }
 
 SourceDriver::~SourceDriver() {
+  assert(eoDUP == nullptr);
+
+  lms::release(q);
   lms::release(source);
 }
 
+void SourceDriver::addStream(StreamId index, const StreamMeta& meta) {
+  void *streamObject = meta.at("stream_object").value.ptr;
+  MediaType type = (MediaType)meta.at("media_type").value.u;
+
+  async(q, "AddStream", [this, index, streamObject, type] {
+    StreamFlow flow;
+    flow.index        = index;
+    flow.streamObject = streamObject;
+    flow.type         = type;
+    flow.watermark    = watermarks[type];
+    flow.queued       = 0;
+    flow.delivered    = 0;
+    flow.received     = 0;
+    flows.push_back(flow);
+  });
+}
+
 void SourceDriver::start() {
   LMSLogInfo("Start SourceDriver");
 
-  eoDUP = addEventObserver("did_update_packets", nullptr, this, (EventCallback)onEventDidUpdatePackets);
-  
-  // 预加载一定数量的数据包
-  fireEvent("load_packets", this, {
-    { "count", 100 }
+  eoDUP = addEventObserver("did_update_packets", nullptr, this, (EventCallback)onEventDidUpdatePackets, EventDeliveryQueue, q);
+
+  async(q, "StartDriver", [this] {
+    running = true;
+    loading = false;
+    eof     = false;
+    evaluate();
+  });
+}
+
+void SourceDriver::preload() {
+  async(q, "Preload", [this] {
+    eof    = false;
+    epoch += 1;
+    evaluate();
   });
 }
 
 void SourceDriver::stop() {
   LMSLogInfo("Stop SourceDriver");
-  
+
   removeEventObserver(eoDUP);
   eoDUP = nullptr;
+
+  // 同步等待，保证stop之后不会再向数据源发起请求。之后才返回的加载结果会被忽略
+  sync(q, "StopDriver", [this] {
+    running = false;
+    generation += 1;
+    flows.clear();
+  });
+}
+
+void SourceDriver::reload(int count) {
+  LMSLogInfo("Reload SourceDriver: count=%d", count);
+
+  async(q, "Reload", [this, count] {
+    if (!running) {
+      return;
+    }
+
+    eof    = false;
+    epoch += 1;
+
+    PacketRequest req;
+    req.limit = count;
+    request(req, false);
+  });
+}
+
+void SourceDriver::setRefillEnabled(bool enabled) {
+  async(q, "SetRefillEnabled", [this, enabled] {
+    refillEnabled = enabled;
+    evaluate();
+  });
+}
+
+void SourceDriver::setWatermark(MediaType type, const PacketWatermark& watermark) {
+  async(q, "SetWatermark", [this, type, watermark] {
+    watermarks[type] = watermark;
+    for (auto& f : flows) {
+      if (f.type == type) {
+        f.watermark = watermark;
+      }
+    }
+
+    evaluate();
+  });
+}
+
+void SourceDriver::setLookAheadLimit(int limit) {
+  async(q, "SetLookAheadLimit", [this, limit] {
+    lookAheadLimit = std::max(limit, 1);
+  });
+}
+
+SourceDriver::StreamFlow *SourceDriver::findFlow(void *streamObject) {
+  for (auto& f : flows) {
+    if (f.streamObject == streamObject) {
+      return &f;
+    }
+  }
+  return nullptr;
+}
+
+void SourceDriver::evaluate() {
+  if (!running || !refillEnabled || loading || eof) {
+    return;
+  }
+
+  // 只要有一个流低于低水位就发起加载，同时为其余未达到高水位的流补充配额，减少请求次数
+  bool starving = false;
+  PacketRequest req;
+  req.limit = lookAheadLimit;
+
+  for (auto& f : flows) {
+    int64_t inTransit = (int64_t)f.delivered - (int64_t)f.received;
+    int level = f.queued + (int)std::max(inTransit, (int64_t)0);
+
+    if (level < f.watermark.low) {
+      starving = true;
+      if (level == 0) {
+        metricsAdd("source.flow.underruns");
+      }
+    }
+
+    if (level < f.watermark.high) {
+      req.quotas[f.index] = f.watermark.high - level;
+    }
+  }
+
+  if (starving) {
+    request(req, true);
+  }
+}
+
+void SourceDriver::request(const PacketRequest& req, bool isRefill) {
+  if (isRefill) {
+    loading = true;
+  }
+
+  metricsAdd("source.flow.requests");
+
+  uint64_t gen = generation;
+  uint64_t ep  = epoch;
+  source->requestPackets(req, [this, gen, ep, isRefill] (const std::map<StreamId, int>& delivered, bool eof) {
+    std::map<StreamId, int> counts = delivered;
+    async(q, "DidLoadPackets", [this, gen, ep, counts, eof, isRefill] {
+      // stop之前发起的请求，其结果不能计入重新启动之后的流。
+      // seek之前发起的请求，投递的数据包仍会被解码器计入，但读到的结尾已不再有效
+      if (gen == generation) {
+        didLoadPackets(counts, eof && ep == epoch, isRefill);
+      }
+    });
+  });
+}
+
+void SourceDriver::didLoadPackets(const std::map<StreamId, int>& delivered, bool eof, bool isRefill) {
+  if (isRefill) {
+    loading = false;
+  }
+
+  for (auto& f : flows) {
+    auto found = delivered.find(f.index);
+    if (found != delivered.end()) {
+      f.delivered += found->second;
+    }
+  }
+
+  // 读到结尾之后不再按水位加载，直到seek之后重新preload
+  if (eof) {
+    LMSLogInfo("SourceDriver reached end of source");
+    this->eof = true;
+  }
+
+  evaluate();
 }
 
 void SourceDriver::onEventDidUpdatePackets(SourceDriver *self, const char *ename, void *sender, const EventParams& p) {
-  int type  = variantsGetUInt(p, "type");
-  int dec   = variantsGetUInt(p, "decrement");
-  
-  // 解码器消费了多少个数据包，就重新加载多少个数据包。以此保证在链路上的缓存数据包总数是可控的
-  if (type == 2 /* decrement */ && dec > 0) {
-    fireEvent("load_packets", self, {{ "count", dec }});
+  void    *streamObject = variantsGetPointer(p, "stream_object");
+  int      queued       = (int)variantsGetUInt(p, "count");
+  uint64_t received     = variantsGetUInt(p, "received");
+
+  // 事件由解码器直接投递到工作队列，水位的计算不经过主线程
+  StreamFlow *f = self->findFlow(streamObject);
+  if (f == nullptr) {
+    return;
   }
+
+  f->queued   = queued;
+  f->received = std::max(f->received, received);
+  self->evaluate();
 }
 
 }
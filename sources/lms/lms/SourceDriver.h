@@ -10,24 +10,106 @@
 #include "MediaSource.h"
 #include "Logger.h"
 #include "Events.h"
+#include <vector>
 
 namespace lms {
 
+class DispatchQueue;
+
+/*
+ @struct PacketWatermark
+ 单个流在链路上缓存的数据包数量的目标区间：低于low时开始加载，一次补充到high为止
+ */
+typedef struct {
+  int low;
+  int high;
+} PacketWatermark;
+
+constexpr PacketWatermark VideoPacketWatermarkDefault = { 30, 60  };
+constexpr PacketWatermark AudioPacketWatermarkDefault = { 50, 100 };
+
+// 单次加载请求最多读取的数据包数量，参考PacketRequest::limit
+constexpr int LookAheadLimitDefault = 256;
+
+/*
+ @class SourceDriver
+ 按需驱动数据源的加载。每个流的缓存水位 = 解码器队列中的数据包数 + 已投递但解码器尚未收到的数据包数，
+ 某个流低于低水位时，为所有未达到高水位的流计算配额并向数据源发起加载请求。
+
+ @discussion
+ 水位的计算与加载请求都在SourceDriver自己的工作队列中进行，解码器的 "did_update_packets" 事件
+ 也直接投递到该队列（EventDeliveryQueue），不经过主线程。同一时间最多只有一个加载请求在进行中
+ */
 class SourceDriver : virtual public Object {
 public:
   SourceDriver(MediaSource *src);
   ~SourceDriver();
 
 public:
+  /*
+   @function addStream
+   添加需要驱动的流，需要在start之前调用。stop之后所有的流会被移除
+   */
+  void addStream(StreamId index, const StreamMeta& meta);
+
   void start();
   void stop();
-  
+
+  /*
+   @function reload
+   不区分流地加载count个数据包，不受水位控制。关键帧模式下用于按请求加载关键帧
+   */
+  void reload(int count);
+
+  /*
+   @function preload
+   按水位重新加载，在seek清空了链路上的缓存之后调用。关闭自动补充时不进行加载
+   */
+  void preload();
+
+  /*
+   @function setRefillEnabled
+   是否按水位自动加载。关键帧模式下数据的加载完全由关键帧请求驱动，需要关闭自动补充
+   */
+  void setRefillEnabled(bool enabled);
+
+  void setWatermark(MediaType type, const PacketWatermark& watermark);
+  void setLookAheadLimit(int limit);
+
 private:
+  typedef struct {
+    StreamId        index;
+    void           *streamObject;
+    MediaType       type;
+    PacketWatermark watermark;
+    int             queued;    // 解码器最近一次报告的队列长度
+    uint64_t        delivered; // 数据源累计投递的数据包数
+    uint64_t        received;  // 解码器累计收到的数据包数
+  } StreamFlow;
+
   static void onEventDidUpdatePackets(SourceDriver *self, const char *ename, void *sender, const EventParams& p);
 
+  // 以下方法只在q中调用
+  StreamFlow *findFlow(void *streamObject);
+  void evaluate();
+  void request(const PacketRequest& req, bool isRefill);
+  void didLoadPackets(const std::map<StreamId, int>& delivered, bool eof, bool isRefill);
+
 private:
-  MediaSource *source;
-  void        *eoDUP;
+  MediaSource   *source;
+  DispatchQueue *q;
+  void          *eoDUP;
+
+  // 以下状态只在q中访问
+  std::vector<StreamFlow> flows;
+  PacketWatermark         watermarks[2];
+  int                     lookAheadLimit;
+  bool                    running;
+  bool                    refillEnabled;
+  bool                    loading; // 按水位发起的加载请求尚未完成
+  bool                    eof;
+  uint64_t                generation; // 每次stop后递增，用于忽略之前发起的请求的结果
+  uint64_t                epoch;      // 每次preload、reload（seek）后递增，用于忽略之前发起的请求读到的结尾
 };
 
 }
@@ -27,6 +27,10 @@ public:
     lms::release(renderDriver);
   }
   
+  int prepare() override {
+    return decoder->prepare();
+  }
+  
   void start() override {
     if (resampler) {
       decoder->addReceiver(resampler);
@@ -51,6 +55,10 @@ public:
     }
   }
   
+  const StreamMeta& getMeta() const {
+    return meta;
+  }
+  
   void didReceivePipelineMessage(const PipelineMessage& msg) override {
     if (msg.at("stream_object").value.ptr == streamObject) {
       decoder->didReceivePipelineMessage(msg);
@@ -0,0 +1,140 @@
+//
+//  VideoFrameQueue.cpp
+//  lms
+//
+
+#include "VideoFrameQueue.h"
+#include "Logger.h"
+extern "C" {
+#include <libavutil/frame.h>
+#include <SDL2/SDL.h>
+}
+
+namespace lms {
+
+// 时间戳回退超过该时长（秒）时不再按时间戳插入，而是视为新的一段放在队尾
+constexpr double ReorderWindowSeconds = 1.0;
+
+VideoFrameQueue::VideoFrameQueue(int capacity, double timeBase) {
+  assert(capacity > 0);
+
+  this->ring.assign(capacity, nullptr);
+  this->head          = 0;
+  this->size          = 0;
+  this->reorderWindow = timeBase > 0 ? (int64_t)(ReorderWindowSeconds / timeBase) : 0;
+  this->spareMutex    = SDL_CreateMutex();
+
+  // 除队列中的帧之外，还有正在呈现的帧，多预留两个
+  for (int i = 0; i < capacity + 2; i += 1) {
+    spares.push_back(av_frame_alloc());
+  }
+}
+
+VideoFrameQueue::~VideoFrameQueue() {
+  clear();
+
+  for (auto f : spares) {
+    av_frame_free(&f);
+  }
+  SDL_DestroyMutex(spareMutex);
+}
+
+int VideoFrameQueue::capacity() const {
+  return (int)ring.size();
+}
+
+int VideoFrameQueue::count() const {
+  return size;
+}
+
+bool VideoFrameQueue::push(AVFrame *src) {
+  if (size == capacity()) {
+    return false;
+  }
+
+  AVFrame *frame = obtain();
+  av_frame_ref(frame, src);
+
+  // 解码器通常已按呈现顺序输出，多数情况下直接放在队尾，只有乱序的帧才需要向前移动
+  int64_t ts  = frame->best_effort_timestamp;
+  int     pos = size;
+  if (ts != AV_NOPTS_VALUE && size > 0) {
+    int64_t tail = ring[(head + size - 1) % capacity()]->best_effort_timestamp;
+    bool discontinuous = tail != AV_NOPTS_VALUE && tail - ts > reorderWindow;
+
+    while (!discontinuous && pos > 0) {
+      int64_t prev = ring[(head + pos - 1) % capacity()]->best_effort_timestamp;
+      if (prev == AV_NOPTS_VALUE || prev <= ts) {
+        break;
+      }
+
+      ring[(head + pos) % capacity()] = ring[(head + pos - 1) % capacity()];
+      pos -= 1;
+    }
+  }
+
+  ring[(head + pos) % capacity()] = frame;
+  size += 1;
+  return true;
+}
+
+AVFrame *VideoFrameQueue::at(int index) const {
+  if (index < 0 || index >= size) {
+    return nullptr;
+  }
+  return ring[(head + index) % capacity()];
+}
+
+AVFrame *VideoFrameQueue::pop() {
+  if (size == 0) {
+    return nullptr;
+  }
+
+  AVFrame *frame = ring[head];
+  ring[head] = nullptr;
+  head = (head + 1) % capacity();
+  size -= 1;
+  return frame;
+}
+
+void VideoFrameQueue::clear() {
+  while (size > 0) {
+    recycle(pop());
+  }
+  head = 0;
+}
+
+AVFrame *VideoFrameQueue::obtain() {
+  AVFrame *frame = nullptr;
+
+  SDL_LockMutex(spareMutex);
+  {
+    if (!spares.empty()) {
+      frame = spares.back();
+      spares.pop_back();
+    }
+  }
+  SDL_UnlockMutex(spareMutex);
+
+  // 呈现端积压时预留的AVFrame可能不够，此时再分配，之后同样会被回收复用
+  if (frame == nullptr) {
+    frame = av_frame_alloc();
+  }
+  return frame;
+}
+
+void VideoFrameQueue::recycle(AVFrame *frame) {
+  if (frame == nullptr) {
+    return;
+  }
+
+  av_frame_unref(frame);
+
+  SDL_LockMutex(spareMutex);
+  {
+    spares.push_back(frame);
+  }
+  SDL_UnlockMutex(spareMutex);
+}
+
+}
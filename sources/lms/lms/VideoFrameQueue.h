@@ -0,0 +1,77 @@
+//
+//  VideoFrameQueue.h
+//  lms
+//
+
+#pragma once
+
+#include "Foundation.h"
+#include <vector>
+
+FWD_DECLARE_STRUCT(AVFrame);
+FWD_DECLARE_STRUCT(SDL_mutex);
+
+namespace lms {
+
+/*
+ @class VideoFrameQueue
+ 容量固定、按时间戳排序的视频帧队列，供渲染端预先缓存多帧，以便一次丢弃多个过期帧、或根据后续帧选择最合适的帧呈现。
+
+ @discussion
+ AVFrame在队列中循环使用：入队时以av_frame_ref引用解码出的帧数据，出队的帧用完后通过recycle放回，
+ 正常播放时不会为每一帧分配和释放AVFrame。
+ 除recycle之外的方法都不加锁，由调用者保证不会在多个线程中同时调用
+ */
+class VideoFrameQueue : virtual public Object {
+public:
+  /*
+   @param timeBase 帧时间戳的单位（秒），用于识别时间戳的回退
+   */
+  VideoFrameQueue(int capacity, double timeBase);
+  ~VideoFrameQueue();
+
+  int capacity() const;
+  int count() const;
+
+  /*
+   @function push
+   引用src的数据放入队列，按时间戳插入到合适的位置。时间戳比队尾早出许多（不连续）或没有时间戳时直接放在队尾。
+   队列已满时返回false，src不会被引用
+   */
+  bool push(AVFrame *src);
+
+  // 第index个（从0开始按时间戳递增）缓存的帧，不会从队列中移除
+  AVFrame *at(int index) const;
+
+  /*
+   @function pop
+   移除并返回最早的帧，队列为空时返回nullptr。使用完毕后需要调用recycle
+   */
+  AVFrame *pop();
+
+  // 丢弃所有缓存的帧
+  void clear();
+
+  /*
+   @function obtain
+   取得一个空的AVFrame，使用完毕后需要调用recycle
+   */
+  AVFrame *obtain();
+
+  /*
+   @function recycle
+   释放帧数据并将AVFrame放回队列以便复用，可以在任意线程中调用
+   */
+  void recycle(AVFrame *frame);
+
+private:
+  std::vector<AVFrame *> ring;
+  int     head;
+  int     size;
+  int64_t reorderWindow; // 允许按时间戳向前插入的最大距离，超过则认为是时间戳不连续
+
+  SDL_mutex              *spareMutex;
+  std::vector<AVFrame *>  spares;
+};
+
+}
@@ -6,150 +6,501 @@
 //
 
 #include "VideoRenderDriver.h"
+#include "VideoFrameQueue.h"
 #include "Cell.h"
 #include "TimeSync.h"
 #include "Runtime.h"
 #include "Events.h"
 #include "Logger.h"
+#include "Metrics.h"
+#include "Decoder.h"
 extern "C" {
 #include <libavformat/avformat.h>
+#include <libavutil/time.h>
 #include <SDL2/SDL.h>
 }
+#include <algorithm>
+#include <cmath>
 
 namespace lms {
 
+// 解码降级控制的评估周期（毫秒）
+constexpr uint32_t SkipWindowMS = 1000;
+
+// 一个评估周期内的丢帧率超过该值时，提升一级解码降级等级
+constexpr double SkipRaiseDropRate = 0.1;
+
+// 连续多个周期没有丢帧时才降低一级。如果降级恢复后很快又再次丢帧，说明仍处于临界负载，
+// 此时加倍所需的周期数，避免在两个等级之间来回抖动
+constexpr int SkipRecoverWindowsMin = 3;
+constexpr int SkipRecoverWindowsMax = 48;
+
+// 流中没有帧率信息时使用的默认帧率
+constexpr double DefaultFPS = 25.0;
+
+// 相邻两帧的时间戳回退，或向前跳过超过该时长（秒），认为是时间戳不连续
+constexpr double DiscontinuityThreshold = 1.0;
+
+// 应播时间在该时长（秒）之内即立即呈现，不再休眠
+constexpr double PresentAheadTolerance = 0.001;
+
+// 单次休眠的上限（秒）。播放时钟可能被音频输出调整，需要定期重新评估
+constexpr double MaxScheduleWait = 0.1;
+
+// 播放时钟尚未开始时的轮询间隔（秒）
+constexpr double ClockPendingWait = 0.01;
+
 VideoRenderDriver::VideoRenderDriver(AVStream *stream, Cell *videoRender, TimeSync *timeSync) {
-  this->stream     = stream;
-  this->render     = lms::retain(videoRender);
-  this->timeSync   = lms::retain(timeSync);
-  this->frameMutex = SDL_CreateMutex();
-  this->nextFrame  = nullptr;
+  this->stream       = stream;
+  this->render       = lms::retain(videoRender);
+  this->timeSync     = lms::retain(timeSync);
+  this->presentTimer = nullptr;
+  this->frameMutex   = SDL_CreateMutex();
+  this->frames       = nullptr;
+  this->queueDepth   = FrameQueueDepthDefault;
+  this->serial       = 0;
+  this->seekRequestTime = 0;
+  this->keyframeOnly    = false;
+  this->scheduleExpired = false;
 }
 
 VideoRenderDriver::~VideoRenderDriver() {
+  lms::release(frames);
   SDL_DestroyMutex(frameMutex);
   lms::release(render);
   lms::release(timeSync);
 }
 
+void VideoRenderDriver::setFrameQueueDepth(int depth) {
+  queueDepth = std::max(depth, 1);
+}
+
 void VideoRenderDriver::start() {
   assert(isHostThread());
   
   q = createDispatchQueue("LMS_VRDriver", QueueTypeHost);
-  nextFrame = nullptr;
+  firstFramePresented = false;
+  
+  // 正在呈现的帧会在回收时引用队列，因此队列直到析构时才释放
+  if (frames == nullptr) {
+    frames = new VideoFrameQueue(queueDepth, av_q2d(stream->time_base));
+  }
+  
+  skipLevel       = DecodeSkipNone;
+  skipWindowBegin = SDL_GetTicks();
+  windowPresented = 0;
+  windowDropped   = 0;
+  cleanWindows    = 0;
+  recoverWindows  = SkipRecoverWindowsMin;
+  sinceRestore    = -1;
 
   render->start();
   
+  eoDecodeMode = addEventObserver("update_decode_mode", nullptr, this, (EventCallback)onEventUpdateDecodeMode);
+  
+  // 帧率只作为无法从时间戳推算帧间隔时的后备。快速启动时帧率可能尚未探测出来（0/0），此时退而使用r_frame_rate或常见的25fps
   double fps = av_q2d(stream->avg_frame_rate);
-  double spf = 1.0 / fps; // second per frame, also timer interval
+  if (!(fps > 0)) {
+    fps = av_q2d(stream->r_frame_rate) > 0 ? av_q2d(stream->r_frame_rate) : DefaultFPS;
+    LMSLogWarning("Frame rate unknown, fallback to %.2lffps", fps);
+  }
+  nominalDuration = 1.0 / fps;
+  resetSchedule();
+  
+  SDL_LockMutex(frameMutex);
+  {
+    presentTimer = scheduleDeadlineTimer("LMS_VRDriver", [this] {
+      assert(!isHostThread());
+      return schedulePresentation();
+    });
+  }
+  SDL_UnlockMutex(frameMutex);
+}
+
+void VideoRenderDriver::resetSchedule() {
+  primed           = false;
+  hasLastFrame     = false;
+  lastFrameTime    = 0;
+  lastDuration     = nominalDuration;
+  lastPresentTime  = 0;
+  freeRunning      = false;
+  hasPresentError  = false;
+  lastPresentError = 0;
+}
+
+/*
+ @function schedulePresentation
+ 处理已到应播时间的帧（呈现或丢弃），返回距离下一次需要处理的时间（秒），小于0表示等待新的帧到达
+ */
+double VideoRenderDriver::schedulePresentation() {
+  if (scheduleExpired.exchange(false)) {
+    resetSchedule();
+  }
   
-  fpsTimer = scheduleTimer("LMS_VRDriver", spf, [this, spf] {
-    assert(!isHostThread());
+  // 关键帧模式下帧一到达就立即渲染，不跟随播放时钟
+  if (keyframeOnly) {
+    return -1;
+  }
 
-    double playingTime = timeSync->getPlayingTime();
-    if (playingTime < 0) {
-      return;
+  double playingTime = timeSync->getPlayingTime();
+  if (playingTime < 0) {
+    return ClockPendingWait;
+  }
+  
+  int64_t  now     = av_gettime_relative();
+  AVFrame *present = nullptr;
+  int      dropped = 0;
+  int      queued  = 0;
+  double   wait    = lastDuration;
+  
+  // 队列中的帧可能被flush回收，判断过程需要持有锁，呈现与请求解码放在锁外进行
+  SDL_LockMutex(frameMutex);
+  while(true) {
+    AVFrame *frame = frames->at(0);
+    
+    // 新的帧到达时会唤醒渲染线程，这里的等待只是解码器没有数据时再次请求解码的间隔
+    if (frame == nullptr) {
+      break;
     }
     
-    AVFrame *frame;
+    AVFrame *following = frames->at(1);
+    double frameTime = framePresentationTime(frame, playingTime);
+    double duration  = frameDuration(frame, frameTime, following);
     
-    EventParams loadingParams = {
-      {"stream_object", this->stream}
-    };
+    if (hasLastFrame && (frameTime < lastFrameTime || frameTime - lastFrameTime > DiscontinuityThreshold) && !freeRunning) {
+      LMSLogWarning("Video timestamp discontinuity: %.3lf -> %.3lf", lastFrameTime, frameTime);
+      metricsAdd("video.present.discontinuities");
+      freeRunning = true;
+    }
+
+    // deviation > 0 表示当前视频帧的应播时间大于当前播放时间（待播帧）
+    // deviation < 0 表示当前视频帧的应播时间小于当前播放时间（迟滞帧），超过半个帧间隔则认为是过期帧
+    double deviation = frameTime - playingTime;
     
-    while(true) {
-      frame = nullptr;
-      SDL_LockMutex(frameMutex);
-      {
-        if (nextFrame) {
-          frame = nextFrame;
-          nextFrame = nullptr;
-        }
-      }
-      SDL_UnlockMutex(frameMutex);
-      
-      if (frame == nullptr) {
-        lms::fireEvent("decode_frame", this, loadingParams);
-        LMSLogWarning("No video frame!");
-        return;
-      }
-      
-      double frameTime = frame->best_effort_timestamp * av_q2d(stream->time_base);
-
-      // deviation > 0 表示当前视频帧的应播时间大于当前播放时间（待播帧）
-      // deviation < 0 表示当前视频帧的应播时间小于当前播放时间（迟滞帧），超过一定时间（tollerance）则认为是过期帧
-      double deviation = frameTime - playingTime;
-
-      LMSLogVerbose("Video frame popped | pts:%lld, ftime:%.2lf, ptime:%.2lf, dev:%.3lf(%.2lf frames)",
-                    frame->pts, frameTime, playingTime, deviation, deviation / spf);
-
-      double tollerance = spf / 2.0;
-      if (deviation < -tollerance) {
-        // 丢弃过期帧，继续下一帧（如果有）的处理
-        LMSLogWarning("Video frame dropped");
-        av_frame_unref(frame);
-
-        lms::fireEvent("decode_frame", this, loadingParams);
-        continue;
-      } else
-      if (deviation > tollerance) {
-        SDL_LockMutex(frameMutex);
-        {
-          nextFrame = frame;
-        }
-        SDL_UnlockMutex(frameMutex);
-
-        // 如果队列头的帧都未到播放时间，应认为后续帧也肯定未到播放时间，所以应直接退出渲染流程
-        LMSLogWarning("Video frame refilled");
-
-        frame = nullptr;
-        return;
+    if (freeRunning) {
+      if (std::fabs(deviation) <= DiscontinuityThreshold) {
+        LMSLogInfo("Video timestamps resynced with clock, deviation=%.3lf", deviation);
+        freeRunning = false;
       } else {
-        lms::fireEvent("decode_frame", this, loadingParams);
-        break;
+        // 播放时钟跟上之前，以上一帧的实际呈现时间加上其帧间隔作为应播时间
+        deviation = lastPresentTime > 0 ? (lastPresentTime - now) / 1e6 + lastDuration : 0;
       }
     }
+
+    // 后续的帧也已到应播时间，当前帧即使呈现也会立即被取代
+    bool superseded = false;
+    if (following && !freeRunning) {
+      double followingTime = following->best_effort_timestamp != AV_NOPTS_VALUE ?
+                             following->best_effort_timestamp * av_q2d(stream->time_base) : frameTime + duration;
+      superseded = followingTime >= frameTime && followingTime - playingTime <= PresentAheadTolerance;
+    }
+
+    LMSLogVerbose("Video frame popped | pts:%lld, ftime:%.3lf, ptime:%.3lf, dev:%.3lf, dur:%.3lf, queued:%d",
+                  frame->pts, frameTime, playingTime, deviation, duration, frames->count());
+
+    if (superseded || deviation < -duration / 2.0) {
+      // 丢弃过期帧，继续下一帧（如果有）的处理
+      frames->recycle(frames->pop());
+      dropped += 1;
+      
+      hasLastFrame  = true;
+      lastFrameTime = frameTime;
+      lastDuration  = duration;
+      continue;
+    }
     
-    assert(frame != nullptr);
+    if (deviation > PresentAheadTolerance) {
+      // 休眠到该帧的应播时间
+      wait = std::min(deviation, MaxScheduleWait);
+      break;
+    }
+    
+    present = frames->pop();
+    trackPresentError(-deviation);
     
-    if (render) {
-      std::shared_ptr<AVFrame> guard(frame, [] (AVFrame *frm) { av_frame_unref(frm); });
-      async(q, "DeliverFrame", [this, frame, guard] {
-        PipelineMessage msg;
-        msg["type"]  = "media_frame";
-        msg["frame"] = frame;
-        render->didReceivePipelineMessage(msg);
-      });
+    hasLastFrame    = true;
+    lastFrameTime   = frameTime;
+    lastDuration    = duration;
+    lastPresentTime = now;
+    
+    // 还有缓存的帧时立即计算其应播时间
+    wait = frames->count() > 0 ? 0 : duration;
+    break;
+  }
+  queued = frames->count();
+  SDL_UnlockMutex(frameMutex);
+  
+  for (int i = 0; i < dropped; i += 1) {
+    LMSLogWarning("Video frame dropped");
+    trackFrameOutcome(true);
+  }
+  
+  // 每消耗一帧请求解码一帧；队列为空时，首次请求填满整个队列，之后每次只请求一帧
+  int requests = dropped + (present ? 1 : 0);
+  if (queued == 0 && requests == 0) {
+    LMSLogWarning("No video frame!");
+    requests = primed ? 1 : frames->capacity();
+    primed   = true;
+  }
+  
+  if (requests > 0) {
+    lms::fireEvent("decode_frame", stream, {
+      {"stream_object", this->stream},
+      {"count"        , requests},
+    });
+  }
+  
+  if (present) {
+    metricsObserve("video.frame_queue.depth", queued);
+    trackFrameOutcome(false);
+    presentFrame(present);
+  }
+  
+  return wait;
+}
+
+double VideoRenderDriver::framePresentationTime(AVFrame *frame, double playingTime) {
+  if (frame->best_effort_timestamp != AV_NOPTS_VALUE) {
+    return frame->best_effort_timestamp * av_q2d(stream->time_base);
+  }
+  
+  // 没有时间戳的帧紧接上一帧呈现
+  return hasLastFrame ? lastFrameTime + lastDuration : playingTime;
+}
+
+// 优先使用帧自身的时长，其次是与后一帧或上一帧的时间戳之差，都不可用时沿用上一帧的帧间隔
+double VideoRenderDriver::frameDuration(AVFrame *frame, double frameTime, AVFrame *following) {
+  if (frame->pkt_duration > 0) {
+    return frame->pkt_duration * av_q2d(stream->time_base);
+  }
+  
+  if (following && following->best_effort_timestamp != AV_NOPTS_VALUE) {
+    double delta = following->best_effort_timestamp * av_q2d(stream->time_base) - frameTime;
+    if (delta > 0 && delta <= DiscontinuityThreshold) {
+      return delta;
     }
+  }
+  
+  double delta = frameTime - lastFrameTime;
+  if (hasLastFrame && delta > 0 && delta <= DiscontinuityThreshold) {
+    return delta;
+  }
+  
+  return lastDuration;
+}
 
+// error为实际呈现时间与应播时间之差（秒），大于0表示晚于应播时间
+void VideoRenderDriver::trackPresentError(double error) {
+  metricsObserve("video.present.error_ms", error * 1000.0);
+  
+  if (hasPresentError) {
+    metricsObserve("video.present.jitter_ms", std::fabs(error - lastPresentError) * 1000.0);
+  }
+  
+  hasPresentError  = true;
+  lastPresentError = error;
+}
+
+void VideoRenderDriver::presentFrame(AVFrame *frame) {
+  if (render == nullptr) {
+    frames->recycle(frame);
+    return;
+  }
+  
+  if (!firstFramePresented.exchange(true)) {
+    lms::fireEvent("did_reach_milestone", this, {
+      { "stream_object", stream },
+      { "milestone"    , "first_present" },
+      { "time"         , (int64_t)av_gettime_relative() },
+    });
+  }
+  
+  // 统计从发起seek到呈现首帧的耗时
+  int64_t requestTime = seekRequestTime.exchange(0);
+  if (requestTime > 0) {
+    double ms = (av_gettime_relative() - requestTime) / 1000.0;
+    metricsObserve("player.seek.first_frame_ms", ms);
+    LMSLogInfo("First frame after seek: cost=%.2lfms", ms);
+  }
+  
+  // 渲染完成后帧放回队列复用
+  VideoFrameQueue *queue = lms::retain(frames);
+  std::shared_ptr<AVFrame> guard(frame, [queue] (AVFrame *frm) {
+    queue->recycle(frm);
+    lms::release(queue);
   });
+  async(q, "DeliverFrame", [this, frame, guard] {
+    PipelineMessage msg;
+    msg["type"]  = "media_frame";
+    msg["frame"] = frame;
+    render->didReceivePipelineMessage(msg);
+  });
+}
+
+void VideoRenderDriver::onEventUpdateDecodeMode(VideoRenderDriver *self, const char *evtName, void *sender, const EventParams& p) {
+  if (variantsGetPointer(p, "stream_object") != self->stream) {
+    return;
+  }
+  
+  self->keyframeOnly = variantsGetBool(p, "keyframe_only");
+  
+  // 退出关键帧模式时渲染线程可能处于无限等待中
+  SDL_LockMutex(self->frameMutex);
+  {
+    wakeTimer(self->presentTimer);
+  }
+  SDL_UnlockMutex(self->frameMutex);
 }
 
 void VideoRenderDriver::stop() {
   assert(isHostThread());
 
-  invalidateTimer(fpsTimer);
-  lms::release(fpsTimer);
+  // 解码线程通过presentTimer唤醒渲染线程，先在锁内置空，之后再等待渲染线程结束
+  Timer *timer;
+  SDL_LockMutex(frameMutex);
+  {
+    timer = presentTimer;
+    presentTimer = nullptr;
+  }
+  SDL_UnlockMutex(frameMutex);
+  
+  invalidateTimer(timer);
+  lms::release(timer);
+  
+  removeEventObserver(eoDecodeMode);
+  eoDecodeMode = nullptr;
   
   render->stop();
   
-  // TODO: 释放缓存帧
-  nextFrame = nullptr;
+  SDL_LockMutex(frameMutex);
+  {
+    frames->clear();
+  }
+  SDL_UnlockMutex(frameMutex);
   
   lms:release(q);
   q= nullptr;
 }
 
+void VideoRenderDriver::trackFrameOutcome(bool dropped) {
+  if (dropped) {
+    windowDropped += 1;
+    metricsAdd("video.frames.dropped");
+  } else {
+    windowPresented += 1;
+    metricsAdd("video.frames.presented");
+  }
+  
+  uint32_t now = SDL_GetTicks();
+  if (now - skipWindowBegin < SkipWindowMS) {
+    return;
+  }
+  
+  int total = windowDropped + windowPresented;
+  double dropRate = total > 0 ? (double)windowDropped / total : 0.0;
+  metricsObserve("video.frames.drop_rate", dropRate);
+
+  if (sinceRestore >= 0) {
+    sinceRestore += 1;
+  }
+
+  int level = skipLevel;
+  if (dropRate > SkipRaiseDropRate) {
+    // 降低一级之后不到recoverWindows个周期就再次丢帧，说明恢复得过早。
+    // 首次提升、以及持续过载中的逐级提升都不属于这种情况
+    if (sinceRestore >= 0 && sinceRestore <= recoverWindows && level < DecodeSkipNonKey) {
+      recoverWindows = std::min(recoverWindows * 2, SkipRecoverWindowsMax);
+    }
+    
+    level = std::min(level + 1, (int)DecodeSkipNonKey);
+    cleanWindows = 0;
+  } else if (windowDropped == 0) {
+    cleanWindows += 1;
+    if (level > DecodeSkipNone && cleanWindows >= recoverWindows) {
+      level -= 1;
+      cleanWindows = 0;
+    }
+    
+    // 已经恢复完整解码，且长期稳定，则重置恢复所需的周期数
+    if (level == DecodeSkipNone && cleanWindows >= SkipRecoverWindowsMax) {
+      recoverWindows = SkipRecoverWindowsMin;
+    }
+  } else {
+    cleanWindows = 0;
+  }
+  
+  skipWindowBegin = now;
+  windowDropped   = 0;
+  windowPresented = 0;
+
+  if (level == skipLevel) {
+    return;
+  }
+  
+  LMSLogInfo("Decode skip level changed: %d -> %d, drop_rate=%.2lf, recover_windows=%d",
+             skipLevel, level, dropRate, recoverWindows);
+
+  sinceRestore = level > skipLevel ? -1 : 0;
+
+  metricsAdd(level > skipLevel ? "video.decode_skip.raised" : "video.decode_skip.restored");
+  metricsObserve("video.decode_skip.level", level);
+  skipLevel = level;
+
+  lms::fireEvent("update_decode_skip", stream, {
+    {"stream_object", stream},
+    {"level"        , (uint64_t)level},
+  });
+}
+
 void VideoRenderDriver::didReceivePipelineMessage(const PipelineMessage& msg) {
+  const char *type = variantsGetCString(msg, "type", "");
+  uint64_t msgSerial = variantsGetUInt(msg, "serial");
+  
+  if (strcmp(type, "flush") == 0) {
+    SDL_LockMutex(frameMutex);
+    {
+      frames->clear();
+      serial = msgSerial;
+      
+      scheduleExpired = true;
+      wakeTimer(presentTimer);
+    }
+    SDL_UnlockMutex(frameMutex);
+    
+    seekRequestTime = variantsGetInt(msg, "request_time");
+    return;
+  }
+  
+  // flush之前解码出的旧帧直接丢弃
+  if (msgSerial != serial) {
+    return;
+  }
+  
   auto avfrm = (AVFrame *)msg.at("frame").value.ptr;
   
+  if (keyframeOnly) {
+    AVFrame *frame = frames->obtain();
+    av_frame_ref(frame, avfrm);
+    presentFrame(frame);
+    return;
+  }
+  
+  // 入队之前通知渲染端，使格式转换等准备工作可以在其他线程中提前进行，在应播时间之前完成
+  PipelineMessage prepareMsg;
+  prepareMsg["type"]  = "prepare_frame";
+  prepareMsg["frame"] = avfrm;
+  render->didReceivePipelineMessage(prepareMsg);
+  
   SDL_LockMutex(frameMutex);
   {
-    if (nextFrame) {
-      av_frame_free(&nextFrame);
+    // 渲染端按消耗的帧数请求解码，正常情况下不会超出队列容量
+    if (!frames->push(avfrm)) {
+      LMSLogWarning("Video frame queue full, frame discarded");
+      metricsAdd("video.frame_queue.overflow");
     }
-
-    nextFrame = av_frame_clone(avfrm);
+    
+    // 渲染线程可能正在等待新的帧，唤醒后按该帧的应播时间重新调度
+    wakeTimer(presentTimer);
   }
   SDL_UnlockMutex(frameMutex);
 }
@@ -7,6 +7,7 @@
 
 #pragma once
 #include "Cell.h"
+#include "Events.h"
 
 FWD_DECLARE_STRUCT(AVStream);
 FWD_DECLARE_STRUCT(AVFrame);
@@ -17,27 +18,88 @@ namespace lms {
 class TimeSync;
 class Timer;
 class DispatchQueue;
+class VideoFrameQueue;
 
+// 默认缓存的已解码视频帧数量
+constexpr int FrameQueueDepthDefault = 4;
+
+/*
+ @class VideoRenderDriver
+ 按播放时钟呈现视频帧。呈现时间由每一帧的pts与播放时钟计算，渲染线程休眠到下一帧的应播时间再醒来，
+ 新的帧到达时也会被唤醒，不依赖固定的帧率，可以正确处理可变帧率的内容。
+
+ @discussion
+ 相邻两帧的时间戳出现跳变（回退或向前跳过超过一定时长）时，在播放时钟跟上之前按帧间隔连续呈现。
+ 每一帧的呈现误差与抖动记录在指标 "video.present.error_ms"、"video.present.jitter_ms" 中。
+ 解码出的帧按时间戳缓存在有界的队列中，呈现时可以参考后续的帧：已被后续帧取代的过期帧一次性丢弃，
+ 后续帧的时间戳同时给出当前帧的实际时长。
+ 帧在入队时先以 "prepare_frame" 消息交给渲染端，渲染端可以借此在其他线程中提前完成格式转换，呈现时再以 "media_frame" 消息送出
+ */
 class VideoRenderDriver : public Cell {
 public:
   VideoRenderDriver(AVStream *stream, Cell *videoRender, TimeSync *timeSync);
   ~VideoRenderDriver();
   
 public:
+  /*
+   @function setFrameQueueDepth
+   设置缓存的已解码帧数量，需要在start之前调用，默认为FrameQueueDepthDefault
+   */
+  void setFrameQueueDepth(int depth);
+  
   void start() override;
   void stop() override;
   void didReceivePipelineMessage(const PipelineMessage& msg) override;
  
+private:
+  double schedulePresentation();
+  void   resetSchedule();
+  double framePresentationTime(AVFrame *frame, double playingTime);
+  double frameDuration(AVFrame *frame, double frameTime, AVFrame *following);
+  void   trackPresentError(double error);
+  void   presentFrame(AVFrame *frame);
+  void   trackFrameOutcome(bool dropped);
+  
+  static void onEventUpdateDecodeMode(VideoRenderDriver *self, const char *evtName, void *sender, const EventParams& p);
+  
 private:
   AVStream *stream;
   Cell     *render;
-  Timer    *fpsTimer;
+  Timer    *presentTimer;
   TimeSync *timeSync;
   
-  SDL_mutex *frameMutex;
-  AVFrame   *nextFrame;
+  SDL_mutex       *frameMutex;
+  VideoFrameQueue *frames;     // 由frameMutex保护
+  int              queueDepth;
+  uint64_t         serial;
+  std::atomic<bool>    firstFramePresented;
+  std::atomic<int64_t> seekRequestTime; // 尚未呈现首帧的seek请求时间（av_gettime_relative），0表示没有
+  
+  std::atomic<bool> keyframeOnly;
+  std::atomic<bool> scheduleExpired; // flush之后需要重置呈现调度的状态
+  void             *eoDecodeMode;  // event observer: "update_decode_mode"
   
   DispatchQueue *q;
+  
+  // 呈现调度的状态，仅在渲染定时器线程中访问
+  double  nominalDuration;  // 由流的帧率得出的帧间隔，只在无法从时间戳推算时使用
+  bool    primed;           // 是否已为填满队列请求过解码
+  bool    hasLastFrame;
+  double  lastFrameTime;
+  double  lastDuration;
+  int64_t lastPresentTime;  // 上一帧实际呈现的时间（av_gettime_relative），0表示没有
+  bool    freeRunning;      // 时间戳跳变后按帧间隔呈现，直到播放时钟跟上
+  bool    hasPresentError;
+  double  lastPresentError;
+  
+  // 根据丢帧率进行解码降级的闭环控制状态，仅在渲染定时器线程中访问
+  int      skipLevel;
+  uint32_t skipWindowBegin;
+  int      windowPresented;
+  int      windowDropped;
+  int      cleanWindows;
+  int      recoverWindows;
+  int      sinceRestore;   // 上一次等级变化是降低时，之后经过的周期数；上一次是提升（或尚未变化）时为-1
 };
 
 }